@@ -0,0 +1,197 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "benchmark.h"
+
+#include <QDateTime>
+#include <QTextStream>
+
+#include <algorithm>
+#include <cmath>
+
+namespace {
+
+/// Tolerated clock difference between the benchmark and QMQTT2SQL when selecting the rows of a run.
+constexpr qint64 clockSlackMs = 60000;
+
+qint64 percentile(std::vector<qint64> values, double p)
+{
+    if (values.empty())
+    {
+        return -1;
+    }
+    const std::size_t index = std::min(values.size() - 1, static_cast<std::size_t>(std::ceil(p * values.size())) - 1);
+    std::nth_element(values.begin(), values.begin() + static_cast<std::ptrdiff_t>(index), values.end());
+    return values[index];
+}
+
+QString perMessage(double before, double after, qint64 messages, int precision)
+{
+    if (before < 0 || after < 0 || messages <= 0)
+    {
+        return "n/a";
+    }
+    return QString::number((after - before) / messages, 'f', precision);
+}
+
+} // namespace
+
+/**
+ * @brief Connect \p client to the broker of \p config, with TLS if configured.
+ */
+void connectMqttClient(QMqttClient & client, const Mqtt2SqlConfig & config)
+{
+    client.setProtocolVersion(config.mqttVersion());
+    client.setHostname(config.mqttHostname());
+    client.setPort(config.mqttPort());
+    if (!config.mqttUsername().isEmpty() && !config.mqttPassword().isEmpty())
+    {
+        client.setUsername(config.mqttUsername());
+        client.setPassword(config.mqttPassword());
+    }
+    if (config.mqttUseTls())
+    {
+        QSslConfiguration sslconfig;
+        sslconfig.setProtocol(QSsl::TlsV1_2);
+        sslconfig.setPeerVerifyMode(QSslSocket::VerifyNone);
+        client.connectToHostEncrypted(sslconfig);
+    }
+    else
+    {
+        client.connectToHost();
+    }
+}
+
+Benchmark::Benchmark(const Mqtt2SqlConfig & config, const Options & options, QObject *parent)
+    : QObject{parent}
+    , m_config(config)
+    , m_options(options)
+    , m_prefix(QString("%1/%2").arg(options.prefix).arg(QDateTime::currentMSecsSinceEpoch()))
+    , m_probe(config)
+    , m_generator(m_client, m_prefix, options.qos)
+{
+    if (options.replay.isEmpty())
+    {
+        m_generator.setSynthetic(options.count, options.topics, options.zipfExponent, options.payloadSize);
+        m_generator.setRate(options.rate);
+    }
+    else
+    {
+        m_generator.setReplay(options.replay, options.speed);
+    }
+    connect(&m_client, &QMqttClient::connected, this, &Benchmark::onConnected);
+    connect(&m_client, &QMqttClient::errorChanged, this, [this](QMqttClient::ClientError error) {
+        if (error != QMqttClient::NoError)
+        {
+            QTextStream(stderr) << "Error: MQTT client error " << error << Qt::endl;
+            emit finished(3);
+        }
+    });
+    connect(&m_generator, &LoadGenerator::finished, this, &Benchmark::onPublished);
+    m_pollTimer.setInterval(options.pollInterval);
+    connect(&m_pollTimer, &QTimer::timeout, this, &Benchmark::poll);
+}
+
+bool Benchmark::start(QString & error)
+{
+    if (!m_probe.open(error))
+    {
+        return false;
+    }
+    connectMqttClient(m_client, m_config);
+    return true;
+}
+
+void Benchmark::onConnected()
+{
+    if (m_running)
+    {
+        return;
+    }
+    m_running = true;
+    QTextStream(stdout) << "Publishing " << m_generator.total() << " messages to " << m_prefix << "/..." << Qt::endl;
+    m_before = m_probe.snapshot();
+    m_startMs = QDateTime::currentMSecsSinceEpoch();
+    m_lastCommitMs = m_startMs;
+    m_latencies.reserve(static_cast<std::size_t>(m_generator.total()));
+    m_generator.start();
+    m_pollTimer.start();
+}
+
+void Benchmark::onPublished()
+{
+    m_publishedMs = QDateTime::currentMSecsSinceEpoch();
+}
+
+/**
+ * @brief Count the committed messages and assign the poll time as commit time to the newly committed ones.
+ */
+void Benchmark::poll()
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    const qint64 committed = m_probe.committedMessages(m_prefix, m_startMs - clockSlackMs);
+    if (committed < 0)
+    {
+        QTextStream(stderr) << "Error: can not count the committed messages" << Qt::endl;
+        return;
+    }
+    const std::vector<qint64> & sendTimes = m_generator.sendTimes();
+    while (static_cast<qint64>(m_latencies.size()) < committed && m_latencies.size() < sendTimes.size())
+    {
+        m_latencies.push_back(now - sendTimes[m_latencies.size()]);
+    }
+    if (committed > m_committed)
+    {
+        m_committed = committed;
+        m_lastCommitMs = now;
+    }
+    if (m_publishedMs == 0)
+    {
+        return;
+    }
+    if (m_committed >= m_generator.published() || now - m_lastCommitMs > m_options.timeout * 1000LL)
+    {
+        m_pollTimer.stop();
+        report();
+        m_client.disconnectFromHost();
+        emit finished(m_committed >= m_generator.published() ? 0 : 2);
+    }
+}
+
+void Benchmark::report()
+{
+    const IngestProbe::Snapshot after = m_probe.snapshot();
+    const int published = m_generator.published();
+    const double publishSeconds = qMax<qint64>(1, m_publishedMs - m_startMs) / 1000.0;
+    const double commitSeconds = qMax<qint64>(1, m_lastCommitMs - m_startMs) / 1000.0;
+    QTextStream out(stdout);
+    out << "Published:     " << published << " messages in " << publishSeconds << " s, "
+        << qRound64(published / publishSeconds) << " msg/s" << Qt::endl;
+    out << "Committed:     " << m_committed << " messages in " << commitSeconds << " s, "
+        << qRound64(m_committed / commitSeconds) << " msg/s" << Qt::endl;
+    if (m_committed < published)
+    {
+        out << "Missing:       " << published - m_committed << " messages after waiting " << m_options.timeout << " s" << Qt::endl;
+    }
+    out << "Latency:       p50 " << percentile(m_latencies, 0.5) << " ms, p99 " << percentile(m_latencies, 0.99)
+        << " ms, publish to commit, resolution " << m_options.pollInterval << " ms" << Qt::endl;
+    out << "WAL:           " << perMessage(m_before.walBytes, after.walBytes, m_committed, 1) << " bytes/msg" << Qt::endl;
+    out << "Transactions:  " << perMessage(m_before.commits, after.commits, m_committed, 4) << " per msg" << Qt::endl;
+    out << "Statements:    " << perMessage(m_before.statementMs, after.statementMs, m_committed, 4) << " ms/msg" << Qt::endl;
+}
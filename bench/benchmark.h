@@ -0,0 +1,93 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#include <QMqttClient>
+#include <QObject>
+#include <QTimer>
+
+#include <vector>
+
+#include "ingestprobe.h"
+#include "loadgenerator.h"
+#include "mqtt2sqlconfig.h"
+
+void connectMqttClient(QMqttClient & client, const Mqtt2SqlConfig & config);
+
+/**
+ * @brief Runs the \ref LoadGenerator against a running QMQTT2SQL and reports its ingest performance.
+ *
+ * The database is polled for the number of committed messages of the run; the n-th message
+ * counts as committed at the first poll seeing n messages, so the latency resolution is the poll
+ * interval and with several writers committing out of order the latencies are approximate.
+ */
+class Benchmark : public QObject
+{
+    Q_OBJECT
+public:
+    struct Options
+    {
+        int rate = 0;
+        int count = 100000;
+        int topics = 100;
+        double zipfExponent = 1;
+        int payloadSize = 64;
+        int qos = 0;
+        QString prefix = "qmqtt2sql-bench";
+        QVector<CapturedMessage> replay;
+        double speed = 1;
+        int pollInterval = 100;
+        int timeout = 30;
+    };
+
+    Benchmark(const Mqtt2SqlConfig & config, const Options & options, QObject *parent = nullptr);
+
+    bool start(QString & error);
+
+signals:
+    /// Is emitted when the run is complete, the exit code is 0 if all messages were committed.
+    void finished(int exitcode);
+
+private slots:
+    void onConnected();
+    void onPublished();
+    void poll();
+
+private:
+    void report();
+
+    Mqtt2SqlConfig m_config;
+    Options m_options;
+    QString m_prefix;
+    QMqttClient m_client {this};
+    IngestProbe m_probe;
+    LoadGenerator m_generator;
+    QTimer m_pollTimer {this};
+    IngestProbe::Snapshot m_before;
+    std::vector<qint64> m_latencies;
+    qint64 m_startMs = 0;
+    qint64 m_publishedMs = 0;
+    qint64 m_lastCommitMs = 0;
+    qint64 m_committed = 0;
+    bool m_running = false;
+};
+
+#endif // BENCHMARK_H
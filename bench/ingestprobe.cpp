@@ -0,0 +1,88 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "ingestprobe.h"
+
+#include <QDateTime>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QVariant>
+
+IngestProbe::IngestProbe(const Mqtt2SqlConfig & config)
+    : m_config(config)
+{
+}
+
+bool IngestProbe::open(QString & error)
+{
+    QSqlDatabase db = QSqlDatabase::addDatabase("QPSQL");
+    db.setHostName(m_config.sqlHostname());
+    db.setDatabaseName(m_config.sqlDatabase());
+    db.setPort(m_config.sqlPort());
+    db.setUserName(m_config.sqlUsername());
+    db.setPassword(m_config.sqlPassword());
+    if (!db.open())
+    {
+        error = "Error: can not open database: " + db.lastError().text();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Current WAL position, commit count and statement time, unavailable values are -1.
+ */
+IngestProbe::Snapshot IngestProbe::snapshot() const
+{
+    Snapshot snapshot;
+    QSqlQuery query;
+    if (query.exec("SELECT pg_wal_lsn_diff(pg_current_wal_lsn(), '0/0')::bigint;") && query.next())
+    {
+        snapshot.walBytes = query.value(0).toLongLong();
+    }
+    if (query.exec("SELECT xact_commit FROM pg_stat_database WHERE datname = current_database();") && query.next())
+    {
+        snapshot.commits = query.value(0).toLongLong();
+    }
+    if (query.exec("SELECT sum(total_exec_time) FROM pg_stat_statements "
+                   "WHERE dbid = (SELECT oid FROM pg_database WHERE datname = current_database());") && query.next())
+    {
+        snapshot.statementMs = query.value(0).toDouble();
+    }
+    return snapshot;
+}
+
+/**
+ * @brief Number of stored messages with a topic starting with \p prefix received after \p since (ms since epoch), -1 on errors.
+ */
+qint64 IngestProbe::committedMessages(const QString & prefix, qint64 since) const
+{
+    QSqlQuery query;
+    query.prepare(m_config.sqlNormalizeTopics()
+                  ? "SELECT count(*) FROM mqtt m JOIN topics t ON t.id = m.topic_id WHERE m.ts >= :since AND t.name LIKE :prefix;"
+                  : "SELECT count(*) FROM mqtt WHERE ts >= :since AND topic LIKE :prefix;");
+    query.bindValue(":since", QDateTime::fromMSecsSinceEpoch(since, Qt::UTC));
+    query.bindValue(":prefix", prefix + "/%");
+    if (!query.exec() || !query.next())
+    {
+        return -1;
+    }
+    return query.value(0).toLongLong();
+}
@@ -0,0 +1,57 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef INGESTPROBE_H
+#define INGESTPROBE_H
+
+#include <QString>
+
+#include "mqtt2sqlconfig.h"
+
+/**
+ * @brief Watches the database QMQTT2SQL writes to while a benchmark runs.
+ *
+ * Counts the committed messages of a benchmark run and takes snapshots of the WAL position,
+ * the committed transactions and, with pg_stat_statements installed, the statement execution
+ * time of the database. The snapshots are database wide, so other clients skew them.
+ */
+class IngestProbe
+{
+public:
+    struct Snapshot
+    {
+        /// WAL position in bytes, -1 if unknown.
+        qint64 walBytes = -1;
+        /// Committed transactions of the database, -1 if unknown.
+        qint64 commits = -1;
+        /// Execution time of all statements in milliseconds, -1 without pg_stat_statements.
+        double statementMs = -1;
+    };
+
+    explicit IngestProbe(const Mqtt2SqlConfig & config);
+
+    bool open(QString & error);
+    Snapshot snapshot() const;
+    qint64 committedMessages(const QString & prefix, qint64 since) const;
+
+private:
+    Mqtt2SqlConfig m_config;
+};
+
+#endif // INGESTPROBE_H
@@ -0,0 +1,160 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "loadgenerator.h"
+
+#include <QDateTime>
+
+#include <cmath>
+
+namespace {
+
+/// Number of messages published at once when there is no rate limit.
+constexpr int burstSize = 1000;
+/// Bytes waiting in the socket before publishing pauses, keeps memory bounded without rate limit.
+constexpr qint64 maxPendingBytes = 4 * 1024 * 1024;
+
+} // namespace
+
+LoadGenerator::LoadGenerator(QMqttClient & client, const QString & prefix, int qos, QObject *parent)
+    : QObject{parent}
+    , m_client(client)
+    , m_prefix(prefix)
+    , m_qos(static_cast<quint8>(qos))
+{
+    m_timer.setTimerType(Qt::PreciseTimer);
+    m_timer.setInterval(1);
+    connect(&m_timer, &QTimer::timeout, this, &LoadGenerator::publishDue);
+}
+
+/**
+ * @brief Publish \p count messages of \p payloadSize bytes to \p topics topics, the k-th topic is chosen with a weight of 1/k^zipfExponent.
+ */
+void LoadGenerator::setSynthetic(int count, int topics, double zipfExponent, int payloadSize)
+{
+    m_count = count;
+    m_payloadSize = payloadSize;
+    m_topics.clear();
+    std::vector<double> weights;
+    for (int i = 0; i < topics; ++i)
+    {
+        m_topics.append(QString("%1/sensor%2/value").arg(m_prefix).arg(i));
+        weights.push_back(1.0 / std::pow(i + 1, zipfExponent));
+    }
+    m_topicDistribution = std::discrete_distribution<int>(weights.begin(), weights.end());
+    m_replay.clear();
+}
+
+/**
+ * @brief Publish the captured \p messages, \p speed times faster than captured or as fast as possible with a speed of 0.
+ */
+void LoadGenerator::setReplay(const QVector<CapturedMessage> & messages, double speed)
+{
+    m_replay = messages;
+    m_speed = speed;
+}
+
+void LoadGenerator::start()
+{
+    m_sendTimes.clear();
+    m_sendTimes.reserve(static_cast<std::size_t>(total()));
+    m_elapsed.start();
+    m_timer.start();
+}
+
+/**
+ * @brief Number of messages that should have been published by now.
+ */
+int LoadGenerator::dueMessages() const
+{
+    const qint64 elapsed = m_elapsed.elapsed();
+    if (!m_replay.isEmpty())
+    {
+        if (m_speed <= 0)
+        {
+            return qMin(m_replay.size(), published() + burstSize);
+        }
+        int due = published();
+        while (due < m_replay.size() && m_replay.at(due).offset / m_speed <= elapsed)
+        {
+            ++due;
+        }
+        return due;
+    }
+    if (m_rate <= 0)
+    {
+        return qMin(m_count, published() + burstSize);
+    }
+    return static_cast<int>(qMin<qint64>(m_count, static_cast<qint64>(m_rate) * elapsed / 1000));
+}
+
+void LoadGenerator::publishDue()
+{
+    const int due = dueMessages();
+    while (published() < due)
+    {
+        if (m_client.transport() && m_client.transport()->bytesToWrite() > maxPendingBytes)
+        {
+            return;
+        }
+        if (!publishNext())
+        {
+            break;
+        }
+    }
+    if (published() >= total())
+    {
+        m_timer.stop();
+        emit finished();
+    }
+}
+
+/**
+ * @brief Publish the next message and remember its send time.
+ */
+bool LoadGenerator::publishNext()
+{
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    const int index = published();
+    QString topic;
+    QByteArray payload;
+    if (!m_replay.isEmpty())
+    {
+        const CapturedMessage & message = m_replay.at(index);
+        topic = m_prefix + '/' + message.topic;
+        payload = message.payload;
+    }
+    else
+    {
+        topic = m_topics.at(m_topicDistribution(m_random));
+        payload = "{\"seq\":" + QByteArray::number(index) + ",\"sent\":" + QByteArray::number(now)
+                + ",\"value\":" + QByteArray::number(std::uniform_real_distribution<double>(0, 100)(m_random)) + ",\"pad\":\"";
+        if (payload.size() + 2 < m_payloadSize)
+        {
+            payload.append(m_payloadSize - payload.size() - 2, 'x');
+        }
+        payload += "\"}";
+    }
+    if (m_client.publish(QMqttTopicName(topic), payload, m_qos) < 0)
+    {
+        return false;
+    }
+    m_sendTimes.push_back(now);
+    return true;
+}
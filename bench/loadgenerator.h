@@ -0,0 +1,86 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef LOADGENERATOR_H
+#define LOADGENERATOR_H
+
+#include <QElapsedTimer>
+#include <QMqttClient>
+#include <QObject>
+#include <QStringList>
+#include <QTimer>
+#include <QVector>
+
+#include <random>
+#include <vector>
+
+#include "trafficcapture.h"
+
+/**
+ * @brief Publishes synthetic or replayed messages to the MQTT broker at a fixed rate or as fast as possible.
+ *
+ * Synthetic messages are JSON objects padded to the configured size, their topics are drawn
+ * from a fixed set with a Zipf distribution. Replayed messages keep the relative timing of the
+ * capture, scaled by the speed. All topics get the prefix, so the messages of one run can be told
+ * apart in the database. The send time of every message is kept for the latency measurement.
+ */
+class LoadGenerator : public QObject
+{
+    Q_OBJECT
+public:
+    LoadGenerator(QMqttClient & client, const QString & prefix, int qos, QObject *parent = nullptr);
+
+    void setSynthetic(int count, int topics, double zipfExponent, int payloadSize);
+    void setReplay(const QVector<CapturedMessage> & messages, double speed);
+    /// Messages per second, 0 to publish as fast as the connection takes them. Ignored for replays.
+    void setRate(int rate) { m_rate = rate; }
+
+    void start();
+    int total() const { return m_replay.isEmpty() ? m_count : m_replay.size(); }
+    int published() const { return static_cast<int>(m_sendTimes.size()); }
+    /// Send time of every published message in milliseconds since the Unix epoch.
+    const std::vector<qint64> & sendTimes() const { return m_sendTimes; }
+
+signals:
+    void finished();
+
+private slots:
+    void publishDue();
+
+private:
+    int dueMessages() const;
+    bool publishNext();
+
+    QMqttClient & m_client;
+    QString m_prefix;
+    quint8 m_qos;
+    int m_rate = 0;
+    int m_count = 0;
+    int m_payloadSize = 0;
+    QStringList m_topics;
+    std::mt19937_64 m_random {42};
+    std::discrete_distribution<int> m_topicDistribution;
+    QVector<CapturedMessage> m_replay;
+    double m_speed = 1;
+    std::vector<qint64> m_sendTimes;
+    QElapsedTimer m_elapsed;
+    QTimer m_timer {this};
+};
+
+#endif // LOADGENERATOR_H
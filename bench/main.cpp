@@ -0,0 +1,125 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QCommandLineOption>
+#include <QTextStream>
+#include <QTimer>
+
+#include "benchmark.h"
+#include "mqtt2sqlconfig.h"
+#include "trafficcapture.h"
+
+static constexpr const char * applicationname = "qmqtt2sql-bench";
+static constexpr int configErrorExitCode = 1;
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+    a.setApplicationName(applicationname);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Publishes synthetic or captured MQTT traffic and measures how fast QMQTT2SQL stores it.\n"
+                                     "Uses the broker and database of the QMQTT2SQL config file, "
+                                     "QMQTT2SQL must subscribe to the topics below the prefix.");
+    parser.addHelpOption();
+    const Benchmark::Options defaults;
+    QCommandLineOption configOption({"c", "config"}, "Path to the QMQTT2SQL config file.", "config",
+                                    QString("%1/%2").arg(QCoreApplication::applicationDirPath(), "qmqtt2sql.ini"));
+    QCommandLineOption rateOption({"r", "rate"}, "Messages per second, 0 for as fast as possible.", "rate", QString::number(defaults.rate));
+    QCommandLineOption countOption({"n", "count"}, "Number of synthetic messages.", "count", QString::number(defaults.count));
+    QCommandLineOption topicsOption("topics", "Number of synthetic topics.", "topics", QString::number(defaults.topics));
+    QCommandLineOption zipfOption("zipf", "Zipf exponent of the topic distribution, 0 for uniform.", "exponent", QString::number(defaults.zipfExponent));
+    QCommandLineOption payloadOption("payload-size", "Size of the synthetic JSON payloads in bytes.", "bytes", QString::number(defaults.payloadSize));
+    QCommandLineOption qosOption("qos", "QoS of the published messages.", "qos", QString::number(defaults.qos));
+    QCommandLineOption prefixOption("prefix", "Topic prefix, every run adds its start time.", "prefix", defaults.prefix);
+    QCommandLineOption replayOption("replay", "Replay the messages of a capture file instead of synthetic ones.", "file");
+    QCommandLineOption speedOption("speed", "Replay speed relative to the capture, 0 for as fast as possible.", "factor", QString::number(defaults.speed));
+    QCommandLineOption captureOption("capture", "Record the messages of the configured topics to a capture file and exit.", "file");
+    QCommandLineOption durationOption("duration", "Duration of the capture in seconds.", "seconds", "60");
+    QCommandLineOption pollOption("poll", "Interval of counting the committed messages in milliseconds.", "ms", QString::number(defaults.pollInterval));
+    QCommandLineOption timeoutOption("timeout", "Seconds to wait for further commits after publishing.", "seconds", QString::number(defaults.timeout));
+    parser.addOptions({configOption, rateOption, countOption, topicsOption, zipfOption, payloadOption, qosOption, prefixOption,
+                       replayOption, speedOption, captureOption, durationOption, pollOption, timeoutOption});
+    parser.process(a);
+
+    const QString configFile = parser.value(configOption);
+    Mqtt2SqlConfig config;
+    if (!config.parse(configFile))
+    {
+        QTextStream(stdout) << "Error while reading config file: " << configFile << Qt::endl;
+        QTextStream(stdout) << config.lastError() << Qt::endl;
+        return configErrorExitCode;
+    }
+
+    if (parser.isSet(captureOption))
+    {
+        QMqttClient * client = new QMqttClient(&a);
+        TrafficCapture * capture = new TrafficCapture(*client, config.mqttTopics(), parser.value(captureOption), &a);
+        QObject::connect(client, &QMqttClient::connected, &a, [&a, client, capture, &parser, &durationOption]() {
+            QString error;
+            if (!capture->start(error))
+            {
+                QTextStream(stderr) << error << Qt::endl;
+                a.exit(configErrorExitCode);
+                return;
+            }
+            QTimer::singleShot(parser.value(durationOption).toInt() * 1000, &a, [&a, client, capture]() {
+                capture->stop();
+                client->disconnectFromHost();
+                QTextStream(stdout) << "Captured " << capture->captured() << " messages." << Qt::endl;
+                a.quit();
+            });
+        });
+        connectMqttClient(*client, config);
+        return a.exec();
+    }
+
+    Benchmark::Options options;
+    options.rate = parser.value(rateOption).toInt();
+    options.count = parser.value(countOption).toInt();
+    options.topics = qMax(1, parser.value(topicsOption).toInt());
+    options.zipfExponent = parser.value(zipfOption).toDouble();
+    options.payloadSize = parser.value(payloadOption).toInt();
+    options.qos = qBound(0, parser.value(qosOption).toInt(), 2);
+    options.prefix = parser.value(prefixOption);
+    options.speed = parser.value(speedOption).toDouble();
+    options.pollInterval = qMax(1, parser.value(pollOption).toInt());
+    options.timeout = parser.value(timeoutOption).toInt();
+    if (parser.isSet(replayOption))
+    {
+        QString error;
+        if (!TrafficCapture::read(parser.value(replayOption), options.replay, error))
+        {
+            QTextStream(stdout) << error << Qt::endl;
+            return configErrorExitCode;
+        }
+    }
+
+    Benchmark benchmark(config, options);
+    QObject::connect(&benchmark, &Benchmark::finished, &a, &QCoreApplication::exit);
+    QString error;
+    if (!benchmark.start(error))
+    {
+        QTextStream(stdout) << error << Qt::endl;
+        return configErrorExitCode;
+    }
+    return a.exec();
+}
@@ -0,0 +1,312 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <QFile>
+#include <QTemporaryDir>
+#include <QTest>
+
+#include <thread>
+
+#include "boundedqueue.h"
+#include "jsonvalidator.h"
+#include "mqtt2sqlconfig.h"
+#include "mqttrecord.h"
+#include "sink.h"
+#include "sqlwriter.h"
+#include "topicmatcher.h"
+#ifdef QMQTT2SQL_HAVE_LIBPQ
+#include "pqcopywriter.h"
+#endif
+
+namespace {
+
+/// Messages per benchmark iteration, the reported time divided by this is the time per message.
+constexpr int batchSize = 1000;
+
+QVector<MqttRecord> makeBatch(const QByteArray & payload)
+{
+    QVector<MqttRecord> batch;
+    for (int i = 0; i < batchSize; ++i)
+    {
+        MqttRecord record {1700000000000 + i, QString("home/room%1/sensor%2/temperature").arg(i % 20).arg(i % 7), payload};
+        record.topicId = i % 140;
+        double number = 0;
+        record.payloadType = classifyPayload(payload, number);
+        record.number = number;
+        batch.append(record);
+    }
+    return batch;
+}
+
+} // namespace
+
+/**
+ * @brief Microbenchmarks of the stages a message passes between the MQTT client and the database.
+ *
+ * Every iteration processes \ref batchSize messages. Run with -median 5 for stable numbers.
+ */
+class IngestStages : public QObject
+{
+    Q_OBJECT
+
+private slots:
+    void initTestCase();
+
+    void matchTopic_data();
+    void matchTopic();
+    void validateJson_data();
+    void validateJson();
+    void classifyPayload_data();
+    void classifyPayload();
+
+    void encodeInsert_data();
+    void encodeInsert();
+#ifdef QMQTT2SQL_HAVE_LIBPQ
+    void encodeCopyText_data() { encodeInsert_data(); }
+    void encodeCopyText();
+    void encodeCopyBinary_data() { encodeInsert_data(); }
+    void encodeCopyBinary();
+#endif
+
+    void queueSingleThread();
+    void queueProducerConsumer();
+
+private:
+    Mqtt2SqlConfig config(const QByteArray & psql);
+    void addPayloads();
+
+    QTemporaryDir m_dir;
+    int m_configs = 0;
+};
+
+void IngestStages::initTestCase()
+{
+    QVERIFY(m_dir.isValid());
+}
+
+/**
+ * @brief Config with the given lines of the psql group, the other settings keep their defaults.
+ */
+Mqtt2SqlConfig IngestStages::config(const QByteArray & psql)
+{
+    const QString path = m_dir.filePath(QString("config%1.ini").arg(m_configs++));
+    QFile file(path);
+    if (!file.open(QIODevice::WriteOnly) || file.write("[psql]\n" + psql) < 0)
+    {
+        qFatal("Can not write %s", qPrintable(path));
+    }
+    file.close();
+    Mqtt2SqlConfig config;
+    if (!config.parse(path))
+    {
+        qFatal("%s", qPrintable(config.lastError()));
+    }
+    return config;
+}
+
+void IngestStages::addPayloads()
+{
+    QTest::addColumn<QByteArray>("payload");
+    QTest::newRow("number") << QByteArray("21.5");
+    QTest::newRow("small object") << QByteArray(R"({"temperature":21.5,"humidity":48,"battery":97})");
+    QTest::newRow("nested object") << QByteArray(R"({"state":{"on":true,"bri":254,"xy":[0.4573,0.41]},"name":"Küche","lastseen":"2024-05-01T12:00:00Z"})");
+    QTest::newRow("4 KiB object") << QByteArray("{\"samples\":[" + QByteArray("123.456,").repeated(512) + "0]}");
+    QTest::newRow("binary") << QByteArray("\x00\x01\xfe\xff\x80payload", 12);
+}
+
+void IngestStages::matchTopic_data()
+{
+    QTest::addColumn<int>("filters");
+    QTest::newRow("10 filters") << 10;
+    QTest::newRow("1000 filters") << 1000;
+}
+
+void IngestStages::matchTopic()
+{
+    QFETCH(int, filters);
+    TopicMatcher matcher;
+    for (int i = 0; i < filters; ++i)
+    {
+        matcher.addFilter(QString("home/room%1/+/temperature").arg(i), i);
+        matcher.addFilter(QString("devices/%1/#").arg(i), i);
+    }
+    const QVector<MqttRecord> batch = makeBatch("21.5");
+    int matched = 0;
+    QBENCHMARK
+    {
+        for (const MqttRecord & record : batch)
+        {
+            matched += matcher.match(record.topic) >= 0;
+        }
+    }
+    QVERIFY(matched > 0);
+}
+
+void IngestStages::validateJson_data()
+{
+    addPayloads();
+}
+
+void IngestStages::validateJson()
+{
+    QFETCH(QByteArray, payload);
+    int valid = 0;
+    QBENCHMARK
+    {
+        for (int i = 0; i < batchSize; ++i)
+        {
+            valid += isValidJson(payload);
+        }
+    }
+    Q_UNUSED(valid)
+}
+
+void IngestStages::classifyPayload_data()
+{
+    addPayloads();
+}
+
+void IngestStages::classifyPayload()
+{
+    QFETCH(QByteArray, payload);
+    double number = 0;
+    int json = 0;
+    QBENCHMARK
+    {
+        for (int i = 0; i < batchSize; ++i)
+        {
+            json += ::classifyPayload(payload, number) == PayloadType::Json;
+        }
+    }
+    Q_UNUSED(json)
+}
+
+void IngestStages::encodeInsert_data()
+{
+    QTest::addColumn<QByteArray>("payload");
+    QTest::addColumn<QByteArray>("settings");
+    const QByteArray payload = R"({"temperature":21.5,"humidity":48,"battery":97})";
+    QTest::newRow("topic") << payload << QByteArray();
+    QTest::newRow("topic id") << payload << QByteArray("normalizetopics=true\n");
+    QTest::newRow("classified") << payload << QByteArray("classifypayloads=true\n");
+}
+
+/**
+ * @brief Conversion of a batch into the values bound to the INSERT statement.
+ */
+void IngestStages::encodeInsert()
+{
+    QFETCH(QByteArray, payload);
+    QFETCH(QByteArray, settings);
+    const Mqtt2SqlConfig insertConfig = config(settings);
+    const QVector<MqttRecord> batch = makeBatch(payload);
+    QVector<QVariant> values;
+    QBENCHMARK
+    {
+        values.clear();
+        for (const MqttRecord & record : batch)
+        {
+            Sink::appendInsertValues(values, record, nullptr, insertConfig);
+        }
+    }
+    QVERIFY(!values.isEmpty());
+}
+
+#ifdef QMQTT2SQL_HAVE_LIBPQ
+void IngestStages::encodeCopyText()
+{
+    QFETCH(QByteArray, payload);
+    QFETCH(QByteArray, settings);
+    PqCopyWriter writer(config(settings + "copyformat=text\n"));
+    const QVector<MqttRecord> batch = makeBatch(payload);
+    qsizetype size = 0;
+    QBENCHMARK
+    {
+        size = writer.encode(batch).size();
+    }
+    QVERIFY(size > 0);
+}
+
+void IngestStages::encodeCopyBinary()
+{
+    QFETCH(QByteArray, payload);
+    QFETCH(QByteArray, settings);
+    PqCopyWriter writer(config(settings + "copyformat=binary\n"));
+    const QVector<MqttRecord> batch = makeBatch(payload);
+    qsizetype size = 0;
+    QBENCHMARK
+    {
+        size = writer.encode(batch).size();
+    }
+    QVERIFY(size > 0);
+}
+#endif
+
+void IngestStages::queueSingleThread()
+{
+    RecordQueue queue(batchSize);
+    const QVector<MqttRecord> batch = makeBatch("21.5");
+    MqttRecord record;
+    QBENCHMARK
+    {
+        for (const MqttRecord & source : batch)
+        {
+            MqttRecord copy = source;
+            queue.tryPush(std::move(copy));
+        }
+        while (queue.tryPop(record))
+        {
+        }
+    }
+}
+
+/**
+ * @brief Messages pushed by a connection thread and popped by a writer thread at the same time.
+ */
+void IngestStages::queueProducerConsumer()
+{
+    RecordQueue queue(100000);
+    const QVector<MqttRecord> batch = makeBatch("21.5");
+    QBENCHMARK
+    {
+        std::thread producer([&queue, &batch]() {
+            for (const MqttRecord & source : batch)
+            {
+                MqttRecord copy = source;
+                while (!queue.tryPush(std::move(copy)))
+                {
+                    std::this_thread::yield();
+                }
+            }
+        });
+        MqttRecord record;
+        for (int popped = 0; popped < batchSize;)
+        {
+            if (queue.tryPop(record))
+            {
+                ++popped;
+            }
+        }
+        producer.join();
+    }
+}
+
+QTEST_GUILESS_MAIN(IngestStages)
+
+#include "microbench.moc"
@@ -0,0 +1,110 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "trafficcapture.h"
+
+TrafficCapture::TrafficCapture(QMqttClient & client, const QStringList & topicFilters, const QString & path, QObject *parent)
+    : QObject{parent}
+    , m_client(client)
+    , m_topicFilters(topicFilters)
+    , m_file(path)
+{
+}
+
+/**
+ * @brief Open the capture file and subscribe to the topic filters, the client must be connected.
+ */
+bool TrafficCapture::start(QString & error)
+{
+    if (!m_file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+    {
+        error = "Error: can not open capture file " + m_file.fileName() + ": " + m_file.errorString();
+        return false;
+    }
+    connect(&m_client, &QMqttClient::messageReceived, this, &TrafficCapture::handleMessage);
+    for (const QString & filter : m_topicFilters)
+    {
+        if (!m_client.subscribe(QMqttTopicFilter(filter)))
+        {
+            error = "Error: failed to subscribe to " + filter;
+            return false;
+        }
+    }
+    return true;
+}
+
+void TrafficCapture::stop()
+{
+    disconnect(&m_client, nullptr, this, nullptr);
+    m_file.close();
+}
+
+void TrafficCapture::handleMessage(const QByteArray & message, const QMqttTopicName & topic)
+{
+    if (!m_timer.isValid())
+    {
+        m_timer.start();
+    }
+    m_file.write(QByteArray::number(m_timer.elapsed()) + '\t' + topic.name().toUtf8() + '\t' + message.toBase64() + '\n');
+    ++m_captured;
+}
+
+/**
+ * @brief Read the capture file \p path written by \ref start into \p messages.
+ */
+bool TrafficCapture::read(const QString & path, QVector<CapturedMessage> & messages, QString & error)
+{
+    QFile file(path);
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        error = "Error: can not open capture file " + path + ": " + file.errorString();
+        return false;
+    }
+    int lineNumber = 0;
+    while (!file.atEnd())
+    {
+        // Not trimmed, the payload of an empty message is an empty last field.
+        QByteArray line = file.readLine();
+        if (line.endsWith('\n'))
+        {
+            line.chop(1);
+        }
+        ++lineNumber;
+        if (line.isEmpty())
+        {
+            continue;
+        }
+        const QList<QByteArray> fields = line.split('\t');
+        bool ok = false;
+        CapturedMessage message;
+        if (fields.size() == 3)
+        {
+            message.offset = fields.at(0).toLongLong(&ok);
+        }
+        if (!ok || fields.at(1).isEmpty())
+        {
+            error = QString("Error: invalid line %1 in capture file %2").arg(lineNumber).arg(path);
+            return false;
+        }
+        message.topic = QString::fromUtf8(fields.at(1));
+        message.payload = QByteArray::fromBase64(fields.at(2));
+        messages.append(message);
+    }
+    return true;
+}
@@ -0,0 +1,68 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef TRAFFICCAPTURE_H
+#define TRAFFICCAPTURE_H
+
+#include <QByteArray>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QMqttClient>
+#include <QObject>
+#include <QStringList>
+#include <QVector>
+
+/// A message of a capture file, sent \ref offset milliseconds after the first message.
+struct CapturedMessage
+{
+    qint64 offset = 0;
+    QString topic;
+    QByteArray payload;
+};
+
+/**
+ * @brief Records the messages of the subscribed topic filters to a capture file for a later replay.
+ *
+ * Every line of the capture file holds the offset in milliseconds since the first message,
+ * the topic and the base64 encoded payload, separated by tabs.
+ */
+class TrafficCapture : public QObject
+{
+    Q_OBJECT
+public:
+    TrafficCapture(QMqttClient & client, const QStringList & topicFilters, const QString & path, QObject *parent = nullptr);
+
+    bool start(QString & error);
+    void stop();
+    int captured() const { return m_captured; }
+
+    static bool read(const QString & path, QVector<CapturedMessage> & messages, QString & error);
+
+private slots:
+    void handleMessage(const QByteArray & message, const QMqttTopicName & topic);
+
+private:
+    QMqttClient & m_client;
+    QStringList m_topicFilters;
+    QFile m_file;
+    QElapsedTimer m_timer;
+    int m_captured = 0;
+};
+
+#endif // TRAFFICCAPTURE_H
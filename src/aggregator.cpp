@@ -0,0 +1,223 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "aggregator.h"
+#include "jsonvalidator.h"
+
+#include <QHash>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+#include <algorithm>
+
+Aggregator::Aggregator(const Mqtt2SqlConfig & config)
+    : m_aggregations(config.aggregations())
+    , m_route(config.aggregateRoute())
+{
+    for (int i = 0; i < m_aggregations.size(); ++i)
+    {
+        m_matcher.addFilter(m_aggregations.at(i).filter, i);
+    }
+    rehash(minSlots);
+}
+
+/**
+ * @brief The shortest window of all aggregations, windows are closed at most this late after their end.
+ */
+std::chrono::milliseconds Aggregator::shortestWindow() const
+{
+    std::chrono::milliseconds shortest = std::chrono::milliseconds::max();
+    for (const Mqtt2SqlConfig::Aggregation & aggregation : m_aggregations)
+    {
+        shortest = qMin(shortest, aggregation.window);
+    }
+    return shortest;
+}
+
+/**
+ * @brief Add the value of \p payload received at \p ts to the window of \p topic, closed windows are appended to \p closed.
+ *
+ * Returns false if the payload has no numeric value, the message is not aggregated then.
+ */
+bool Aggregator::add(int aggregation, const QString & topic, const QByteArray & payload, qint64 ts, QVector<MqttRecord> & closed)
+{
+    double number = 0;
+    if (!value(aggregation, payload, number))
+    {
+        return false;
+    }
+    const qint64 length = m_aggregations.at(aggregation).window.count();
+    const qint64 start = ts - ((ts % length) + length) % length;
+    Window & current = window(topic, aggregation);
+    if (current.count > 0 && current.start != start)
+    {
+        close(current, closed);
+    }
+    if (current.count == 0)
+    {
+        current.start = start;
+        current.min = number;
+        current.max = number;
+        current.sum = 0;
+    }
+    ++current.count;
+    current.min = qMin(current.min, number);
+    current.max = qMax(current.max, number);
+    current.sum += number;
+    return true;
+}
+
+/**
+ * @brief Close all windows which ended before \p now.
+ *
+ * A window is idle once a whole window length passed after it closed without a new message.
+ * Once a quarter of all windows is idle they are removed and the index is rebuilt, so topics
+ * which are no longer published do not keep their window forever without rebuilding the index
+ * on every call.
+ */
+void Aggregator::closeExpired(qint64 now, QVector<MqttRecord> & closed)
+{
+    const auto idle = [this, now](const Window & window) {
+        return window.count == 0 && window.start + 2 * m_aggregations.at(window.aggregation).window.count() <= now;
+    };
+    if (m_idleWindows > 0 && m_idleWindows * 4 >= m_windows.size())
+    {
+        m_windows.erase(std::remove_if(m_windows.begin(), m_windows.end(), idle), m_windows.end());
+        std::size_t size = m_slots.size();
+        while (size > minSlots && m_windows.size() * 8 < size)
+        {
+            size /= 2;
+        }
+        rehash(size);
+    }
+    m_idleWindows = 0;
+    for (Window & window : m_windows)
+    {
+        if (window.count == 0)
+        {
+            m_idleWindows += idle(window) ? 1 : 0;
+        }
+        else if (window.start + m_aggregations.at(window.aggregation).window.count() <= now)
+        {
+            close(window, closed);
+        }
+    }
+}
+
+/**
+ * @brief Close all open windows, e.g. on shutdown.
+ */
+void Aggregator::closeAll(QVector<MqttRecord> & closed)
+{
+    for (Window & window : m_windows)
+    {
+        if (window.count > 0)
+        {
+            close(window, closed);
+        }
+    }
+}
+
+/**
+ * @brief The value of a numeric payload, or of the configured field of a JSON object.
+ */
+bool Aggregator::value(int aggregation, const QByteArray & payload, double & number) const
+{
+    const QString & field = m_aggregations.at(aggregation).field;
+    if (field.isEmpty())
+    {
+        return classifyPayload(payload, number) == PayloadType::Number;
+    }
+    const QJsonValue value = QJsonDocument::fromJson(payload).object().value(field);
+    if (!value.isDouble())
+    {
+        return false;
+    }
+    number = value.toDouble();
+    return true;
+}
+
+/**
+ * @brief The window of \p topic, a new one is added for unknown topics.
+ */
+Aggregator::Window & Aggregator::window(const QString & topic, int aggregation)
+{
+    const std::size_t hash = qHash(topic);
+    const std::size_t mask = m_slots.size() - 1;
+    for (std::size_t i = hash & mask; ; i = (i + 1) & mask)
+    {
+        Slot & slot = m_slots[i];
+        if (slot.window < 0)
+        {
+            slot.hash = hash;
+            slot.window = static_cast<int>(m_windows.size());
+            Window added;
+            added.topic = topic;
+            added.aggregation = aggregation;
+            m_windows.push_back(added);
+            // Kept at most half full, so probe sequences stay short.
+            if (m_windows.size() * 2 > m_slots.size())
+            {
+                rehash(m_slots.size() * 2);
+            }
+            return m_windows.back();
+        }
+        if (slot.hash == hash && m_windows[slot.window].topic == topic)
+        {
+            return m_windows[slot.window];
+        }
+    }
+}
+
+/**
+ * @brief Append the record of \p window to \p closed and reset the window.
+ */
+void Aggregator::close(Window & window, QVector<MqttRecord> & closed) const
+{
+    AggregateWindow values;
+    values.windowMs = m_aggregations.at(window.aggregation).window.count();
+    values.count = static_cast<qint64>(window.count);
+    values.min = window.min;
+    values.max = window.max;
+    values.avg = window.sum / window.count;
+    MqttRecord record {window.start, window.topic, QByteArray(reinterpret_cast<const char *>(&values), sizeof(values))};
+    record.route = m_route;
+    record.aggregate = true;
+    closed.append(record);
+    window.count = 0;
+}
+
+/**
+ * @brief Rebuild the index with \p size slots, a power of two.
+ */
+void Aggregator::rehash(std::size_t size)
+{
+    m_slots.assign(size, Slot());
+    const std::size_t mask = size - 1;
+    for (std::size_t window = 0; window < m_windows.size(); ++window)
+    {
+        const std::size_t hash = qHash(m_windows[window].topic);
+        std::size_t i = hash & mask;
+        while (m_slots[i].window >= 0)
+        {
+            i = (i + 1) & mask;
+        }
+        m_slots[i] = {hash, static_cast<int>(window)};
+    }
+}
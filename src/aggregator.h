@@ -0,0 +1,95 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef AGGREGATOR_H
+#define AGGREGATOR_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+#include <chrono>
+#include <vector>
+
+#include "mqtt2sqlconfig.h"
+#include "mqttrecord.h"
+#include "topicmatcher.h"
+
+/**
+ * @brief Aggregates numeric messages per topic over fixed windows instead of storing every message.
+ *
+ * The windows of an aggregation are aligned to the Unix epoch. Every topic has one open window
+ * with count, minimum, maximum and sum, kept in a flat array found through an open addressing
+ * index. A window is closed when a message of a later window arrives or its end has passed, and
+ * becomes one record for the mqtt_aggregates route. Topics without messages since their last
+ * window closed are removed in bulk. Messages are expected in time order, a late
+ * message of an already closed window starts a new row for that window. Not thread safe, every
+ * connection uses its own aggregator.
+ */
+class Aggregator
+{
+public:
+    explicit Aggregator(const Mqtt2SqlConfig & config);
+
+    /// Returns the index of the aggregation of \p topic, or -1 if it is not aggregated.
+    int match(QStringView topic) const { return m_matcher.match(topic); }
+    bool keepRaw(int aggregation) const { return m_aggregations.at(aggregation).keepRaw; }
+    std::chrono::milliseconds shortestWindow() const;
+
+    bool add(int aggregation, const QString & topic, const QByteArray & payload, qint64 ts, QVector<MqttRecord> & closed);
+    void closeExpired(qint64 now, QVector<MqttRecord> & closed);
+    void closeAll(QVector<MqttRecord> & closed);
+
+private:
+    struct Window
+    {
+        QString topic;
+        int aggregation = -1;
+        /// Start in milliseconds since the Unix epoch.
+        qint64 start = 0;
+        quint64 count = 0;
+        double min = 0;
+        double max = 0;
+        double sum = 0;
+    };
+
+    struct Slot
+    {
+        std::size_t hash = 0;
+        /// Index into \ref m_windows, -1 for an unused slot.
+        int window = -1;
+    };
+
+    static constexpr std::size_t minSlots = 64;
+
+    bool value(int aggregation, const QByteArray & payload, double & number) const;
+    Window & window(const QString & topic, int aggregation);
+    void close(Window & window, QVector<MqttRecord> & closed) const;
+    void rehash(std::size_t size);
+
+    QVector<Mqtt2SqlConfig::Aggregation> m_aggregations;
+    TopicMatcher m_matcher;
+    int m_route;
+    std::vector<Window> m_windows;
+    std::vector<Slot> m_slots;
+    /// Idle windows found by the previous \ref closeExpired.
+    std::size_t m_idleWindows = 0;
+};
+
+#endif // AGGREGATOR_H
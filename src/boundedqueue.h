@@ -0,0 +1,206 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef BOUNDEDQUEUE_H
+#define BOUNDEDQUEUE_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+
+/**
+ * @brief Bounded lock-free multi-producer multi-consumer queue.
+ *
+ * Push and pop are lock-free (Dmitry Vyukov's bounded MPMC ring buffer). Only
+ * consumers waiting for data sleep on a condition variable, producers take the
+ * mutex only if a consumer is actually sleeping. All cells are allocated up front
+ * and reused, elements are moved in and out, so the queue itself never allocates.
+ */
+template <typename T>
+class BoundedQueue
+{
+public:
+    /// Creates a queue for at least \p capacity elements, rounded up to a power of two.
+    explicit BoundedQueue(std::size_t capacity)
+    {
+        std::size_t size = 2;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+        m_mask = size - 1;
+        m_cells.reset(new Cell[size]);
+        for (std::size_t i = 0; i < size; ++i)
+        {
+            m_cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedQueue(const BoundedQueue &) = delete;
+    BoundedQueue & operator=(const BoundedQueue &) = delete;
+
+    std::size_t capacity() const { return m_mask + 1; }
+
+    /// Number of queued elements, only approximate while other threads push or pop.
+    std::size_t size() const
+    {
+        const std::size_t enqueuePos = m_enqueuePos.load(std::memory_order_relaxed);
+        const std::size_t dequeuePos = m_dequeuePos.load(std::memory_order_relaxed);
+        return enqueuePos > dequeuePos ? enqueuePos - dequeuePos : 0;
+    }
+
+    /// Appends \p value, returns false if the queue is full.
+    bool tryPush(T && value)
+    {
+        Cell * cell;
+        std::size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            cell = &m_cells[pos & m_mask];
+            const std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            const std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos);
+            if (diff == 0)
+            {
+                if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = m_enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->data = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (m_sleepers.load(std::memory_order_relaxed) > 0)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_condition.notify_one();
+        }
+        return true;
+    }
+
+    /// Removes the oldest element into \p value, returns false if the queue is empty.
+    bool tryPop(T & value)
+    {
+        Cell * cell;
+        std::size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+        for (;;)
+        {
+            cell = &m_cells[pos & m_mask];
+            const std::size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            const std::ptrdiff_t diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos + 1);
+            if (diff == 0)
+            {
+                if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = m_dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(cell->data);
+        cell->data = T();
+        cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    /// True if the next element is ready to be popped.
+    bool hasData() const
+    {
+        const std::size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+        return m_cells[pos & m_mask].sequence.load(std::memory_order_acquire) == pos + 1;
+    }
+
+    /**
+     * Blocks until data is available, the queue is closed or \p deadline is reached.
+     * Returns true if data is available.
+     */
+    bool waitForData(std::chrono::steady_clock::time_point deadline)
+    {
+        m_sleepers.fetch_add(1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        bool available;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            available = m_condition.wait_until(lock, deadline, [this]() {
+                return hasData() || m_closed.load(std::memory_order_relaxed);
+            });
+        }
+        m_sleepers.fetch_sub(1, std::memory_order_relaxed);
+        return available && hasData();
+    }
+
+    /**
+     * Blocks until the queue is closed or \p deadline is reached, regardless of pushed data.
+     * Returns true if the queue is closed.
+     */
+    bool waitForClose(std::chrono::steady_clock::time_point deadline)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        return m_condition.wait_until(lock, deadline, [this]() {
+            return m_closed.load(std::memory_order_relaxed);
+        });
+    }
+
+    /// Wakes all waiting consumers, which should then drain the queue and stop.
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed.store(true, std::memory_order_relaxed);
+        m_condition.notify_all();
+    }
+
+    bool isClosed() const { return m_closed.load(std::memory_order_relaxed); }
+
+private:
+    struct Cell
+    {
+        std::atomic<std::size_t> sequence;
+        T data;
+    };
+
+    std::unique_ptr<Cell[]> m_cells;
+    std::size_t m_mask = 0;
+    alignas(64) std::atomic<std::size_t> m_enqueuePos {0};
+    alignas(64) std::atomic<std::size_t> m_dequeuePos {0};
+    alignas(64) std::atomic<int> m_sleepers {0};
+    std::atomic<bool> m_closed {false};
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+};
+
+#endif // BOUNDEDQUEUE_H
@@ -0,0 +1,494 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "columnarfilesink.h"
+
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QStringList>
+
+#include <algorithm>
+
+#include <arrow/api.h>
+#include <arrow/io/file.h>
+#include <arrow/ipc/writer.h>
+#include <parquet/arrow/writer.h>
+#include <parquet/properties.h>
+
+#include "logger.h"
+#include "messagerouter.h"
+
+/// Output of one table: the file of the current interval and the builders of its next row group.
+struct ColumnarFileSink::TableFile
+{
+    QString table;
+    std::shared_ptr<arrow::Schema> schema;
+    std::vector<std::unique_ptr<arrow::ArrayBuilder>> builders;
+    int rows = 0;
+    /// Final path of the open file, empty if no file is open.
+    QString path;
+    std::shared_ptr<arrow::io::FileOutputStream> output;
+    std::unique_ptr<parquet::arrow::FileWriter> parquetWriter;
+    std::shared_ptr<arrow::ipc::RecordBatchWriter> arrowWriter;
+};
+
+namespace {
+
+/**
+ * Arrow type of a typed route column, declared with its PostgreSQL type. Unknown types are stored as text.
+ */
+std::shared_ptr<arrow::DataType> columnType(const QString & sqlType)
+{
+    const QString type = sqlType.trimmed().toLower();
+    if (type == "smallint" || type == "int2")
+    {
+        return arrow::int16();
+    }
+    if (type == "integer" || type == "int" || type == "int4")
+    {
+        return arrow::int32();
+    }
+    if (type == "bigint" || type == "int8")
+    {
+        return arrow::int64();
+    }
+    if (type == "real" || type == "float4")
+    {
+        return arrow::float32();
+    }
+    if (type == "double precision" || type == "float8" || type == "float" || type.startsWith("numeric") || type.startsWith("decimal"))
+    {
+        return arrow::float64();
+    }
+    if (type == "boolean" || type == "bool")
+    {
+        return arrow::boolean();
+    }
+    if (type.startsWith("timestamp"))
+    {
+        return arrow::timestamp(arrow::TimeUnit::MILLI, "UTC");
+    }
+    return arrow::utf8();
+}
+
+/**
+ * Append \p value to \p builder, converted to the type of the builder. Values which can not be converted are NULL.
+ */
+arrow::Status appendValue(arrow::ArrayBuilder & builder, const QVariant & value)
+{
+    if (value.isNull())
+    {
+        return builder.AppendNull();
+    }
+    bool ok = true;
+    switch (builder.type()->id())
+    {
+    case arrow::Type::TIMESTAMP:
+    {
+        const QDateTime ts = value.toDateTime();
+        return ts.isValid() ? static_cast<arrow::TimestampBuilder &>(builder).Append(ts.toMSecsSinceEpoch()) : builder.AppendNull();
+    }
+    case arrow::Type::INT16:
+    {
+        const int number = value.toInt(&ok);
+        return ok ? static_cast<arrow::Int16Builder &>(builder).Append(static_cast<int16_t>(number)) : builder.AppendNull();
+    }
+    case arrow::Type::INT32:
+    {
+        const int number = value.toInt(&ok);
+        return ok ? static_cast<arrow::Int32Builder &>(builder).Append(number) : builder.AppendNull();
+    }
+    case arrow::Type::INT64:
+    {
+        const qlonglong number = value.toLongLong(&ok);
+        return ok ? static_cast<arrow::Int64Builder &>(builder).Append(number) : builder.AppendNull();
+    }
+    case arrow::Type::FLOAT:
+    {
+        const float number = value.toFloat(&ok);
+        return ok ? static_cast<arrow::FloatBuilder &>(builder).Append(number) : builder.AppendNull();
+    }
+    case arrow::Type::DOUBLE:
+    {
+        const double number = value.toDouble(&ok);
+        return ok ? static_cast<arrow::DoubleBuilder &>(builder).Append(number) : builder.AppendNull();
+    }
+    case arrow::Type::BOOL:
+        return static_cast<arrow::BooleanBuilder &>(builder).Append(value.toBool());
+    case arrow::Type::BINARY:
+    {
+        const QByteArray bytes = value.toByteArray();
+        return static_cast<arrow::BinaryBuilder &>(builder).Append(reinterpret_cast<const uint8_t *>(bytes.constData()), bytes.size());
+    }
+    default:
+    {
+        const QByteArray text = value.toString().toUtf8();
+        return static_cast<arrow::StringBuilder &>(builder).Append(text.constData(), text.size());
+    }
+    }
+}
+
+/**
+ * Reserve the memory \ref appendValue needs to append \p value to \p builder, so the append can
+ * not fail. Text is reserved with its maximum UTF-8 size, which avoids converting it twice.
+ */
+arrow::Status reserveValue(arrow::ArrayBuilder & builder, const QVariant & value)
+{
+    arrow::Status status = builder.Reserve(1);
+    if (!status.ok() || value.isNull())
+    {
+        return status;
+    }
+    switch (builder.type()->id())
+    {
+    case arrow::Type::BINARY:
+        return static_cast<arrow::BinaryBuilder &>(builder).ReserveData(value.toByteArray().size());
+    case arrow::Type::STRING:
+        return static_cast<arrow::StringBuilder &>(builder).ReserveData(value.toString().size() * 3);
+    default:
+        return status;
+    }
+}
+
+} // namespace
+
+ColumnarFileSink::ColumnarFileSink(const Mqtt2SqlConfig & config, const MessageRouter * router, int index)
+    : m_config(config)
+    , m_router(router)
+    , m_index(index)
+{
+    const QVector<Mqtt2SqlConfig::Route> & routes = config.routes();
+    for (int route = -1; route < routes.size(); ++route)
+    {
+        const Mqtt2SqlConfig::Route * routeConfig = route >= 0 ? &routes.at(route) : nullptr;
+        const QString table = routeConfig ? routeConfig->table : QString("mqtt");
+        const auto known = std::find_if(m_files.cbegin(), m_files.cend(),
+                                        [&table](const std::unique_ptr<TableFile> & file) { return file->table == table; });
+        if (known != m_files.cend())
+        {
+            m_routeFiles.push_back(static_cast<int>(known - m_files.cbegin()));
+            continue;
+        }
+
+        // The payload columns are written like for PostgreSQL, see Sink::appendInsertValues.
+        std::vector<std::shared_ptr<arrow::Field>> fields;
+        const QStringList names = MessageRouter::columnNames(routeConfig, config);
+        const int firstTyped = static_cast<int>(names.size() - (routeConfig ? routeConfig->columns.size() : 0));
+        for (int i = 0; i < names.size(); ++i)
+        {
+            const QString & name = names.at(i);
+            std::shared_ptr<arrow::DataType> type = arrow::utf8();
+            if (i >= firstTyped)
+            {
+                type = columnType(routeConfig->columns.at(i - firstTyped).type);
+            }
+            else if (name == "ts")
+            {
+                type = arrow::timestamp(arrow::TimeUnit::MILLI, "UTC");
+            }
+            else if (name == "value")
+            {
+                type = arrow::float64();
+            }
+            else if (name == "raw")
+            {
+                type = arrow::binary();
+            }
+            fields.push_back(arrow::field(name.toStdString(), type));
+        }
+        auto file = std::make_unique<TableFile>();
+        file->table = table;
+        file->schema = arrow::schema(fields);
+        m_routeFiles.push_back(static_cast<int>(m_files.size()));
+        m_files.push_back(std::move(file));
+    }
+}
+
+ColumnarFileSink::~ColumnarFileSink()
+{
+    close();
+}
+
+bool ColumnarFileSink::open()
+{
+    if (!QDir().mkpath(m_config.filesDirectory()))
+    {
+        logError("Error: can not create directory " + m_config.filesDirectory());
+        return false;
+    }
+    m_open = true;
+    m_failed = false;
+    m_closeFailed = false;
+    scheduleRotation();
+    return true;
+}
+
+/**
+ * @brief Complete all open files.
+ */
+void ColumnarFileSink::close()
+{
+    for (const std::unique_ptr<TableFile> & file : m_files)
+    {
+        m_closeFailed = !closeFile(*file) || m_closeFailed;
+    }
+    m_open = false;
+}
+
+bool ColumnarFileSink::isOpen() const
+{
+    return m_open;
+}
+
+bool ColumnarFileSink::isAlive()
+{
+    return m_open && !m_failed;
+}
+
+/**
+ * @brief Append the rows of \p batch to the builders of their tables, full row groups are written to the files.
+ *
+ * Every row is reserved in all builders before its first value is appended, so a failure never
+ * leaves the builders of a table with different lengths. Success only means the rows are
+ * buffered, they are durable once their file is complete, see \ref isDurable. After a failure the rows of
+ * \p batch appended before are kept, a batch written again is stored twice.
+ */
+bool ColumnarFileSink::write(QVector<MqttRecord> & batch)
+{
+    for (const MqttRecord & record : std::as_const(batch))
+    {
+        TableFile & file = *m_files.at(m_routeFiles.at(record.route + 1));
+        if (file.path.isEmpty() && !openFile(file))
+        {
+            m_failed = true;
+            return false;
+        }
+        m_values.clear();
+        appendInsertValues(m_values, record, record.route >= 0 ? &m_router->at(record.route) : nullptr, m_config);
+        arrow::Status status;
+        for (int i = 0; status.ok() && i < m_values.size(); ++i)
+        {
+            status = reserveValue(*file.builders.at(i), m_values.at(i));
+        }
+        for (int i = 0; status.ok() && i < m_values.size(); ++i)
+        {
+            status = appendValue(*file.builders.at(i), m_values.at(i));
+        }
+        if (!status.ok())
+        {
+            Logger::instance().logLimited(LogLevel::Error, "files-write", "Error: can not append row to " + file.path + ": " + QString::fromStdString(status.ToString()));
+            m_failed = true;
+            return false;
+        }
+        if (++file.rows >= m_config.filesRowGroupSize() && !writeRows(file))
+        {
+            m_failed = true;
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Complete the files of the current interval once it is over, the next rows start new files.
+ */
+void ColumnarFileSink::maintain()
+{
+    if (std::chrono::system_clock::now() < m_rotateAt)
+    {
+        return;
+    }
+    for (const std::unique_ptr<TableFile> & file : m_files)
+    {
+        m_closeFailed = !closeFile(*file) || m_closeFailed;
+    }
+    scheduleRotation();
+}
+
+/**
+ * @brief True once all written rows are in complete files, i.e. no file is open and none failed.
+ */
+bool ColumnarFileSink::isDurable() const
+{
+    return !m_closeFailed && std::all_of(m_files.cbegin(), m_files.cend(),
+                                         [](const std::unique_ptr<TableFile> & file) { return file->path.isEmpty(); });
+}
+
+/**
+ * @brief Rotate at the next multiple of filesRotateInterval() since the epoch, so all writers rotate at the same time.
+ */
+void ColumnarFileSink::scheduleRotation()
+{
+    const auto interval = std::chrono::duration_cast<std::chrono::system_clock::duration>(m_config.filesRotateInterval());
+    const auto now = std::chrono::system_clock::now().time_since_epoch();
+    m_rotateAt = std::chrono::system_clock::time_point((now / interval + 1) * interval);
+}
+
+/**
+ * @brief Open a new file for \p file, named after the table, the current time in milliseconds and the writer.
+ */
+bool ColumnarFileSink::openFile(TableFile & file)
+{
+    const QString directory = m_config.filesDirectory() + "/" + file.table;
+    if (!QDir().mkpath(directory))
+    {
+        Logger::instance().logLimited(LogLevel::Error, "files-open", "Error: can not create directory " + directory);
+        return false;
+    }
+    const bool parquet = m_config.filesFormat() == Mqtt2SqlConfig::FileFormat::Parquet;
+    const QString base = QString("%1/%2-%3-%4").arg(directory, file.table, QDateTime::currentDateTimeUtc().toString("yyyyMMdd-HHmmsszzz"))
+            .arg(m_index);
+    const QString suffix = parquet ? ".parquet" : ".arrow";
+    // A file reopened within the same millisecond, e.g. after a reload, gets a sequence number, rename does not overwrite.
+    QString path = base + suffix;
+    for (int sequence = 1; QFile::exists(path) || QFile::exists(path + ".tmp"); ++sequence)
+    {
+        path = base + "-" + QString::number(sequence) + suffix;
+    }
+    const auto fail = [&path](const arrow::Status & status) {
+        Logger::instance().logLimited(LogLevel::Error, "files-open", "Error: can not open " + path + ": " + QString::fromStdString(status.ToString()));
+        return false;
+    };
+
+    arrow::Result<std::shared_ptr<arrow::io::FileOutputStream>> output = arrow::io::FileOutputStream::Open((path + ".tmp").toStdString());
+    if (!output.ok())
+    {
+        return fail(output.status());
+    }
+    file.output = *output;
+    if (parquet)
+    {
+        parquet::WriterProperties::Builder properties;
+        if (m_config.filesCompression() == "zstd")
+        {
+            properties.compression(arrow::Compression::ZSTD);
+        }
+        else if (m_config.filesCompression() == "snappy")
+        {
+            properties.compression(arrow::Compression::SNAPPY);
+        }
+        else
+        {
+            properties.compression(arrow::Compression::UNCOMPRESSED);
+        }
+        arrow::Result<std::unique_ptr<parquet::arrow::FileWriter>> writer
+                = parquet::arrow::FileWriter::Open(*file.schema, arrow::default_memory_pool(), file.output, properties.build());
+        if (!writer.ok())
+        {
+            return fail(writer.status());
+        }
+        file.parquetWriter = std::move(*writer);
+    }
+    else
+    {
+        arrow::Result<std::shared_ptr<arrow::ipc::RecordBatchWriter>> writer = arrow::ipc::MakeFileWriter(file.output, file.schema);
+        if (!writer.ok())
+        {
+            return fail(writer.status());
+        }
+        file.arrowWriter = *writer;
+    }
+
+    file.builders.clear();
+    for (const std::shared_ptr<arrow::Field> & field : file.schema->fields())
+    {
+        arrow::Result<std::unique_ptr<arrow::ArrayBuilder>> builder = arrow::MakeBuilder(field->type());
+        if (!builder.ok())
+        {
+            return fail(builder.status());
+        }
+        file.builders.push_back(std::move(*builder));
+    }
+    file.rows = 0;
+    file.path = path;
+    return true;
+}
+
+/**
+ * @brief Write the collected rows of \p file as one row group or record batch.
+ */
+bool ColumnarFileSink::writeRows(TableFile & file)
+{
+    if (file.rows == 0)
+    {
+        return true;
+    }
+    std::vector<std::shared_ptr<arrow::Array>> arrays;
+    arrays.reserve(file.builders.size());
+    arrow::Status status;
+    for (const std::unique_ptr<arrow::ArrayBuilder> & builder : file.builders)
+    {
+        std::shared_ptr<arrow::Array> array;
+        status = builder->Finish(&array);
+        if (!status.ok())
+        {
+            break;
+        }
+        arrays.push_back(std::move(array));
+    }
+    if (status.ok() && file.parquetWriter)
+    {
+        status = file.parquetWriter->WriteTable(*arrow::Table::Make(file.schema, arrays, file.rows), file.rows);
+    }
+    else if (status.ok())
+    {
+        status = file.arrowWriter->WriteRecordBatch(*arrow::RecordBatch::Make(file.schema, file.rows, arrays));
+    }
+    file.rows = 0;
+    if (!status.ok())
+    {
+        Logger::instance().logLimited(LogLevel::Error, "files-write", "Error: can not write " + file.path + ": " + QString::fromStdString(status.ToString()));
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Write the remaining rows of \p file, complete the file and rename it to its final name.
+ */
+bool ColumnarFileSink::closeFile(TableFile & file)
+{
+    if (file.path.isEmpty())
+    {
+        return true;
+    }
+    bool ok = writeRows(file);
+    arrow::Status status = file.parquetWriter ? file.parquetWriter->Close() : file.arrowWriter->Close();
+    if (status.ok())
+    {
+        status = file.output->Close();
+    }
+    if (!status.ok())
+    {
+        logError("Error: can not complete " + file.path + ": " + QString::fromStdString(status.ToString()));
+        ok = false;
+    }
+    else if (!QFile::rename(file.path + ".tmp", file.path))
+    {
+        logError("Error: can not rename " + file.path + ".tmp");
+        ok = false;
+    }
+    file.parquetWriter.reset();
+    file.arrowWriter.reset();
+    file.output.reset();
+    file.builders.clear();
+    file.path.clear();
+    return ok;
+}
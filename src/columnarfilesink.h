@@ -0,0 +1,81 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef COLUMNARFILESINK_H
+#define COLUMNARFILESINK_H
+
+#include <QString>
+#include <QVector>
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "sink.h"
+
+/**
+ * @brief Writes batches to time rotated Parquet or Arrow IPC files, one file set per table.
+ *
+ * Every writer writes its own files `<directory>/<table>/<table>-<start>-<writer>.<format>` with the
+ * columns of the PostgreSQL table, a new file is started at every multiple of filesRotateInterval().
+ * Rows are collected in column builders and written as one row group of filesRowGroupSize() rows,
+ * so unlike the database sinks a written batch is not durable until its row group is written.
+ * A file is written as `.tmp` and renamed once it is complete, so readers only see complete files.
+ * The rows of a file that is not complete yet are lost if QMQTT2SQL is killed.
+ */
+class ColumnarFileSink : public Sink
+{
+public:
+    ColumnarFileSink(const Mqtt2SqlConfig & config, const MessageRouter * router, int index);
+    ~ColumnarFileSink() override;
+
+    bool open() override;
+    void close() override;
+    bool isOpen() const override;
+    bool isAlive() override;
+    bool write(QVector<MqttRecord> & batch) override;
+    void maintain() override;
+    bool isDurable() const override;
+
+private:
+    struct TableFile;
+
+    bool openFile(TableFile & file);
+    bool writeRows(TableFile & file);
+    bool closeFile(TableFile & file);
+    void scheduleRotation();
+
+    Mqtt2SqlConfig m_config;
+    const MessageRouter * m_router;
+    int m_index;
+    bool m_open = false;
+    /// Set by a failed write, the sink is opened again.
+    bool m_failed = false;
+    /// Set if a file could not be completed since the sink was opened, its rows are lost.
+    bool m_closeFailed = false;
+    /// Output of every table, several routes can share a table.
+    std::vector<std::unique_ptr<TableFile>> m_files;
+    /// Index into \ref m_files of the mqtt table and of every route.
+    std::vector<int> m_routeFiles;
+    std::chrono::system_clock::time_point m_rotateAt;
+    /// Values of one row, keeps its capacity.
+    QVector<QVariant> m_values;
+};
+
+#endif // COLUMNARFILESINK_H
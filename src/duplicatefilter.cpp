@@ -0,0 +1,82 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "duplicatefilter.h"
+
+#include <QHash>
+
+namespace {
+
+/// Number of entries looked at for every message.
+constexpr std::size_t maxProbes = 8;
+
+quint64 messageKey(const QString & topic, const QByteArray & payload)
+{
+    // qHash is only 32 bit with Qt 5, two seeds give 64 bits for the payload.
+    const quint64 payloadHash = (quint64(qHash(payload, 0x9e3779b9U)) << 32) ^ quint64(qHash(payload, 0x85ebca6bU));
+    return payloadHash ^ (quint64(qHash(topic)) * 0x9e3779b97f4a7c15ULL);
+}
+
+} // namespace
+
+/**
+ * @brief Create a filter with at least \p capacity entries, rounded up to a power of two, remembering messages for \p window.
+ */
+DuplicateFilter::DuplicateFilter(int capacity, std::chrono::milliseconds window)
+    : m_window(qMax<qint64>(1, window.count()))
+{
+    std::size_t size = maxProbes;
+    while (size < static_cast<std::size_t>(capacity))
+    {
+        size <<= 1;
+    }
+    m_entries.resize(size);
+    m_mask = size - 1;
+}
+
+/**
+ * @brief Returns true if \p topic and \p payload were first seen less than the window before \p ts, otherwise remembers them.
+ */
+bool DuplicateFilter::isDuplicate(const QString & topic, const QByteArray & payload, qint64 ts)
+{
+    const quint64 key = messageKey(topic, payload);
+    Entry * replace = nullptr;
+    for (std::size_t i = 0; i < maxProbes; ++i)
+    {
+        Entry & entry = m_entries[(key + i) & m_mask];
+        if (entry.key == key && entry.seen != unused)
+        {
+            if (ts - entry.seen < m_window)
+            {
+                return true;
+            }
+            // Expired, the message starts a new window in its own entry.
+            replace = &entry;
+            break;
+        }
+        // Unused entries have the lowest time and expired ones come next, so they are preferred.
+        if (!replace || entry.seen < replace->seen)
+        {
+            replace = &entry;
+        }
+    }
+    replace->key = key;
+    replace->seen = ts;
+    return false;
+}
@@ -0,0 +1,62 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef DUPLICATEFILTER_H
+#define DUPLICATEFILTER_H
+
+#include <QByteArray>
+#include <QString>
+
+#include <chrono>
+#include <limits>
+#include <vector>
+
+/**
+ * @brief Detects messages whose topic and payload were already seen shortly before.
+ *
+ * Remembers a 64 bit hash of topic and payload together with the time the message was first
+ * seen, in a fixed size open addressing table. A message is a duplicate if its hash was first
+ * seen less than the window before, so the same message is stored at most once per window. The
+ * filter compares content only, a sensor publishing the same value again within the window is
+ * skipped as well. Lookups probe a few neighbouring entries only; if all of them are in use the
+ * oldest is replaced. Not thread safe, every connection uses its own filter.
+ */
+class DuplicateFilter
+{
+public:
+    DuplicateFilter(int capacity, std::chrono::milliseconds window);
+
+    bool isDuplicate(const QString & topic, const QByteArray & payload, qint64 ts);
+
+private:
+    static constexpr qint64 unused = std::numeric_limits<qint64>::min();
+
+    struct Entry
+    {
+        quint64 key = 0;
+        /// Time the message was first seen in milliseconds since the Unix epoch, \ref unused for an unused entry.
+        qint64 seen = unused;
+    };
+
+    std::vector<Entry> m_entries;
+    std::size_t m_mask;
+    qint64 m_window;
+};
+
+#endif // DUPLICATEFILTER_H
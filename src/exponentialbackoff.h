@@ -0,0 +1,60 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef EXPONENTIALBACKOFF_H
+#define EXPONENTIALBACKOFF_H
+
+#include <QRandomGenerator>
+
+#include <algorithm>
+#include <chrono>
+
+/**
+ * @brief Jittered exponential backoff for reconnection attempts.
+ *
+ * Every call of \ref next doubles the delay up to the maximum, the returned delay is
+ * randomly chosen between half and the full delay so that many instances do not
+ * reconnect at the same time.
+ */
+class ExponentialBackoff
+{
+public:
+    ExponentialBackoff(std::chrono::milliseconds minimum, std::chrono::milliseconds maximum)
+        : m_minimum(minimum)
+        , m_maximum(std::max(minimum, maximum))
+        , m_current(minimum)
+    {}
+
+    std::chrono::milliseconds next()
+    {
+        const std::chrono::milliseconds delay = m_current;
+        m_current = std::min(m_current * 2, m_maximum);
+        const int upper = static_cast<int>(delay.count());
+        return std::chrono::milliseconds(QRandomGenerator::global()->bounded(upper / 2, upper + 1));
+    }
+
+    void reset() { m_current = m_minimum; }
+
+private:
+    std::chrono::milliseconds m_minimum;
+    std::chrono::milliseconds m_maximum;
+    std::chrono::milliseconds m_current;
+};
+
+#endif // EXPONENTIALBACKOFF_H
@@ -0,0 +1,177 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "indexbuilder.h"
+#include "exponentialbackoff.h"
+#include "logger.h"
+
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QVariant>
+
+namespace {
+
+QVector<IndexBuilder::Index> tableIndexes(const Mqtt2SqlConfig & config, const QString & table, bool concurrent)
+{
+    const QString topicColumn = config.sqlTopicColumn();
+    const bool mqtt = table == "mqtt";
+    QVector<IndexBuilder::Index> indexes;
+    for (Mqtt2SqlConfig::Index index : config.sqlIndexes())
+    {
+        switch (index)
+        {
+        case Mqtt2SqlConfig::Index::Topic:
+            // The names are kept from older versions.
+            if (mqtt && !config.sqlNormalizeTopics())
+            {
+                indexes.append({"mqtt_topic_idx", table, "(topic DESC)", concurrent});
+            }
+            else if (mqtt)
+            {
+                indexes.append({"mqtt_topic_id_idx", table, "(topic_id)", concurrent});
+            }
+            else
+            {
+                indexes.append({table + "_topic_idx", table, "(" + topicColumn + ")", concurrent});
+            }
+            break;
+        case Mqtt2SqlConfig::Index::Ts:
+            // TimescaleDB creates this index itself.
+            if (!mqtt || !config.sqlTimescaleDb())
+            {
+                indexes.append({table + "_ts_idx", table, "(ts)", concurrent});
+            }
+            break;
+        case Mqtt2SqlConfig::Index::TsBrin:
+            indexes.append({table + "_ts_brin_idx", table, "USING brin (ts)", concurrent});
+            break;
+        case Mqtt2SqlConfig::Index::TopicTs:
+            indexes.append({table + "_topic_ts_idx", table, "(" + topicColumn + ", ts DESC)", concurrent});
+            break;
+        }
+    }
+    return indexes;
+}
+
+} // namespace
+
+IndexBuilder::IndexBuilder(const Mqtt2SqlConfig & config, QObject *parent)
+    : QThread{parent}
+    , m_config(config)
+{
+    setObjectName("qmqtt2sql-index");
+}
+
+/**
+ * @brief All configured indexes of the mqtt and the route tables.
+ */
+QVector<IndexBuilder::Index> IndexBuilder::indexes(const Mqtt2SqlConfig & config)
+{
+    const bool partitioned = config.sqlPartitioning() != Mqtt2SqlConfig::Partitioning::None || config.sqlTimescaleDb();
+    QVector<Index> indexes = tableIndexes(config, "mqtt", !partitioned);
+    for (const Mqtt2SqlConfig::Route & route : config.routes())
+    {
+        indexes += tableIndexes(config, route.table, true);
+    }
+    return indexes;
+}
+
+/**
+ * @brief Create \p index on \p db if it does not exist, with \p concurrently if the table allows it.
+ *
+ * An existing valid index is not touched, so a restart issues no DDL for it. An invalid index
+ * left behind by an aborted concurrent build is dropped and built again.
+ */
+bool IndexBuilder::create(QSqlDatabase db, const Index & index, bool concurrently)
+{
+    concurrently = concurrently && index.concurrent;
+    QSqlQuery query(db);
+    query.prepare("SELECT i.indisvalid FROM pg_index i JOIN pg_class c ON c.oid = i.indexrelid "
+                  "WHERE c.relname = :name AND pg_table_is_visible(c.oid);");
+    query.bindValue(":name", index.name);
+    if (query.exec() && query.next())
+    {
+        if (query.value(0).toBool())
+        {
+            return true;
+        }
+        logWarning("Dropping invalid index " + index.name + ".");
+        if (!query.exec(QString("DROP INDEX %1IF EXISTS %2;").arg(concurrently ? "CONCURRENTLY " : "", index.name)))
+        {
+            logError("Error while dropping index: " + query.lastError().text());
+            return false;
+        }
+    }
+    logInfo("Creating index " + index.name + ".");
+    const QString statement = QString("CREATE INDEX %1IF NOT EXISTS %2 ON %3 %4;")
+            .arg(concurrently ? "CONCURRENTLY " : "", index.name, index.table, index.definition);
+    if (!query.exec(statement))
+    {
+        logError("Error while creating index " + index.name + ": " + query.lastError().text());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Build the missing indexes one after another on a connection of this thread.
+ *
+ * The connection is retried with backoff until it is open or the build is interrupted.
+ */
+void IndexBuilder::run()
+{
+    const QString connectionName = objectName();
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase("QPSQL", connectionName);
+        db.setHostName(m_config.sqlHostname());
+        db.setDatabaseName(m_config.sqlDatabase());
+        db.setPort(m_config.sqlPort());
+        db.setUserName(m_config.sqlUsername());
+        db.setPassword(m_config.sqlPassword());
+        ExponentialBackoff backoff(m_config.sqlReconnectMin(), m_config.sqlReconnectMax());
+        bool open = db.open();
+        while (!open && !isInterruptionRequested())
+        {
+            const std::chrono::milliseconds delay = backoff.next();
+            logError("Error: Failed to open database for the index build, retrying in " + QString::number(delay.count())
+                     + " ms: " + db.lastError().text());
+            // Slept in steps, so the shutdown does not wait for the whole delay.
+            const auto until = std::chrono::steady_clock::now() + delay;
+            while (std::chrono::steady_clock::now() < until && !isInterruptionRequested())
+            {
+                msleep(100);
+            }
+            open = !isInterruptionRequested() && db.open();
+        }
+        if (open)
+        {
+            const QVector<Index> indexes = IndexBuilder::indexes(m_config);
+            for (const Index & index : indexes)
+            {
+                if (isInterruptionRequested())
+                {
+                    break;
+                }
+                create(db, index, true);
+            }
+            db.close();
+        }
+    }
+    QSqlDatabase::removeDatabase(connectionName);
+}
@@ -0,0 +1,65 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef INDEXBUILDER_H
+#define INDEXBUILDER_H
+
+#include <QSqlDatabase>
+#include <QString>
+#include <QThread>
+#include <QVector>
+
+#include "mqtt2sqlconfig.h"
+
+/**
+ * @brief Creates the configured indexes of the mqtt and the route tables.
+ *
+ * Either directly on a given connection while the schema is created, or as a thread with its
+ * own connection building the missing indexes with CREATE INDEX CONCURRENTLY, so a backfill
+ * without indexes can be indexed later without blocking the writers. PostgreSQL can not
+ * build indexes of partitioned tables and hypertables concurrently, those block the writers
+ * while they are built.
+ */
+class IndexBuilder : public QThread
+{
+    Q_OBJECT
+public:
+    struct Index
+    {
+        QString name;
+        QString table;
+        /// Method and columns, e.g. "USING brin (ts)".
+        QString definition;
+        /// Whether the index may be built with CREATE INDEX CONCURRENTLY.
+        bool concurrent = true;
+    };
+
+    explicit IndexBuilder(const Mqtt2SqlConfig & config, QObject *parent = nullptr);
+
+    static QVector<Index> indexes(const Mqtt2SqlConfig & config);
+    static bool create(QSqlDatabase db, const Index & index, bool concurrently);
+
+protected:
+    void run() override;
+
+private:
+    Mqtt2SqlConfig m_config;
+};
+
+#endif // INDEXBUILDER_H
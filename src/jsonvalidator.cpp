@@ -0,0 +1,472 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "jsonvalidator.h"
+
+#include <cstdint>
+#include <cstring>
+
+namespace {
+
+/// Deeper nesting is rejected, PostgreSQL fails on it anyway.
+constexpr int maxDepth = 1000;
+
+constexpr std::uint64_t repeatedByte(unsigned char byte) { return 0x0101010101010101ULL * byte; }
+
+/// Non-zero if \p word contains a zero byte.
+constexpr std::uint64_t zeroBytes(std::uint64_t word) { return (word - repeatedByte(0x01)) & ~word & repeatedByte(0x80); }
+
+/**
+ * @brief Number of bytes from \p pos that are plain ASCII string characters.
+ *
+ * Checks eight bytes at a time for bytes >= 0x80, control characters, quotes and backslashes,
+ * so long ASCII runs are skipped without looking at each byte.
+ */
+qsizetype plainAsciiLength(const unsigned char * data, qsizetype pos, qsizetype size, bool inString)
+{
+    const qsizetype start = pos;
+    while (size - pos >= 8)
+    {
+        std::uint64_t word;
+        std::memcpy(&word, data + pos, sizeof(word));
+        std::uint64_t special = word & repeatedByte(0x80);
+        if (inString)
+        {
+            special |= zeroBytes(word & repeatedByte(0xE0)) // < 0x20
+                    | zeroBytes(word ^ repeatedByte('"'))
+                    | zeroBytes(word ^ repeatedByte('\\'));
+        }
+        if (special != 0)
+        {
+            break;
+        }
+        pos += 8;
+    }
+    return pos - start;
+}
+
+/**
+ * @brief Length of the UTF-8 sequence at \p pos, 0 if it is invalid.
+ */
+int utf8SequenceLength(const unsigned char * data, qsizetype pos, qsizetype size)
+{
+    const unsigned char lead = data[pos];
+    if (lead < 0x80)
+    {
+        return 1;
+    }
+    int length = 0;
+    unsigned char min = 0x80;
+    unsigned char max = 0xBF;
+    if (lead >= 0xC2 && lead <= 0xDF)
+    {
+        length = 2;
+    }
+    else if (lead >= 0xE0 && lead <= 0xEF)
+    {
+        length = 3;
+        if (lead == 0xE0)
+        {
+            min = 0xA0; // overlong
+        }
+        else if (lead == 0xED)
+        {
+            max = 0x9F; // surrogates
+        }
+    }
+    else if (lead >= 0xF0 && lead <= 0xF4)
+    {
+        length = 4;
+        if (lead == 0xF0)
+        {
+            min = 0x90; // overlong
+        }
+        else if (lead == 0xF4)
+        {
+            max = 0x8F; // above U+10FFFF
+        }
+    }
+    else
+    {
+        return 0;
+    }
+    if (size - pos < length || data[pos + 1] < min || data[pos + 1] > max)
+    {
+        return 0;
+    }
+    for (int i = 2; i < length; ++i)
+    {
+        if ((data[pos + i] & 0xC0) != 0x80)
+        {
+            return 0;
+        }
+    }
+    return length;
+}
+
+class JsonParser
+{
+public:
+    JsonParser(const char * data, qsizetype size)
+        : m_data(reinterpret_cast<const unsigned char *>(data))
+        , m_size(size)
+    {}
+
+    bool parse()
+    {
+        skipWhitespace();
+        if (!parseValue(0))
+        {
+            return false;
+        }
+        skipWhitespace();
+        return m_pos == m_size;
+    }
+
+private:
+    bool atEnd() const { return m_pos >= m_size; }
+    unsigned char peek() const { return m_data[m_pos]; }
+
+    void skipWhitespace()
+    {
+        while (!atEnd() && (peek() == ' ' || peek() == '\t' || peek() == '\n' || peek() == '\r'))
+        {
+            ++m_pos;
+        }
+    }
+
+    bool consume(unsigned char c)
+    {
+        if (atEnd() || peek() != c)
+        {
+            return false;
+        }
+        ++m_pos;
+        return true;
+    }
+
+    bool parseLiteral(const char * literal)
+    {
+        for (; *literal; ++literal)
+        {
+            if (!consume(static_cast<unsigned char>(*literal)))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool parseValue(int depth)
+    {
+        if (atEnd())
+        {
+            return false;
+        }
+        switch (peek())
+        {
+        case '{': return parseObject(depth + 1);
+        case '[': return parseArray(depth + 1);
+        case '"': return parseString();
+        case 't': return parseLiteral("true");
+        case 'f': return parseLiteral("false");
+        case 'n': return parseLiteral("null");
+        default: return parseNumber();
+        }
+    }
+
+    bool parseObject(int depth)
+    {
+        if (depth > maxDepth)
+        {
+            return false;
+        }
+        ++m_pos;
+        skipWhitespace();
+        if (consume('}'))
+        {
+            return true;
+        }
+        for (;;)
+        {
+            skipWhitespace();
+            if (atEnd() || peek() != '"' || !parseString())
+            {
+                return false;
+            }
+            skipWhitespace();
+            if (!consume(':'))
+            {
+                return false;
+            }
+            skipWhitespace();
+            if (!parseValue(depth))
+            {
+                return false;
+            }
+            skipWhitespace();
+            if (consume('}'))
+            {
+                return true;
+            }
+            if (!consume(','))
+            {
+                return false;
+            }
+        }
+    }
+
+    bool parseArray(int depth)
+    {
+        if (depth > maxDepth)
+        {
+            return false;
+        }
+        ++m_pos;
+        skipWhitespace();
+        if (consume(']'))
+        {
+            return true;
+        }
+        for (;;)
+        {
+            skipWhitespace();
+            if (!parseValue(depth))
+            {
+                return false;
+            }
+            skipWhitespace();
+            if (consume(']'))
+            {
+                return true;
+            }
+            if (!consume(','))
+            {
+                return false;
+            }
+        }
+    }
+
+    bool parseHex4(unsigned & value)
+    {
+        if (m_size - m_pos < 4)
+        {
+            return false;
+        }
+        value = 0;
+        for (int i = 0; i < 4; ++i)
+        {
+            const unsigned char c = m_data[m_pos++];
+            value <<= 4;
+            if (c >= '0' && c <= '9')
+            {
+                value |= c - '0';
+            }
+            else if (c >= 'a' && c <= 'f')
+            {
+                value |= c - 'a' + 10;
+            }
+            else if (c >= 'A' && c <= 'F')
+            {
+                value |= c - 'A' + 10;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool parseEscape()
+    {
+        if (atEnd())
+        {
+            return false;
+        }
+        const unsigned char c = m_data[m_pos++];
+        switch (c)
+        {
+        case '"': case '\\': case '/': case 'b': case 'f': case 'n': case 'r': case 't':
+            return true;
+        case 'u':
+        {
+            unsigned value = 0;
+            if (!parseHex4(value) || value == 0 || (value >= 0xDC00 && value <= 0xDFFF))
+            {
+                return false;
+            }
+            if (value >= 0xD800 && value <= 0xDBFF)
+            {
+                unsigned low = 0;
+                return consume('\\') && consume('u') && parseHex4(low) && low >= 0xDC00 && low <= 0xDFFF;
+            }
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    bool parseString()
+    {
+        ++m_pos;
+        while (!atEnd())
+        {
+            m_pos += plainAsciiLength(m_data, m_pos, m_size, true);
+            if (atEnd())
+            {
+                break;
+            }
+            const unsigned char c = peek();
+            if (c == '"')
+            {
+                ++m_pos;
+                return true;
+            }
+            if (c == '\\')
+            {
+                ++m_pos;
+                if (!parseEscape())
+                {
+                    return false;
+                }
+            }
+            else if (c < 0x20)
+            {
+                return false;
+            }
+            else
+            {
+                const int length = utf8SequenceLength(m_data, m_pos, m_size);
+                if (length == 0)
+                {
+                    return false;
+                }
+                m_pos += length;
+            }
+        }
+        return false;
+    }
+
+    bool parseDigits()
+    {
+        const qsizetype start = m_pos;
+        while (!atEnd() && peek() >= '0' && peek() <= '9')
+        {
+            ++m_pos;
+        }
+        return m_pos > start;
+    }
+
+    bool parseNumber()
+    {
+        consume('-');
+        if (consume('0'))
+        {
+            // No leading zeros.
+        }
+        else if (!parseDigits())
+        {
+            return false;
+        }
+        if (consume('.') && !parseDigits())
+        {
+            return false;
+        }
+        if (consume('e') || consume('E'))
+        {
+            if (!consume('+'))
+            {
+                consume('-');
+            }
+            if (!parseDigits())
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const unsigned char * m_data;
+    qsizetype m_size;
+    qsizetype m_pos = 0;
+};
+
+} // namespace
+
+bool isValidUtf8(const char * data, qsizetype size)
+{
+    const auto * bytes = reinterpret_cast<const unsigned char *>(data);
+    qsizetype pos = 0;
+    while (pos < size)
+    {
+        // Skip ASCII quickly, it is the common case for MQTT payloads.
+        pos += plainAsciiLength(bytes, pos, size, false);
+        if (pos >= size)
+        {
+            break;
+        }
+        if (bytes[pos] < 0x80)
+        {
+            ++pos;
+            continue;
+        }
+        const int length = utf8SequenceLength(bytes, pos, size);
+        if (length == 0)
+        {
+            return false;
+        }
+        pos += length;
+    }
+    return true;
+}
+
+bool isValidJson(const QByteArray & data)
+{
+    return JsonParser(data.constData(), data.size()).parse();
+}
+
+/**
+ * @brief Classify \p data for storage, \p number is set for \ref PayloadType::Number.
+ *
+ * Numbers out of the double range are kept as JSON.
+ */
+PayloadType classifyPayload(const QByteArray & data, double & number)
+{
+    if (!isValidJson(data))
+    {
+        return PayloadType::Binary;
+    }
+    for (char c : data)
+    {
+        if (c == ' ' || c == '\t' || c == '\n' || c == '\r')
+        {
+            continue;
+        }
+        if (c != '-' && (c < '0' || c > '9'))
+        {
+            return PayloadType::Json;
+        }
+        bool ok = false;
+        number = data.toDouble(&ok);
+        return ok ? PayloadType::Number : PayloadType::Json;
+    }
+    return PayloadType::Json;
+}
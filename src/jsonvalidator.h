@@ -0,0 +1,54 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef JSONVALIDATOR_H
+#define JSONVALIDATOR_H
+
+#include <QByteArray>
+
+/// Kind of a payload, see \ref classifyPayload.
+enum class PayloadType
+{
+    /// Valid JSON, stored as jsonb.
+    Json,
+    /// A single JSON number, stored as double precision.
+    Number,
+    /// Anything else, stored as bytea.
+    Binary
+};
+
+/**
+ * @brief Check that \p data is valid UTF-8, without decoding it.
+ *
+ * Overlong encodings, surrogates and code points above U+10FFFF are rejected.
+ */
+bool isValidUtf8(const char * data, qsizetype size);
+
+/**
+ * @brief Check that \p data is a JSON text PostgreSQL accepts as jsonb.
+ *
+ * Validates the syntax and the UTF-8 encoding in a single pass over the bytes, without
+ * allocating or transcoding. Besides the JSON rules, \u0000 escapes and unpaired surrogate
+ * escapes are rejected like PostgreSQL does.
+ */
+bool isValidJson(const QByteArray & data);
+
+PayloadType classifyPayload(const QByteArray & data, double & number);
+
+#endif // JSONVALIDATOR_H
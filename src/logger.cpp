@@ -0,0 +1,197 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "logger.h"
+
+#include <QTextStream>
+
+#include <cstdio>
+
+Logger & Logger::instance()
+{
+    static Logger logger;
+    return logger;
+}
+
+Logger::~Logger()
+{
+    stop();
+}
+
+/**
+ * @brief Allow at most \p lines lines per key of \ref logLimited within \p interval.
+ */
+void Logger::setRateLimit(int lines, std::chrono::seconds interval)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_limitLines = lines;
+    m_limitInterval = interval;
+}
+
+void Logger::log(LogLevel level, const QString & message)
+{
+    if (isEnabled(level))
+    {
+        enqueue(level, message);
+    }
+}
+
+/**
+ * @brief Log \p message, unless more than the allowed number of lines with \p key were logged in the current interval.
+ */
+void Logger::logLimited(LogLevel level, const char * key, const QString & message)
+{
+    if (!isEnabled(level))
+    {
+        return;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    int suppressed = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        Limit & limit = m_limits[QByteArray(key)];
+        if (now - limit.windowStart >= m_limitInterval)
+        {
+            suppressed = limit.suppressed;
+            limit = Limit();
+            limit.windowStart = now;
+        }
+        if (limit.lines >= m_limitLines)
+        {
+            ++limit.suppressed;
+            return;
+        }
+        ++limit.lines;
+    }
+    if (suppressed > 0)
+    {
+        enqueue(level, QString("%1 similar messages suppressed (%2)").arg(suppressed).arg(QLatin1String(key)));
+    }
+    enqueue(level, message);
+}
+
+void Logger::enqueue(LogLevel level, const QString & message)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    if (!m_running)
+    {
+        // Before start and after stop lines are written directly.
+        lock.unlock();
+        write({{level, message}});
+        return;
+    }
+    m_lines.append({level, message});
+    m_condition.notify_one();
+}
+
+/**
+ * @brief Start the sink thread.
+ */
+void Logger::start()
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_running)
+    {
+        return;
+    }
+    m_running = true;
+    m_thread = std::thread(&Logger::run, this);
+}
+
+/**
+ * @brief Write all queued lines and stop the sink thread.
+ */
+void Logger::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_running)
+        {
+            return;
+        }
+        m_running = false;
+        m_condition.notify_one();
+    }
+    m_thread.join();
+}
+
+bool Logger::parseLevel(const QString & name, LogLevel & level)
+{
+    if (name == "error")
+    {
+        level = LogLevel::Error;
+    }
+    else if (name == "warning")
+    {
+        level = LogLevel::Warning;
+    }
+    else if (name == "info")
+    {
+        level = LogLevel::Info;
+    }
+    else if (name == "debug")
+    {
+        level = LogLevel::Debug;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Sink loop, writes all lines queued since the last wakeup at once.
+ */
+void Logger::run()
+{
+    QVector<Line> lines;
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;)
+    {
+        m_condition.wait(lock, [this]() { return !m_lines.isEmpty() || !m_running; });
+        lines.swap(m_lines);
+        const bool running = m_running;
+        lock.unlock();
+        write(lines);
+        lines.clear();
+        lock.lock();
+        if (!running && m_lines.isEmpty())
+        {
+            break;
+        }
+    }
+}
+
+void Logger::write(const QVector<Line> & lines)
+{
+    if (lines.isEmpty())
+    {
+        return;
+    }
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+    for (const Line & line : lines)
+    {
+        (line.level <= LogLevel::Warning ? err : out) << line.message << '\n';
+    }
+    out.flush();
+    err.flush();
+}
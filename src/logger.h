@@ -0,0 +1,100 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+/// Severity of a log line, lower values are more severe.
+enum class LogLevel { Error, Warning, Info, Debug };
+
+/**
+ * @brief Leveled logger with a background sink thread.
+ *
+ * Log lines are queued and written by the sink thread, errors and warnings to stderr,
+ * everything else to stdout. Callers on hot paths check \ref isEnabled before formatting
+ * a line, so disabled levels cost a single atomic load. Lines logged with \ref logLimited
+ * are rate limited by their key, the number of suppressed lines is reported once the
+ * interval has passed.
+ */
+class Logger
+{
+public:
+    static Logger & instance();
+
+    void setLevel(LogLevel level) { m_level.store(static_cast<int>(level), std::memory_order_relaxed); }
+    bool isEnabled(LogLevel level) const { return static_cast<int>(level) <= m_level.load(std::memory_order_relaxed); }
+    void setRateLimit(int lines, std::chrono::seconds interval);
+
+    void log(LogLevel level, const QString & message);
+    void logLimited(LogLevel level, const char * key, const QString & message);
+
+    void start();
+    void stop();
+
+    static bool parseLevel(const QString & name, LogLevel & level);
+
+private:
+    struct Line
+    {
+        LogLevel level;
+        QString message;
+    };
+
+    struct Limit
+    {
+        std::chrono::steady_clock::time_point windowStart;
+        int lines = 0;
+        int suppressed = 0;
+    };
+
+    Logger() = default;
+    ~Logger();
+
+    void enqueue(LogLevel level, const QString & message);
+    void write(const QVector<Line> & lines);
+    void run();
+
+    std::atomic<int> m_level {static_cast<int>(LogLevel::Info)};
+    std::mutex m_mutex;
+    std::condition_variable m_condition;
+    QVector<Line> m_lines;
+    QHash<QByteArray, Limit> m_limits;
+    int m_limitLines = 10;
+    std::chrono::seconds m_limitInterval {60};
+    std::thread m_thread;
+    bool m_running = false;
+};
+
+inline void logError(const QString & message) { Logger::instance().log(LogLevel::Error, message); }
+inline void logWarning(const QString & message) { Logger::instance().log(LogLevel::Warning, message); }
+inline void logInfo(const QString & message) { Logger::instance().log(LogLevel::Info, message); }
+inline void logDebug(const QString & message) { Logger::instance().log(LogLevel::Debug, message); }
+
+#endif // LOGGER_H
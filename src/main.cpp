@@ -21,8 +21,12 @@
 #include <QCommandLineParser>
 #include <QCommandLineOption>
 
+#include <csignal>
+
+#include "logger.h"
 #include "mqtt2sqlconfig.h"
 #include "mqttsubscriber.h"
+#include "signalnotifier.h"
 
 static constexpr const char * version = "0.0.1";
 static constexpr const char * applicationname = "QMQTT2SQL";
@@ -74,14 +78,41 @@ int main(int argc, char *argv[])
         ::exit(configErrorExitCode);
     }
 
+    Logger & logger = Logger::instance();
+    logger.setLevel(config.logLevel());
+    logger.setRateLimit(config.logRateLimit(), config.logRateInterval());
+    logger.start();
+
+    // Leaving the event loop destroys the subscriber, which writes the queued messages and the open windows.
     MqttSubscriber mc(config);
     QObject::connect(&mc, &MqttSubscriber::errorOccured, qApp, [](const QString & error, int exitcode){
-        QTextStream(stderr) << error << Qt::endl;
+        logError(error);
         if (exitcode != 0)
         {
-            ::exit(exitcode);
+            QCoreApplication::exit(exitcode);
+        }
+    });
+
+#ifdef Q_OS_UNIX
+    // SIGHUP reloads the config, the running config is only replaced by a file without errors.
+    SignalNotifier signalNotifier({SIGTERM, SIGINT, SIGHUP});
+    QObject::connect(&signalNotifier, &SignalNotifier::received, &mc, [&mc, configFile](int signalNumber) {
+        if (signalNumber != SIGHUP)
+        {
+            logInfo("Stopping, writing queued messages.");
+            QCoreApplication::quit();
+            return;
+        }
+        logInfo("Reloading config file " + configFile);
+        Mqtt2SqlConfig reloaded;
+        if (!reloaded.parse(configFile))
+        {
+            logError("Error while reading config file: " + configFile + ", config not reloaded. " + reloaded.lastError());
+            return;
         }
+        mc.reload(reloaded);
     });
+#endif
 
     return a.exec();
 }
@@ -0,0 +1,116 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "messagerouter.h"
+
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QJsonValue>
+
+#include <cstring>
+
+MessageRouter::MessageRouter(const QVector<Mqtt2SqlConfig::Route> & routes)
+    : m_routes(routes)
+{
+    for (int i = 0; i < m_routes.size(); ++i)
+    {
+        // Routes without filter, like the one of the aggregation table, are only assigned explicitly.
+        if (!m_routes.at(i).filter.isEmpty())
+        {
+            m_matcher.addFilter(m_routes.at(i).filter, i);
+        }
+    }
+}
+
+/**
+ * @brief Columns written for \p route, or for the mqtt table if \p route is nullptr.
+ *
+ * With classified payloads the payload is written to one of the columns data, value and raw,
+ * compressed payloads are always written to the bytea column data.
+ */
+QStringList MessageRouter::columnNames(const Mqtt2SqlConfig::Route * route, const Mqtt2SqlConfig & config)
+{
+    QStringList names {"ts", config.sqlTopicColumn()};
+    if (!route || route->storeData)
+    {
+        names << "data";
+        if (config.sqlClassifyPayloads() && !(route && route->compress))
+        {
+            names << "value" << "raw";
+        }
+    }
+    if (route)
+    {
+        for (const Mqtt2SqlConfig::RouteColumn & column : route->columns)
+        {
+            names << column.name;
+        }
+    }
+    return names;
+}
+
+/**
+ * @brief Extract the typed column values of \p route from the JSON object in the payload of \p record.
+ *
+ * Missing fields and payloads which are not a JSON object give NULL values, nested
+ * objects and arrays are returned as compact JSON text. The values of aggregate records
+ * are taken from their \ref AggregateWindow, in the column order of the aggregate route.
+ */
+QVariantList MessageRouter::columnValues(const MqttRecord & record, const Mqtt2SqlConfig::Route & route)
+{
+    QVariantList values;
+    values.reserve(route.columns.size());
+    if (record.aggregate)
+    {
+        AggregateWindow window;
+        if (record.payload.size() == static_cast<int>(sizeof(window)))
+        {
+            std::memcpy(&window, record.payload.constData(), sizeof(window));
+            values << window.windowMs << window.count << window.min << window.max << window.avg;
+        }
+        while (values.size() < route.columns.size())
+        {
+            values << QVariant();
+        }
+        return values;
+    }
+    const QJsonObject object = QJsonDocument::fromJson(record.payload).object();
+    for (const Mqtt2SqlConfig::RouteColumn & column : route.columns)
+    {
+        const QJsonValue value = object.value(column.name);
+        if (value.isObject())
+        {
+            values << QString::fromUtf8(QJsonDocument(value.toObject()).toJson(QJsonDocument::Compact));
+        }
+        else if (value.isArray())
+        {
+            values << QString::fromUtf8(QJsonDocument(value.toArray()).toJson(QJsonDocument::Compact));
+        }
+        else if (value.isUndefined() || value.isNull())
+        {
+            values << QVariant();
+        }
+        else
+        {
+            values << value.toVariant();
+        }
+    }
+    return values;
+}
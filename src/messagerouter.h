@@ -0,0 +1,60 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef MESSAGEROUTER_H
+#define MESSAGEROUTER_H
+
+#include <QByteArray>
+#include <QStringList>
+#include <QVariantList>
+#include <QVector>
+
+#include "mqtt2sqlconfig.h"
+#include "mqttrecord.h"
+#include "topicmatcher.h"
+
+/**
+ * @brief Assigns received messages to the routes of the [routes] config section.
+ *
+ * The topic filters of all routes are compiled into one \ref TopicMatcher, the first
+ * matching route in config order wins. Messages without a matching route are stored
+ * in the mqtt table. The router is not changed after construction and may be used
+ * from all threads.
+ */
+class MessageRouter
+{
+public:
+    explicit MessageRouter(const QVector<Mqtt2SqlConfig::Route> & routes);
+
+    bool isEmpty() const { return m_routes.isEmpty(); }
+    int size() const { return m_routes.size(); }
+
+    /// Returns the index of the route for \p topic, or -1 for the mqtt table.
+    int route(QStringView topic) const { return m_matcher.match(topic); }
+    const Mqtt2SqlConfig::Route & at(int route) const { return m_routes.at(route); }
+
+    static QStringList columnNames(const Mqtt2SqlConfig::Route * route, const Mqtt2SqlConfig & config);
+    static QVariantList columnValues(const MqttRecord & record, const Mqtt2SqlConfig::Route & route);
+
+private:
+    QVector<Mqtt2SqlConfig::Route> m_routes;
+    TopicMatcher m_matcher;
+};
+
+#endif // MESSAGEROUTER_H
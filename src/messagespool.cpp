@@ -0,0 +1,292 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "messagespool.h"
+
+#include <QFileInfo>
+#include <QMutexLocker>
+#include <QtEndian>
+
+#include <cstring>
+
+#ifdef Q_OS_UNIX
+#include <sys/mman.h>
+#endif
+
+namespace {
+
+/// Marks the start of every record, zero filled space after the last record ends the segment.
+constexpr quint32 recordMagic = 0x31505351; // "QSP1"
+/// Marks the start of a window record of the Aggregator, the spool does not store routes.
+constexpr quint32 aggregateMagic = 0x32505351; // "QSP2"
+
+/// magic, topic size, payload size (all quint32) and the timestamp in ms since epoch (qint64).
+constexpr qint64 recordHeaderSize = 3 * sizeof(quint32) + sizeof(qint64);
+
+QString segmentFileName(quint64 number)
+{
+    return QString("%1.spool").arg(number, 16, 10, QChar('0'));
+}
+
+} // namespace
+
+MessageSpool::MessageSpool(const QString & directory, qint64 segmentSize, qint64 maxSize)
+    : m_directory(directory)
+    , m_segmentSize(segmentSize)
+    , m_maxSize(maxSize)
+{}
+
+MessageSpool::~MessageSpool()
+{
+    QMutexLocker locker(&m_mutex);
+    sealLocked();
+}
+
+/**
+ * @brief Create the spool directory and pick up segments of a previous run.
+ */
+bool MessageSpool::open()
+{
+    QMutexLocker locker(&m_mutex);
+    if (!m_directory.mkpath("."))
+    {
+        m_lastError = "Error: can not create spool directory: " + m_directory.path();
+        return false;
+    }
+
+    m_sealed = m_directory.entryList({"*.spool"}, QDir::Files, QDir::Name);
+    for (const QString & fileName : std::as_const(m_sealed))
+    {
+        const qint64 size = QFileInfo(m_directory.filePath(fileName)).size();
+        m_totalSize += size;
+        m_pendingBytes.fetch_add(size, std::memory_order_relaxed);
+        m_nextNumber = qMax(m_nextNumber, QFileInfo(fileName).baseName().toULongLong() + 1);
+    }
+    return true;
+}
+
+bool MessageSpool::append(const MqttRecord & record)
+{
+    QMutexLocker locker(&m_mutex);
+    return appendLocked(record);
+}
+
+/**
+ * @brief Append all \p records, returns false if at least one record did not fit into the spool.
+ */
+bool MessageSpool::append(const QVector<MqttRecord> & records)
+{
+    QMutexLocker locker(&m_mutex);
+    bool ok = true;
+    for (const MqttRecord & record : records)
+    {
+        ok = appendLocked(record) && ok;
+    }
+    return ok;
+}
+
+bool MessageSpool::appendLocked(const MqttRecord & record)
+{
+    const QByteArray topic = record.topic.toUtf8();
+    const qint64 size = recordHeaderSize + topic.size() + record.payload.size();
+    if (!m_map || m_offset + size > m_mapSize)
+    {
+        sealLocked();
+        if (!openSegmentLocked(qMax(m_segmentSize, size)))
+        {
+            return false;
+        }
+    }
+
+    uchar * data = m_map + m_offset;
+    qToLittleEndian<quint32>(record.aggregate ? aggregateMagic : recordMagic, data);
+    qToLittleEndian<quint32>(topic.size(), data + 4);
+    qToLittleEndian<quint32>(record.payload.size(), data + 8);
+    qToLittleEndian<qint64>(record.ts, data + 12);
+    std::memcpy(data + recordHeaderSize, topic.constData(), topic.size());
+    std::memcpy(data + recordHeaderSize + topic.size(), record.payload.constData(), record.payload.size());
+    m_offset += size;
+    m_pendingBytes.fetch_add(size, std::memory_order_relaxed);
+    return true;
+}
+
+/**
+ * @brief Start a new zero filled segment of \p size bytes and map it into memory.
+ */
+bool MessageSpool::openSegmentLocked(qint64 size)
+{
+    if (m_totalSize + size > m_maxSize)
+    {
+        m_lastError = "Error: spool is full.";
+        return false;
+    }
+
+    m_file.setFileName(m_directory.filePath(segmentFileName(m_nextNumber++)));
+    if (!m_file.open(QIODevice::ReadWrite | QIODevice::Truncate) || !m_file.resize(size))
+    {
+        m_lastError = "Error: can not create spool segment " + m_file.fileName() + ": " + m_file.errorString();
+        m_file.close();
+        m_file.remove();
+        return false;
+    }
+    m_map = m_file.map(0, size);
+    if (!m_map)
+    {
+        m_lastError = "Error: can not map spool segment " + m_file.fileName() + ": " + m_file.errorString();
+        m_file.close();
+        m_file.remove();
+        return false;
+    }
+    m_mapSize = size;
+    m_offset = 0;
+    m_totalSize += size;
+    return true;
+}
+
+/**
+ * @brief Unmap the current segment, truncate it to the used size and queue it for the writers.
+ */
+void MessageSpool::sealLocked()
+{
+    if (!m_map)
+    {
+        return;
+    }
+
+#ifdef Q_OS_UNIX
+    ::msync(m_map, m_mapSize, MS_SYNC);
+#endif
+    m_file.unmap(m_map);
+    m_map = nullptr;
+    m_totalSize -= m_mapSize - m_offset;
+    if (m_offset > 0)
+    {
+        m_file.resize(m_offset);
+        m_file.close();
+        m_sealed.append(QFileInfo(m_file).fileName());
+    }
+    else
+    {
+        m_file.close();
+        m_file.remove();
+    }
+    m_mapSize = 0;
+    m_offset = 0;
+}
+
+/**
+ * @brief Take the oldest segment, sealing the current one if there is no other.
+ *
+ * The segment stays on disk until it is handed back with \ref releaseSegment.
+ * An unreadable segment is returned without records, so it is deleted on release.
+ */
+bool MessageSpool::takeSegment(Segment & segment)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        if (m_sealed.isEmpty())
+        {
+            sealLocked();
+        }
+        if (m_sealed.isEmpty())
+        {
+            return false;
+        }
+        segment.fileName = m_sealed.takeFirst();
+        m_pendingBytes.fetch_sub(QFileInfo(m_directory.filePath(segment.fileName)).size(), std::memory_order_relaxed);
+    }
+
+    segment.records.clear();
+    if (!readSegment(m_directory.filePath(segment.fileName), segment.records))
+    {
+        QMutexLocker locker(&m_mutex);
+        m_lastError = "Error: can not read spool segment " + segment.fileName;
+    }
+    return true;
+}
+
+/**
+ * @brief Hand back a segment taken with \ref takeSegment.
+ *
+ * If \p written is true the segment file is deleted, otherwise it is queued again as oldest segment.
+ */
+void MessageSpool::releaseSegment(const Segment & segment, bool written)
+{
+    QMutexLocker locker(&m_mutex);
+    const QString filePath = m_directory.filePath(segment.fileName);
+    const qint64 size = QFileInfo(filePath).size();
+    if (written)
+    {
+        QFile::remove(filePath);
+        m_totalSize -= size;
+    }
+    else
+    {
+        m_sealed.prepend(segment.fileName);
+        m_pendingBytes.fetch_add(size, std::memory_order_relaxed);
+    }
+}
+
+QString MessageSpool::lastError() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_lastError;
+}
+
+/**
+ * @brief Read all records of a sealed segment, a truncated last record is ignored.
+ */
+bool MessageSpool::readSegment(const QString & fileName, QVector<MqttRecord> & records) const
+{
+    QFile file(fileName);
+    if (!file.open(QIODevice::ReadOnly))
+    {
+        return false;
+    }
+    const qint64 size = file.size();
+    const uchar * data = size > 0 ? file.map(0, size) : nullptr;
+    if (!data)
+    {
+        return size == 0;
+    }
+
+    qint64 offset = 0;
+    while (offset + recordHeaderSize <= size)
+    {
+        const quint32 magic = qFromLittleEndian<quint32>(data + offset);
+        if (magic != recordMagic && magic != aggregateMagic)
+        {
+            break;
+        }
+        const qint64 topicSize = qFromLittleEndian<quint32>(data + offset + 4);
+        const qint64 payloadSize = qFromLittleEndian<quint32>(data + offset + 8);
+        if (offset + recordHeaderSize + topicSize + payloadSize > size)
+        {
+            break;
+        }
+        const qint64 ts = qFromLittleEndian<qint64>(data + offset + 12);
+        const char * topic = reinterpret_cast<const char *>(data + offset + recordHeaderSize);
+        records.append({ts,
+                        QString::fromUtf8(topic, topicSize),
+                        QByteArray(topic + topicSize, payloadSize)});
+        records.last().aggregate = magic == aggregateMagic;
+        offset += recordHeaderSize + topicSize + payloadSize;
+    }
+    return true;
+}
@@ -0,0 +1,93 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef MESSAGESPOOL_H
+#define MESSAGESPOOL_H
+
+#include <QDir>
+#include <QFile>
+#include <QMutex>
+#include <QStringList>
+#include <QVector>
+
+#include <atomic>
+
+#include "mqttrecord.h"
+
+/**
+ * @brief Append-only on-disk spool for messages that can not be written to the database.
+ *
+ * Messages are appended to memory mapped segment files of a fixed size in the spool
+ * directory. A full segment is sealed and a new one is started, the total size of all
+ * segments is limited. Writers take whole segments, write their messages and release
+ * them, which deletes the segment file. Segments left over from a previous run are
+ * picked up on \ref open. All methods are thread-safe.
+ */
+class MessageSpool
+{
+public:
+    /// A sealed segment taken by a writer.
+    struct Segment
+    {
+        QString fileName;
+        QVector<MqttRecord> records;
+    };
+
+    MessageSpool(const QString & directory, qint64 segmentSize, qint64 maxSize);
+    ~MessageSpool();
+
+    MessageSpool(const MessageSpool &) = delete;
+    MessageSpool & operator=(const MessageSpool &) = delete;
+
+    bool open();
+
+    bool append(const MqttRecord & record);
+    bool append(const QVector<MqttRecord> & records);
+
+    /// True if there are spooled messages which are not taken by a writer.
+    bool hasData() const { return m_pendingBytes.load(std::memory_order_relaxed) > 0; }
+    qint64 pendingBytes() const { return m_pendingBytes.load(std::memory_order_relaxed); }
+
+    bool takeSegment(Segment & segment);
+    void releaseSegment(const Segment & segment, bool written);
+
+    QString lastError() const;
+
+private:
+    bool appendLocked(const MqttRecord & record);
+    bool openSegmentLocked(qint64 minimumSize);
+    void sealLocked();
+    bool readSegment(const QString & fileName, QVector<MqttRecord> & records) const;
+
+    mutable QMutex m_mutex;
+    QDir m_directory;
+    qint64 m_segmentSize;
+    qint64 m_maxSize;
+    QStringList m_sealed;
+    QFile m_file;
+    uchar * m_map = nullptr;
+    qint64 m_mapSize = 0;
+    qint64 m_offset = 0;
+    quint64 m_nextNumber = 0;
+    qint64 m_totalSize = 0;
+    std::atomic<qint64> m_pendingBytes {0};
+    QString m_lastError;
+};
+
+#endif // MESSAGESPOOL_H
@@ -0,0 +1,145 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "metrics.h"
+
+#include <algorithm>
+
+MetricsHistogram::MetricsHistogram(std::initializer_list<double> bounds)
+{
+    for (double bound : bounds)
+    {
+        if (m_boundCount < MaxBounds)
+        {
+            m_bounds[m_boundCount++] = bound;
+        }
+    }
+}
+
+void MetricsHistogram::observe(double value)
+{
+    const auto end = m_bounds.cbegin() + m_boundCount;
+    const int index = static_cast<int>(std::lower_bound(m_bounds.cbegin(), end, value) - m_bounds.cbegin());
+    m_buckets[index].store(m_buckets[index].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    m_sum.store(m_sum.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+/**
+ * @brief Add a shard for a new thread, the shard lives as long as this object.
+ */
+MetricsShard * Metrics::addShard()
+{
+    m_shards.push_back(std::make_unique<MetricsShard>());
+    return m_shards.back().get();
+}
+
+/**
+ * @brief Add a gauge, \p value is called by the thread collecting the metrics.
+ */
+void Metrics::addGauge(const char * name, const char * help, std::function<double()> value)
+{
+    m_gauges.append({name, help, std::move(value)});
+}
+
+/**
+ * @brief Metrics of all shards and gauges in the Prometheus text format.
+ */
+QByteArray Metrics::exposition() const
+{
+    QByteArray out;
+    appendCounter(out, "qmqtt2sql_messages_received_total", "Messages received from the MQTT broker.",
+                  &MetricsShard::messagesReceived);
+    appendCounter(out, "qmqtt2sql_messages_inserted_total", "Messages written to the database.",
+                  &MetricsShard::messagesInserted);
+    appendCounter(out, "qmqtt2sql_messages_spooled_total", "Messages appended to the spool.",
+                  &MetricsShard::messagesSpooled);
+    appendCounter(out, "qmqtt2sql_messages_dropped_total", "Messages dropped because of errors.",
+                  &MetricsShard::messagesDropped);
+    appendCounter(out, "qmqtt2sql_messages_duplicate_total", "Duplicate and retained messages that were skipped.",
+                  &MetricsShard::messagesDuplicate);
+    appendCounter(out, "qmqtt2sql_messages_aggregated_total", "Messages added to an aggregation window.",
+                  &MetricsShard::messagesAggregated);
+    appendCounter(out, "qmqtt2sql_batches_failed_total", "Batches the database did not accept.",
+                  &MetricsShard::batchesFailed);
+    appendCounter(out, "qmqtt2sql_rows_deleted_total", "Expired rows deleted by the cleanup.",
+                  &MetricsShard::rowsDeleted);
+    appendCounter(out, "qmqtt2sql_payload_bytes_total", "Payload bytes of compressed routes before compression.",
+                  &MetricsShard::payloadBytes);
+    appendCounter(out, "qmqtt2sql_compressed_bytes_total", "Payload bytes of compressed routes after compression.",
+                  &MetricsShard::compressedBytes);
+    appendHistogram(out, "qmqtt2sql_batch_size", "Messages per written batch.",
+                    &MetricsShard::batchSize);
+    appendHistogram(out, "qmqtt2sql_commit_seconds", "Time to write and commit a batch.",
+                    &MetricsShard::commitSeconds);
+    appendHistogram(out, "qmqtt2sql_lag_seconds", "Time from receiving a message until its batch is committed.",
+                    &MetricsShard::lagSeconds);
+    appendHistogram(out, "qmqtt2sql_cleanup_seconds", "Duration of the cleanup of expired messages.",
+                    &MetricsShard::cleanupSeconds);
+    for (const Gauge & gauge : m_gauges)
+    {
+        out += QByteArray("# HELP ") + gauge.name + ' ' + gauge.help + '\n';
+        out += QByteArray("# TYPE ") + gauge.name + " gauge\n";
+        out += QByteArray(gauge.name) + ' ' + QByteArray::number(gauge.value()) + '\n';
+    }
+    return out;
+}
+
+void Metrics::appendCounter(QByteArray & out, const char * name, const char * help,
+                            MetricsCounter MetricsShard::*counter) const
+{
+    quint64 value = 0;
+    for (const auto & shard : m_shards)
+    {
+        value += ((*shard).*counter).value();
+    }
+    out += QByteArray("# HELP ") + name + ' ' + help + '\n';
+    out += QByteArray("# TYPE ") + name + " counter\n";
+    out += QByteArray(name) + ' ' + QByteArray::number(value) + '\n';
+}
+
+void Metrics::appendHistogram(QByteArray & out, const char * name, const char * help,
+                              MetricsHistogram MetricsShard::*histogram) const
+{
+    out += QByteArray("# HELP ") + name + ' ' + help + '\n';
+    out += QByteArray("# TYPE ") + name + " histogram\n";
+    if (m_shards.empty())
+    {
+        return;
+    }
+
+    // All shards use the same bounds.
+    const MetricsHistogram & first = (*m_shards.front()).*histogram;
+    quint64 cumulative = 0;
+    double sum = 0;
+    for (int i = 0; i <= first.boundCount(); ++i)
+    {
+        for (const auto & shard : m_shards)
+        {
+            cumulative += ((*shard).*histogram).bucket(i);
+        }
+        const QByteArray le = i < first.boundCount() ? QByteArray::number(first.bound(i)) : QByteArray("+Inf");
+        out += QByteArray(name) + "_bucket{le=\"" + le + "\"} " + QByteArray::number(cumulative) + '\n';
+    }
+    for (const auto & shard : m_shards)
+    {
+        sum += ((*shard).*histogram).sum();
+    }
+    out += QByteArray(name) + "_sum " + QByteArray::number(sum) + '\n';
+    out += QByteArray(name) + "_count " + QByteArray::number(cumulative) + '\n';
+}
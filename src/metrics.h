@@ -0,0 +1,124 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <QByteArray>
+#include <QVector>
+
+#include <array>
+#include <atomic>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <vector>
+
+/**
+ * @brief Counter updated by a single thread.
+ *
+ * Only the thread owning the \ref MetricsShard adds to the counter, so a relaxed load and
+ * store replace the locked read-modify-write of fetch_add, the collector only reads.
+ */
+class MetricsCounter
+{
+public:
+    void add(quint64 value = 1) { m_value.store(m_value.load(std::memory_order_relaxed) + value, std::memory_order_relaxed); }
+    quint64 value() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<quint64> m_value {0};
+};
+
+/**
+ * @brief Histogram with fixed bucket bounds, updated by a single thread like \ref MetricsCounter.
+ */
+class MetricsHistogram
+{
+public:
+    static constexpr int MaxBounds = 16;
+
+    MetricsHistogram(std::initializer_list<double> bounds);
+
+    void observe(double value);
+
+    int boundCount() const { return m_boundCount; }
+    double bound(int index) const { return m_bounds[index]; }
+    /// Number of observations in the bucket \p index, the last bucket at \ref boundCount is +Inf.
+    quint64 bucket(int index) const { return m_buckets[index].load(std::memory_order_relaxed); }
+    double sum() const { return m_sum.load(std::memory_order_relaxed); }
+
+private:
+    std::array<double, MaxBounds> m_bounds {};
+    int m_boundCount = 0;
+    std::array<std::atomic<quint64>, MaxBounds + 1> m_buckets {};
+    std::atomic<double> m_sum {0};
+};
+
+/// Metrics of one thread, see \ref Metrics::addShard.
+struct MetricsShard
+{
+    MetricsCounter messagesReceived;
+    MetricsCounter messagesInserted;
+    MetricsCounter messagesSpooled;
+    MetricsCounter messagesDropped;
+    MetricsCounter messagesDuplicate;
+    MetricsCounter messagesAggregated;
+    MetricsCounter batchesFailed;
+    MetricsCounter rowsDeleted;
+    MetricsCounter payloadBytes;
+    MetricsCounter compressedBytes;
+    MetricsHistogram batchSize {1, 10, 50, 100, 500, 1000, 5000, 10000};
+    MetricsHistogram commitSeconds {0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10};
+    MetricsHistogram lagSeconds {0.01, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 300};
+    MetricsHistogram cleanupSeconds {0.01, 0.1, 0.5, 1, 5, 10, 30, 60, 300, 900};
+};
+
+/**
+ * @brief Collection of the \ref MetricsShard of all threads.
+ *
+ * Every thread updates its own shard, the shards are only summed up when the metrics are
+ * collected by \ref exposition. Shards and gauges have to be added before the threads start.
+ */
+class Metrics
+{
+public:
+    MetricsShard * addShard();
+    void addGauge(const char * name, const char * help, std::function<double()> value);
+
+    QByteArray exposition() const;
+
+private:
+    struct Gauge
+    {
+        const char * name;
+        const char * help;
+        std::function<double()> value;
+    };
+
+    void appendCounter(QByteArray & out, const char * name, const char * help,
+                       MetricsCounter MetricsShard::*counter) const;
+    void appendHistogram(QByteArray & out, const char * name, const char * help,
+                         MetricsHistogram MetricsShard::*histogram) const;
+
+    std::vector<std::unique_ptr<MetricsShard>> m_shards;
+    QVector<Gauge> m_gauges;
+};
+
+#endif // METRICS_H
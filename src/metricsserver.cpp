@@ -0,0 +1,102 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "metricsserver.h"
+#include "metrics.h"
+
+#include <QTcpSocket>
+#include <QTimer>
+
+#include <chrono>
+
+/// Requests with larger headers are rejected.
+static constexpr int maxRequestSize = 8192;
+/// Connections still open after this time are closed, e.g. clients which never send a complete request.
+static constexpr std::chrono::seconds requestTimeout {10};
+
+MetricsServer::MetricsServer(const Metrics & metrics, QObject *parent)
+    : QObject{parent}
+    , m_metrics(metrics)
+{
+    connect(&m_server, &QTcpServer::newConnection, this, &MetricsServer::onNewConnection);
+}
+
+bool MetricsServer::listen(const QHostAddress & address, quint16 port)
+{
+    return m_server.listen(address, port);
+}
+
+/**
+ * @brief Accept the pending connections, every connection is aborted after requestTimeout.
+ */
+void MetricsServer::onNewConnection()
+{
+    while (QTcpSocket * socket = m_server.nextPendingConnection())
+    {
+        m_requests.insert(socket, QByteArray());
+        // Bound to the socket, so the timer is gone once the socket is deleted.
+        QTimer::singleShot(requestTimeout, socket, [socket]() { socket->abort(); });
+        connect(socket, &QTcpSocket::readyRead, this, [this, socket]() { onReadyRead(socket); });
+        connect(socket, &QTcpSocket::disconnected, this, [this, socket]() {
+            m_requests.remove(socket);
+            socket->deleteLater();
+        });
+    }
+}
+
+/**
+ * @brief Collects the request header and answers once it is complete, the connection is closed afterwards.
+ */
+void MetricsServer::onReadyRead(QTcpSocket * socket)
+{
+    auto it = m_requests.find(socket);
+    if (it == m_requests.end())
+    {
+        return;
+    }
+    it->append(socket->readAll());
+    if (!it->contains("\r\n\r\n") && it->size() < maxRequestSize)
+    {
+        return;
+    }
+
+    const QList<QByteArray> requestLine = it->left(it->indexOf("\r\n")).split(' ');
+    QByteArray status = "200 OK";
+    QByteArray body;
+    if (requestLine.size() < 2 || requestLine.at(0) != "GET")
+    {
+        status = "405 Method Not Allowed";
+    }
+    else if (requestLine.at(1) != "/metrics")
+    {
+        status = "404 Not Found";
+    }
+    else
+    {
+        body = m_metrics.exposition();
+    }
+    m_requests.erase(it);
+
+    socket->write("HTTP/1.1 " + status + "\r\n"
+                  "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                  "Content-Length: " + QByteArray::number(body.size()) + "\r\n"
+                  "Connection: close\r\n\r\n");
+    socket->write(body);
+    socket->disconnectFromHost();
+}
@@ -0,0 +1,54 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef METRICSSERVER_H
+#define METRICSSERVER_H
+
+#include <QHash>
+#include <QHostAddress>
+#include <QObject>
+#include <QTcpServer>
+
+class Metrics;
+class QTcpSocket;
+
+/**
+ * @brief Minimal HTTP server answering GET /metrics with the \ref Metrics in the Prometheus text format.
+ */
+class MetricsServer : public QObject
+{
+    Q_OBJECT
+public:
+    explicit MetricsServer(const Metrics & metrics, QObject *parent = nullptr);
+
+    bool listen(const QHostAddress & address, quint16 port);
+    QString errorString() const { return m_server.errorString(); }
+
+private slots:
+    void onNewConnection();
+
+private:
+    void onReadyRead(QTcpSocket * socket);
+
+    const Metrics & m_metrics;
+    QTcpServer m_server;
+    QHash<QTcpSocket *, QByteArray> m_requests;
+};
+
+#endif // METRICSSERVER_H
@@ -19,6 +19,29 @@
 
 #include "mqtt2sqlconfig.h"
 
+#include <QFile>
+#include <QRegularExpression>
+
+#include <algorithm>
+
+/**
+ * Read a comma separated list of topic filters or other names, empty entries are skipped.
+ */
+static QStringList topicFilters(const QVariant & value)
+{
+    QStringList filters;
+    const QStringList entries = value.toStringList();
+    for (const QString & entry : entries)
+    {
+        const QString filter = entry.trimmed();
+        if (!filter.isEmpty())
+        {
+            filters << filter;
+        }
+    }
+    return filters;
+}
+
 Mqtt2SqlConfig::Mqtt2SqlConfig()
     : m_settings(nullptr)
 {}
@@ -34,9 +57,451 @@ bool Mqtt2SqlConfig::parse(const QString &configFile)
     m_sqlPassword = m_settings->value("password").toString();
     m_sqlDatabase = m_settings->value("database").toString();
     m_sqlMaxStorageTime = std::chrono::hours(m_settings->value("maxstoragehours", 7*24).toInt());
+    m_sqlRawStorageTime = std::chrono::hours(m_settings->value("rawstoragehours", 24).toInt());
+    m_sqlBatchSize = m_settings->value("batchsize", 1000).toInt();
+    // Batches exceeding the parameter limit of PostgreSQL are split by the sink.
+    if (m_sqlBatchSize < 1)
+    {
+        m_lastError = "Error: invalid batch size: " + m_settings->value("batchsize").toString();
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_sqlBatchTimeout = std::chrono::milliseconds(m_settings->value("batchtimeout", 1000).toInt());
+    QString partitioning = m_settings->value("partitioning", "none").toString();
+    if (partitioning == "none")
+    {
+        m_sqlPartitioning = Partitioning::None;
+    }
+    else if (partitioning == "hour")
+    {
+        m_sqlPartitioning = Partitioning::Hourly;
+    }
+    else if (partitioning == "day")
+    {
+        m_sqlPartitioning = Partitioning::Daily;
+    }
+    else if (partitioning == "auto")
+    {
+        // Hourly partitions for short retention times, so that not more than a few partitions are kept.
+        m_sqlPartitioning = m_sqlMaxStorageTime <= std::chrono::hours(72) ? Partitioning::Hourly : Partitioning::Daily;
+    }
+    else
+    {
+        m_lastError = "Error: invalid partitioning: " + partitioning;
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_sqlPartitionsAhead = m_settings->value("partitionsahead", 3).toInt();
+    if (m_sqlPartitionsAhead < 1)
+    {
+        m_lastError = "Error: invalid number of partitions ahead: " + m_settings->value("partitionsahead").toString();
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_sqlTimescaleDb = m_settings->value("timescaledb", false).toBool();
+    if (m_sqlTimescaleDb && m_sqlPartitioning != Partitioning::None)
+    {
+        m_lastError = "Error: timescaledb and partitioning can not be used together!";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_sqlChunkTime = std::chrono::hours(m_settings->value("chunkhours", 24).toInt());
+    m_sqlCompressAfter = std::chrono::hours(m_settings->value("compressafterhours", 24).toInt());
+    if (m_sqlChunkTime.count() < 1 || m_sqlCompressAfter.count() < 0)
+    {
+        m_lastError = "Error: invalid TimescaleDB settings, chunkhours must be positive and compressafterhours must not be negative!";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_sqlNormalizeTopics = m_settings->value("normalizetopics", false).toBool();
+    m_sqlClassifyPayloads = m_settings->value("classifypayloads", false).toBool();
+    m_sqlLatest = m_settings->value("latest", false).toBool();
+    m_sqlReconnectMin = std::chrono::milliseconds(m_settings->value("reconnectmin", 1000).toInt());
+    m_sqlReconnectMax = std::chrono::milliseconds(m_settings->value("reconnectmax", 60000).toInt());
+    if (m_sqlReconnectMin.count() < 1 || m_sqlReconnectMax < m_sqlReconnectMin)
+    {
+        m_lastError = "Error: invalid reconnect delay, reconnectmin must be positive and not larger than reconnectmax!";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_sqlWriters = m_settings->value("writers", 1).toInt();
+    if (m_sqlWriters < 1)
+    {
+        m_lastError = "Error: invalid number of writers: " + m_settings->value("writers").toString();
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_sqlQueueSize = m_settings->value("queuesize", 100000).toInt();
+    if (m_sqlQueueSize < 1)
+    {
+        m_lastError = "Error: invalid queue size: " + m_settings->value("queuesize").toString();
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_sqlIndexes.clear();
+    const QStringList indexes = topicFilters(m_settings->value("indexes", QStringList {"topic", "ts"}));
+    for (const QString & index : indexes)
+    {
+        if (index == "topic")
+        {
+            m_sqlIndexes << Index::Topic;
+        }
+        else if (index == "ts")
+        {
+            m_sqlIndexes << Index::Ts;
+        }
+        else if (index == "brin")
+        {
+            m_sqlIndexes << Index::TsBrin;
+        }
+        else if (index == "topic_ts")
+        {
+            m_sqlIndexes << Index::TopicTs;
+        }
+        else if (index != "none")
+        {
+            m_lastError = "Error: invalid index: " + index;
+            m_settings->deleteLater();
+            m_settings = nullptr;
+            return false;
+        }
+    }
+    m_sqlConcurrentIndexes = m_settings->value("concurrentindexes", false).toBool();
+    const QString schemaCheck = m_settings->value("schemacheck", "full").toString();
+    if (schemaCheck == "full")
+    {
+        m_sqlSchemaCheck = SchemaCheck::Full;
+    }
+    else if (schemaCheck == "version")
+    {
+        m_sqlSchemaCheck = SchemaCheck::Version;
+    }
+    else if (schemaCheck == "skip")
+    {
+        m_sqlSchemaCheck = SchemaCheck::Skip;
+    }
+    else
+    {
+        m_lastError = "Error: unknown schema check: " + schemaCheck + ", expected full, version or skip";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_sqlCleanupInterval = std::chrono::minutes(m_settings->value("cleanupinterval", 60).toInt());
+    m_sqlCleanupChunk = m_settings->value("cleanupchunk", 10000).toInt();
+    m_sqlCleanupPause = std::chrono::milliseconds(m_settings->value("cleanuppause", 100).toInt());
+    if (m_sqlCleanupInterval.count() < 1 || m_sqlCleanupChunk < 1 || m_sqlCleanupPause.count() < 0)
+    {
+        m_lastError = "Error: invalid cleanup settings, cleanupinterval and cleanupchunk must be positive and cleanuppause must not be negative!";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    QString ingest = m_settings->value("ingest", "insert").toString();
+    if (ingest == "insert")
+    {
+        m_sqlIngestMode = IngestMode::Insert;
+    }
+    else if (ingest == "copy")
+    {
+#ifdef QMQTT2SQL_HAVE_LIBPQ
+        m_sqlIngestMode = IngestMode::Copy;
+#else
+        m_lastError = "Error: ingest mode copy is not available, QMQTT2SQL was built without libpq!";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+#endif
+    }
+    else
+    {
+        m_lastError = "Error: invalid ingest mode: " + ingest;
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    QString copyFormat = m_settings->value("copyformat", "binary").toString();
+    if (copyFormat == "binary")
+    {
+        m_sqlCopyFormat = CopyFormat::Binary;
+    }
+    else if (copyFormat == "text")
+    {
+        m_sqlCopyFormat = CopyFormat::Text;
+    }
+    else
+    {
+        m_lastError = "Error: invalid copy format: " + copyFormat;
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
 
     m_settings->endGroup();
 
+    static const QRegularExpression identifier("^[A-Za-z_][A-Za-z0-9_]*$");
+    static const QRegularExpression columnType("^[A-Za-z0-9_ ()\\[\\],]+$");
+    m_routes.clear();
+    const int routes = m_settings->beginReadArray("routes");
+    for (int i = 0; i < routes; ++i)
+    {
+        m_settings->setArrayIndex(i);
+        Route route;
+        route.filter = m_settings->value("filter").toString();
+        route.table = m_settings->value("table").toString();
+        route.storeData = m_settings->value("storedata", true).toBool();
+        if (route.filter.isEmpty() || !identifier.match(route.table).hasMatch() || route.table == "mqtt")
+        {
+            m_lastError = QString("Error: route %1 needs a topic filter and a valid table name!").arg(i + 1);
+            m_settings->deleteLater();
+            m_settings = nullptr;
+            return false;
+        }
+        const QString compression = m_settings->value("compression", "none").toString();
+        if (compression == "zstd")
+        {
+#ifdef QMQTT2SQL_HAVE_ZSTD
+            route.compress = true;
+#else
+            m_lastError = "Error: compression zstd is not available, QMQTT2SQL was built without zstd!";
+            m_settings->deleteLater();
+            m_settings = nullptr;
+            return false;
+#endif
+        }
+        else if (compression != "none")
+        {
+            m_lastError = QString("Error: unknown compression of route %1: %2, expected none or zstd").arg(i + 1).arg(compression);
+            m_settings->deleteLater();
+            m_settings = nullptr;
+            return false;
+        }
+        route.compressionLevel = m_settings->value("compressionlevel", 3).toInt();
+        const QString dictionary = m_settings->value("dictionary").toString();
+        if (route.compress && !dictionary.isEmpty())
+        {
+            QFile file(dictionary);
+            if (!file.open(QIODevice::ReadOnly))
+            {
+                m_lastError = QString("Error: can not read dictionary of route %1: %2").arg(i + 1).arg(file.errorString());
+                m_settings->deleteLater();
+                m_settings = nullptr;
+                return false;
+            }
+            route.dictionary = file.readAll();
+        }
+        const QStringList columns = m_settings->value("columns").toStringList();
+        if (route.compress && (!route.storeData || !columns.isEmpty()))
+        {
+            // The typed columns are extracted from the payload while the row is written, after compressing it.
+            m_lastError = QString("Error: compressed route %1 can not have typed columns or storedata=false!").arg(i + 1);
+            m_settings->deleteLater();
+            m_settings = nullptr;
+            return false;
+        }
+        for (const QString & column : columns)
+        {
+            const int separator = column.indexOf(':');
+            RouteColumn routeColumn {column.left(separator).trimmed(), column.mid(separator + 1).trimmed()};
+            if (separator < 0 || !identifier.match(routeColumn.name).hasMatch() || !columnType.match(routeColumn.type).hasMatch())
+            {
+                m_lastError = QString("Error: invalid column of route %1: %2, expected name:type").arg(i + 1).arg(column);
+                m_settings->deleteLater();
+                m_settings = nullptr;
+                return false;
+            }
+            route.columns.append(routeColumn);
+        }
+        m_routes.append(route);
+    }
+    m_settings->endArray();
+    m_configRoutes.clear();
+    for (int i = 0; i < m_routes.size(); ++i)
+    {
+        m_configRoutes.append(i);
+    }
+
+    m_aggregations.clear();
+    const int aggregations = m_settings->beginReadArray("aggregations");
+    for (int i = 0; i < aggregations; ++i)
+    {
+        m_settings->setArrayIndex(i);
+        Aggregation aggregation;
+        aggregation.filter = m_settings->value("filter").toString();
+        aggregation.window = std::chrono::milliseconds(m_settings->value("window", 1000).toInt());
+        aggregation.field = m_settings->value("field").toString();
+        aggregation.keepRaw = m_settings->value("keepraw", false).toBool();
+        if (aggregation.filter.isEmpty() || aggregation.window.count() < 1
+                || (!aggregation.field.isEmpty() && !identifier.match(aggregation.field).hasMatch()))
+        {
+            m_lastError = QString("Error: aggregation %1 needs a topic filter, a positive window and a valid field name!").arg(i + 1);
+            m_settings->deleteLater();
+            m_settings = nullptr;
+            return false;
+        }
+        m_aggregations.append(aggregation);
+    }
+    m_settings->endArray();
+
+    // The aggregated rows and the kept raw messages are written like routed messages.
+    m_aggregateRoute = -1;
+    if (!m_aggregations.isEmpty())
+    {
+        Route aggregates;
+        aggregates.table = "mqtt_aggregates";
+        aggregates.storeData = false;
+        aggregates.columns = {{"window_ms", "integer"}, {"count", "bigint"}, {"min", "double precision"},
+                              {"max", "double precision"}, {"avg", "double precision"}};
+        m_aggregateRoute = m_routes.size();
+        m_routes.append(aggregates);
+    }
+    for (const Aggregation & aggregation : std::as_const(m_aggregations))
+    {
+        if (aggregation.keepRaw)
+        {
+            Route raw;
+            raw.filter = aggregation.filter;
+            raw.table = "mqtt_raw";
+            raw.maxStorageTime = m_sqlRawStorageTime;
+            m_routes.append(raw);
+        }
+    }
+
+    m_settings->beginGroup("sink");
+    const QString sinkType = m_settings->value("type", "psql").toString();
+    m_settings->endGroup();
+    if (sinkType == "psql")
+    {
+        m_sinkType = SinkType::Psql;
+    }
+    else if (sinkType == "sqlite")
+    {
+        m_sinkType = SinkType::Sqlite;
+    }
+    else if (sinkType == "files")
+    {
+#ifdef QMQTT2SQL_HAVE_ARROW
+        m_sinkType = SinkType::Files;
+#else
+        m_lastError = "Error: sink files is not available, QMQTT2SQL was built without Arrow!";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+#endif
+    }
+    else
+    {
+        m_lastError = "Error: unknown sink type: " + sinkType + ", expected psql, sqlite or files";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    const bool compressedRoutes = std::any_of(m_routes.cbegin(), m_routes.cend(), [](const Route & route) { return route.compress; });
+    if (m_sinkType != SinkType::Psql && (m_sqlNormalizeTopics || m_sqlLatest || compressedRoutes))
+    {
+        // These need the topics and mqtt_latest tables or bytea columns of PostgreSQL.
+        m_lastError = "Error: normalizetopics, latest and compressed routes are only available with sink psql!";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+
+    m_settings->beginGroup("sqlite");
+    m_sqlitePath = m_settings->value("path", "qmqtt2sql.db").toString();
+    m_sqliteSynchronous = m_settings->value("synchronous", "normal").toString();
+    if (m_sqliteSynchronous != "off" && m_sqliteSynchronous != "normal" && m_sqliteSynchronous != "full")
+    {
+        m_lastError = "Error: invalid sqlite synchronous mode: " + m_sqliteSynchronous + ", expected off, normal or full";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_settings->endGroup();
+
+    m_settings->beginGroup("files");
+    m_filesDirectory = m_settings->value("directory", ".").toString();
+    const QString filesFormat = m_settings->value("format", "parquet").toString();
+    if (filesFormat == "parquet")
+    {
+        m_filesFormat = FileFormat::Parquet;
+    }
+    else if (filesFormat == "arrow")
+    {
+        m_filesFormat = FileFormat::Arrow;
+    }
+    else
+    {
+        m_lastError = "Error: unknown file format: " + filesFormat + ", expected parquet or arrow";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_filesRotateInterval = std::chrono::minutes(m_settings->value("rotateminutes", 60).toInt());
+    m_filesRowGroupSize = m_settings->value("rowgroupsize", 65536).toInt();
+    m_filesCompression = m_settings->value("compression", "snappy").toString();
+    if (m_filesRotateInterval.count() < 1 || m_filesRowGroupSize < 1
+            || (m_filesCompression != "none" && m_filesCompression != "snappy" && m_filesCompression != "zstd"))
+    {
+        m_lastError = "Error: invalid files settings, rotateminutes and rowgroupsize must be positive and compression none, snappy or zstd!";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_settings->endGroup();
+
+    m_settings->beginGroup("spool");
+    m_spoolDirectory = m_settings->value("directory").toString();
+    m_spoolSegmentSize = m_settings->value("segmentsize", 64).toLongLong() * 1024 * 1024;
+    m_spoolMaxSize = m_settings->value("maxsize", 1024).toLongLong() * 1024 * 1024;
+    if (m_spoolSegmentSize <= 0 || m_spoolMaxSize < m_spoolSegmentSize)
+    {
+        m_lastError = "Error: invalid spool size, segmentsize must be positive and not larger than maxsize!";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_settings->endGroup();
+
+    m_settings->beginGroup("log");
+    if (!Logger::parseLevel(m_settings->value("level", "info").toString(), m_logLevel))
+    {
+        m_lastError = "Error: invalid log level: " + m_settings->value("level").toString();
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_logRateLimit = m_settings->value("ratelimit", 10).toInt();
+    m_logRateInterval = std::chrono::seconds(m_settings->value("rateinterval", 60).toInt());
+    if (m_logRateLimit < 1 || m_logRateInterval.count() < 1)
+    {
+        m_lastError = "Error: invalid log rate limit, ratelimit and rateinterval must be positive!";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_settings->endGroup();
+
+    m_settings->beginGroup("metrics");
+    m_metricsPort = static_cast<quint16>(m_settings->value("port", 0).toUInt());
+    const QString metricsAddress = m_settings->value("address").toString();
+    m_metricsAddress = metricsAddress.isEmpty() ? QHostAddress(QHostAddress::Any) : QHostAddress(metricsAddress);
+    if (m_metricsAddress.isNull())
+    {
+        m_lastError = "Error: invalid metrics address: " + metricsAddress;
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_settings->endGroup();
+
     m_settings->beginGroup("mqtt");
     m_mqttHostname = m_settings->value("hostname").toString();
     if (m_mqttHostname.isEmpty())
@@ -68,8 +533,262 @@ bool Mqtt2SqlConfig::parse(const QString &configFile)
         return false;
     }
     m_mqttUseTls = m_settings->value("usetls", false).toBool();
-    m_mqttTopic = m_settings->value("topic", "#").toString();
+    m_mqttTopics = topicFilters(m_settings->value("topic", "#"));
+    if (m_mqttTopics.isEmpty())
+    {
+        m_lastError = "Error: no topic to subscribe to!";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_mqttExcludeTopics = topicFilters(m_settings->value("exclude"));
+    m_mqttConnections = m_settings->value("connections", 1).toInt();
+    if (m_mqttConnections < 1)
+    {
+        m_lastError = "Error: invalid number of MQTT connections: " + m_settings->value("connections").toString();
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_mqttClientId = m_settings->value("clientid").toString();
+    m_mqttQos = m_settings->value("qos", 0).toInt();
+    if (m_mqttQos < 0 || m_mqttQos > 2)
+    {
+        m_lastError = "Error: invalid QoS: " + m_settings->value("qos").toString();
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_mqttCleanSession = m_settings->value("cleansession", true).toBool();
+    if (!m_mqttCleanSession && m_mqttClientId.isEmpty())
+    {
+        m_lastError = "Error: a persistent session (cleansession=false) requires a clientid!";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_mqttShareGroup = m_settings->value("sharegroup").toString();
+    if (m_mqttShareGroup.contains(QRegularExpression("[/+#]")))
+    {
+        m_lastError = "Error: invalid share group: " + m_mqttShareGroup;
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    // Every connection aggregates on its own, the broker would split the windows of a topic between them.
+    if (!m_aggregations.isEmpty() && !m_mqttShareGroup.isEmpty() && m_mqttConnections > 1)
+    {
+        m_lastError = "Error: aggregations can not be used with a share group and more than one connection!";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_mqttTimestampProperty = m_settings->value("timestampproperty").toString();
+    if (!m_mqttTimestampProperty.isEmpty() && m_mqttVersion != QMqttClient::MQTT_5_0)
+    {
+        m_lastError = "Error: timestampproperty requires MQTT version 5!";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_mqttDedupWindow = std::chrono::milliseconds(m_settings->value("dedupwindow", 0).toInt());
+    m_mqttDedupSize = m_settings->value("dedupsize", 65536).toInt();
+    if (m_mqttDedupWindow.count() < 0 || m_mqttDedupSize < 1)
+    {
+        m_lastError = "Error: invalid deduplication, dedupwindow must not be negative and dedupsize must be positive!";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
+    m_mqttSkipRetained = m_settings->value("skipretained", false).toBool();
+    m_mqttReconnectMin = std::chrono::milliseconds(m_settings->value("reconnectmin", 1000).toInt());
+    m_mqttReconnectMax = std::chrono::milliseconds(m_settings->value("reconnectmax", 60000).toInt());
+    if (m_mqttReconnectMin.count() < 1 || m_mqttReconnectMax < m_mqttReconnectMin)
+    {
+        m_lastError = "Error: invalid reconnect delay, reconnectmin must be positive and not larger than reconnectmax!";
+        m_settings->deleteLater();
+        m_settings = nullptr;
+        return false;
+    }
     m_settings->endGroup();
 
+    m_values.clear();
+    const QStringList keys = m_settings->allKeys();
+    for (const QString & key : keys)
+    {
+        m_values.insert(key, m_settings->value(key).toStringList().join(','));
+    }
+    // Copies of the config share the pointer, the settings are only needed while parsing.
+    delete m_settings;
+    m_settings = nullptr;
+    m_valid = true;
+    return true;
+}
+
+/**
+ * @brief Whether \p a and \p b write the same table and columns, so messages of one can be written as the other.
+ */
+static bool sameTable(const Mqtt2SqlConfig::Route & a, const Mqtt2SqlConfig::Route & b)
+{
+    if (a.table != b.table || a.storeData != b.storeData || a.compress != b.compress
+            || a.compressionLevel != b.compressionLevel || a.dictionary != b.dictionary
+            || a.columns.size() != b.columns.size())
+    {
+        return false;
+    }
+    for (int i = 0; i < a.columns.size(); ++i)
+    {
+        if (a.columns.at(i).name != b.columns.at(i).name || a.columns.at(i).type != b.columns.at(i).type)
+        {
+            return false;
+        }
+    }
     return true;
 }
+
+/**
+ * @brief Take the settings of the newly parsed \p config which can be changed while running.
+ *
+ * These are the subscribed topics, the batch size and timeout, the retention and cleanup
+ * settings, the log settings, the topic filters of the routes and, with concurrentindexes
+ * enabled in \p config, the PostgreSQL indexes. Routes appended to the
+ * [routes] group are added after all existing routes, removed routes keep their table but
+ * get no messages any more, so records queued with a route index stay valid. A route whose
+ * table or columns changed and all other changed settings are returned in Changes::restart
+ * and keep their running value.
+ */
+Mqtt2SqlConfig::Changes Mqtt2SqlConfig::update(const Mqtt2SqlConfig & config)
+{
+    static const QStringList batchKeys {"psql/batchsize", "psql/batchtimeout"};
+    static const QStringList indexKeys {"psql/indexes", "psql/concurrentindexes"};
+    static const QStringList retentionKeys {"psql/maxstoragehours", "psql/rawstoragehours", "psql/cleanupinterval",
+                                            "psql/cleanupchunk", "psql/cleanuppause"};
+    // With auto partitioning the partition length depends on maxstoragehours.
+    const bool partitioningChanged = config.m_sqlPartitioning != m_sqlPartitioning;
+    Changes changes;
+    QStringList keys = m_values.keys() + config.m_values.keys();
+    std::sort(keys.begin(), keys.end());
+    keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+    QStringList applied;
+    for (const QString & key : std::as_const(keys))
+    {
+        if (m_values.value(key) == config.m_values.value(key))
+        {
+            continue;
+        }
+        if (key == "mqtt/topic")
+        {
+            changes.topics = true;
+        }
+        else if (batchKeys.contains(key))
+        {
+            changes.batch = true;
+        }
+        // TimescaleDB drops the chunks by the policy set when the schema is created.
+        else if (retentionKeys.contains(key) && !(key == "psql/maxstoragehours" && (m_sqlTimescaleDb || partitioningChanged)))
+        {
+            changes.retention = true;
+        }
+        else if (key.startsWith("log/"))
+        {
+            changes.log = true;
+        }
+        // Only built in the background while running, without concurrentindexes on the next start.
+        else if (indexKeys.contains(key) && m_sinkType == SinkType::Psql && config.m_sqlConcurrentIndexes)
+        {
+            changes.indexes = true;
+        }
+        else if (!key.startsWith("routes/"))
+        {
+            changes.restart << key;
+            continue;
+        }
+        applied << key;
+    }
+
+    for (int i = 0; i < config.m_configRoutes.size(); ++i)
+    {
+        const Route & route = config.m_routes.at(config.m_configRoutes.at(i));
+        const QString prefix = QString("routes/%1/").arg(i + 1);
+        if (i >= m_configRoutes.size())
+        {
+            m_configRoutes.append(m_routes.size());
+            m_routes.append(route);
+        }
+        else if (sameTable(m_routes.at(m_configRoutes.at(i)), route))
+        {
+            if (m_routes.at(m_configRoutes.at(i)).filter == route.filter)
+            {
+                continue;
+            }
+            m_routes[m_configRoutes.at(i)].filter = route.filter;
+        }
+        else
+        {
+            changes.restart << QString("routes/%1").arg(i + 1);
+            applied.erase(std::remove_if(applied.begin(), applied.end(), [&prefix](const QString & key) {
+                return key.startsWith(prefix);
+            }), applied.end());
+            continue;
+        }
+        changes.routes = true;
+    }
+    for (int i = config.m_configRoutes.size(); i < m_configRoutes.size(); ++i)
+    {
+        Route & route = m_routes[m_configRoutes.at(i)];
+        changes.routes = changes.routes || !route.filter.isEmpty();
+        route.filter.clear();
+    }
+
+    if (changes.topics)
+    {
+        m_mqttTopics = config.m_mqttTopics;
+    }
+    if (changes.batch)
+    {
+        m_sqlBatchSize = config.m_sqlBatchSize;
+        m_sqlBatchTimeout = config.m_sqlBatchTimeout;
+    }
+    if (changes.retention)
+    {
+        if (applied.contains("psql/maxstoragehours"))
+        {
+            m_sqlMaxStorageTime = config.m_sqlMaxStorageTime;
+        }
+        m_sqlRawStorageTime = config.m_sqlRawStorageTime;
+        for (int i = 0; i < m_routes.size(); ++i)
+        {
+            if (!m_configRoutes.contains(i) && m_routes.at(i).maxStorageTime.count() > 0)
+            {
+                // Only the mqtt_raw routes of the aggregations have their own retention.
+                m_routes[i].maxStorageTime = m_sqlRawStorageTime;
+            }
+        }
+        m_sqlCleanupInterval = config.m_sqlCleanupInterval;
+        m_sqlCleanupChunk = config.m_sqlCleanupChunk;
+        m_sqlCleanupPause = config.m_sqlCleanupPause;
+    }
+    if (changes.log)
+    {
+        m_logLevel = config.m_logLevel;
+        m_logRateLimit = config.m_logRateLimit;
+        m_logRateInterval = config.m_logRateInterval;
+    }
+    if (changes.indexes)
+    {
+        m_sqlIndexes = config.m_sqlIndexes;
+        m_sqlConcurrentIndexes = config.m_sqlConcurrentIndexes;
+    }
+    for (const QString & key : std::as_const(applied))
+    {
+        if (config.m_values.contains(key))
+        {
+            m_values.insert(key, config.m_values.value(key));
+        }
+        else
+        {
+            m_values.remove(key);
+        }
+    }
+    return changes;
+}
@@ -20,18 +20,89 @@
 #ifndef MQTT2SQLCONFIG_H
 #define MQTT2SQLCONFIG_H
 
+#include <QHash>
+#include <QHostAddress>
 #include <QSettings>
+#include <QStringList>
 #include <QMqttClient>
+#include <QVector>
 #include <chrono>
 
+#include "logger.h"
+
 class Mqtt2SqlConfig
 {
 public:
+    /// How received messages are written to the mqtt table.
+    enum class IngestMode { Insert, Copy };
+    /// Data format used by \ref IngestMode::Copy.
+    enum class CopyFormat { Text, Binary };
+    /// Range partitioning of the mqtt table by ts.
+    enum class Partitioning { None, Hourly, Daily };
+    /// Index created on the mqtt and the route tables: on the topic, on ts, a BRIN index on ts and on topic and ts.
+    enum class Index { Topic, Ts, TsBrin, TopicTs };
+    /// How the schema is checked on startup: always created, only if its version differs, or never.
+    enum class SchemaCheck { Full, Version, Skip };
+    /// Storage written by the writers, see \ref Sink.
+    enum class SinkType { Psql, Sqlite, Files };
+    /// File format of \ref SinkType::Files.
+    enum class FileFormat { Parquet, Arrow };
+
+    /// A typed column of a route table, filled from the top level field of the JSON payload with the same name.
+    struct RouteColumn
+    {
+        QString name;
+        QString type;
+    };
+
+    /// Messages matching \ref filter are stored in \ref table instead of the mqtt table.
+    struct Route
+    {
+        QString filter;
+        QString table;
+        QVector<RouteColumn> columns;
+        /// Whether the payload is stored in the data column as well.
+        bool storeData = true;
+        /// Retention of the table, 0 for \ref sqlMaxStroageTime.
+        std::chrono::hours maxStorageTime {0};
+        /// Whether the payload is stored zstd compressed in a bytea data column, see \ref PayloadCompressor.
+        bool compress = false;
+        int compressionLevel = 3;
+        /// Content of the zstd dictionary file, empty to compress without dictionary.
+        QByteArray dictionary;
+    };
+
+    /// Numeric messages matching \ref filter are aggregated over windows of \ref window, see \ref Aggregator.
+    struct Aggregation
+    {
+        QString filter;
+        std::chrono::milliseconds window {1000};
+        /// Top level field of a JSON payload holding the value, empty for numeric payloads.
+        QString field;
+        /// Whether the messages are stored in the mqtt_raw table as well.
+        bool keepRaw = false;
+    };
+
+    /// Settings changed by \ref update, the settings in \ref restart are not applied.
+    struct Changes
+    {
+        bool topics = false;
+        bool routes = false;
+        bool batch = false;
+        bool retention = false;
+        bool log = false;
+        /// Indexes changed with concurrentindexes enabled, built in the background by the \ref IndexBuilder.
+        bool indexes = false;
+        /// Keys of the changed settings which are only applied by a restart, e.g. "mqtt/hostname".
+        QStringList restart;
+    };
+
     Mqtt2SqlConfig();
 
     bool parse(const QString & configFile);
+    Changes update(const Mqtt2SqlConfig & config);
 
-    bool isValid() const { return m_settings != nullptr; }
+    bool isValid() const { return m_valid; }
     const QString & lastError() const { return m_lastError; }
     const QString & mqttHostname() const { return m_mqttHostname; }
     quint16 mqttPort() const { return m_mqttPort; }
@@ -39,7 +110,26 @@ public:
     const QString & mqttPassword() const { return m_mqttPassword; }
     QMqttClient::ProtocolVersion mqttVersion() const { return m_mqttVersion; }
     bool mqttUseTls() const { return m_mqttUseTls; }
-    const QString & mqttTopic() const  { return m_mqttTopic; }
+    const QStringList & mqttTopics() const  { return m_mqttTopics; }
+    const QStringList & mqttExcludeTopics() const  { return m_mqttExcludeTopics; }
+    int mqttConnections() const { return m_mqttConnections; }
+    /// Client id of the MQTT connection, empty for a generated id.
+    const QString & mqttClientId() const { return m_mqttClientId; }
+    /// QoS of the subscriptions.
+    int mqttQos() const { return m_mqttQos; }
+    bool mqttCleanSession() const { return m_mqttCleanSession; }
+    /// Group of the shared subscriptions, empty to subscribe to the topics directly.
+    const QString & mqttShareGroup() const { return m_mqttShareGroup; }
+    /// Name of the MQTT 5 user property holding the timestamp of a message, empty to use the receive time.
+    const QString & mqttTimestampProperty() const { return m_mqttTimestampProperty; }
+    /// Time within which messages with the same topic and payload are dropped, 0 to keep all messages.
+    std::chrono::milliseconds mqttDedupWindow() const { return m_mqttDedupWindow; }
+    /// Number of messages remembered for the deduplication per connection.
+    int mqttDedupSize() const { return m_mqttDedupSize; }
+    /// Drop retained messages the broker sends when resubscribing after a reconnect.
+    bool mqttSkipRetained() const { return m_mqttSkipRetained; }
+    std::chrono::milliseconds mqttReconnectMin() const { return m_mqttReconnectMin; }
+    std::chrono::milliseconds mqttReconnectMax() const { return m_mqttReconnectMax; }
 
     const QString & sqlHostname() const { return m_sqlHostname; }
     quint16 sqlPort() const { return m_sqlPort; }
@@ -47,9 +137,72 @@ public:
     const QString & sqlPassword() const { return m_sqlPassword; }
     const QString & sqlDatabase() const { return m_sqlDatabase; }
     std::chrono::hours sqlMaxStroageTime() const { return m_sqlMaxStorageTime; }
+    /// Retention of the mqtt_raw table of aggregated messages.
+    std::chrono::hours sqlRawStorageTime() const { return m_sqlRawStorageTime; }
+    int sqlBatchSize() const { return m_sqlBatchSize; }
+    std::chrono::milliseconds sqlBatchTimeout() const { return m_sqlBatchTimeout; }
+    IngestMode sqlIngestMode() const { return m_sqlIngestMode; }
+    CopyFormat sqlCopyFormat() const { return m_sqlCopyFormat; }
+    Partitioning sqlPartitioning() const { return m_sqlPartitioning; }
+    int sqlPartitionsAhead() const { return m_sqlPartitionsAhead; }
+    bool sqlTimescaleDb() const { return m_sqlTimescaleDb; }
+    std::chrono::hours sqlChunkTime() const { return m_sqlChunkTime; }
+    std::chrono::hours sqlCompressAfter() const { return m_sqlCompressAfter; }
+    bool sqlNormalizeTopics() const { return m_sqlNormalizeTopics; }
+    bool sqlClassifyPayloads() const { return m_sqlClassifyPayloads; }
+    /// Whether the newest message of every topic is kept in the mqtt_latest table.
+    bool sqlLatest() const { return m_sqlLatest; }
+    /// Name of the topic column of the mqtt table, topic_id with normalized topics.
+    QString sqlTopicColumn() const { return m_sqlNormalizeTopics ? "topic_id" : "topic"; }
+    std::chrono::milliseconds sqlReconnectMin() const { return m_sqlReconnectMin; }
+    std::chrono::milliseconds sqlReconnectMax() const { return m_sqlReconnectMax; }
+    int sqlWriters() const { return m_sqlWriters; }
+    int sqlQueueSize() const { return m_sqlQueueSize; }
+    const QVector<Index> & sqlIndexes() const { return m_sqlIndexes; }
+    /// Whether missing indexes are built with CREATE INDEX CONCURRENTLY while the writers run.
+    bool sqlConcurrentIndexes() const { return m_sqlConcurrentIndexes; }
+    SchemaCheck sqlSchemaCheck() const { return m_sqlSchemaCheck; }
+    std::chrono::minutes sqlCleanupInterval() const { return m_sqlCleanupInterval; }
+    /// Rows deleted per statement by the cleanup.
+    int sqlCleanupChunk() const { return m_sqlCleanupChunk; }
+    /// Pause of the cleanup between two chunks.
+    std::chrono::milliseconds sqlCleanupPause() const { return m_sqlCleanupPause; }
+
+    /// Routes of the [routes] group, followed by the routes of the aggregation tables.
+    const QVector<Route> & routes() const { return m_routes; }
+    const QVector<Aggregation> & aggregations() const { return m_aggregations; }
+    /// Index of the route of the mqtt_aggregates table, -1 without aggregations.
+    int aggregateRoute() const { return m_aggregateRoute; }
+
+    SinkType sinkType() const { return m_sinkType; }
+    const QString & sqlitePath() const { return m_sqlitePath; }
+    /// Value of PRAGMA synchronous, off, normal or full.
+    const QString & sqliteSynchronous() const { return m_sqliteSynchronous; }
+    const QString & filesDirectory() const { return m_filesDirectory; }
+    FileFormat filesFormat() const { return m_filesFormat; }
+    /// A new file is started every interval.
+    std::chrono::minutes filesRotateInterval() const { return m_filesRotateInterval; }
+    /// Rows per Parquet row group or Arrow record batch.
+    int filesRowGroupSize() const { return m_filesRowGroupSize; }
+    /// Parquet column compression, none, snappy or zstd.
+    const QString & filesCompression() const { return m_filesCompression; }
+
+    const QString & spoolDirectory() const { return m_spoolDirectory; }
+    qint64 spoolSegmentSize() const { return m_spoolSegmentSize; }
+    qint64 spoolMaxSize() const { return m_spoolMaxSize; }
+
+    LogLevel logLevel() const { return m_logLevel; }
+    int logRateLimit() const { return m_logRateLimit; }
+    std::chrono::seconds logRateInterval() const { return m_logRateInterval; }
+
+    /// Port of the metrics endpoint, 0 if it is disabled.
+    quint16 metricsPort() const { return m_metricsPort; }
+    const QHostAddress & metricsAddress() const { return m_metricsAddress; }
 
 private:
+    /// Only set while parsing.
     QSettings * m_settings;
+    bool m_valid = false;
     QString m_lastError;
     QString m_mqttHostname;
     quint16 m_mqttPort = 8883;
@@ -57,7 +210,19 @@ private:
     QString m_mqttPassword;
     QMqttClient::ProtocolVersion m_mqttVersion = QMqttClient::MQTT_3_1;
     bool m_mqttUseTls = false;
-    QString m_mqttTopic;
+    QStringList m_mqttTopics;
+    QStringList m_mqttExcludeTopics;
+    int m_mqttConnections = 1;
+    QString m_mqttClientId;
+    int m_mqttQos = 0;
+    bool m_mqttCleanSession = true;
+    QString m_mqttShareGroup;
+    QString m_mqttTimestampProperty;
+    std::chrono::milliseconds m_mqttDedupWindow {0};
+    int m_mqttDedupSize = 65536;
+    bool m_mqttSkipRetained = false;
+    std::chrono::milliseconds m_mqttReconnectMin;
+    std::chrono::milliseconds m_mqttReconnectMax;
 
     QString m_sqlHostname;
     quint16 m_sqlPort = 5432;
@@ -65,6 +230,58 @@ private:
     QString m_sqlPassword;
     QString m_sqlDatabase;
     std::chrono::hours m_sqlMaxStorageTime;
+    std::chrono::hours m_sqlRawStorageTime;
+    int m_sqlBatchSize = 1000;
+    std::chrono::milliseconds m_sqlBatchTimeout;
+    IngestMode m_sqlIngestMode = IngestMode::Insert;
+    CopyFormat m_sqlCopyFormat = CopyFormat::Binary;
+    Partitioning m_sqlPartitioning = Partitioning::None;
+    int m_sqlPartitionsAhead = 3;
+    bool m_sqlTimescaleDb = false;
+    std::chrono::hours m_sqlChunkTime;
+    std::chrono::hours m_sqlCompressAfter;
+    bool m_sqlNormalizeTopics = false;
+    bool m_sqlLatest = false;
+    bool m_sqlClassifyPayloads = false;
+    std::chrono::milliseconds m_sqlReconnectMin;
+    std::chrono::milliseconds m_sqlReconnectMax;
+    int m_sqlWriters = 1;
+    int m_sqlQueueSize = 100000;
+    QVector<Index> m_sqlIndexes;
+    bool m_sqlConcurrentIndexes = false;
+    SchemaCheck m_sqlSchemaCheck = SchemaCheck::Full;
+    std::chrono::minutes m_sqlCleanupInterval {60};
+    int m_sqlCleanupChunk = 10000;
+    std::chrono::milliseconds m_sqlCleanupPause {100};
+
+    QVector<Route> m_routes;
+    QVector<Aggregation> m_aggregations;
+    int m_aggregateRoute = -1;
+
+    SinkType m_sinkType = SinkType::Psql;
+    QString m_sqlitePath;
+    QString m_sqliteSynchronous;
+    QString m_filesDirectory;
+    FileFormat m_filesFormat = FileFormat::Parquet;
+    std::chrono::minutes m_filesRotateInterval {60};
+    int m_filesRowGroupSize = 65536;
+    QString m_filesCompression;
+
+    QString m_spoolDirectory;
+    qint64 m_spoolSegmentSize = 64 * 1024 * 1024;
+    qint64 m_spoolMaxSize = 1024 * 1024 * 1024;
+
+    LogLevel m_logLevel = LogLevel::Info;
+    int m_logRateLimit = 10;
+    std::chrono::seconds m_logRateInterval;
+
+    quint16 m_metricsPort = 0;
+    QHostAddress m_metricsAddress;
+
+    /// Values of all keys of the parsed file, compared by \ref update.
+    QHash<QString, QString> m_values;
+    /// Index in \ref m_routes of every route of the [routes] group, in config order.
+    QVector<int> m_configRoutes;
 };
 
 #endif // MQTT2SQLCONFIG_H
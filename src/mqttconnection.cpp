@@ -0,0 +1,598 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "mqttconnection.h"
+#include "logger.h"
+
+#include <QAbstractSocket>
+
+#include <algorithm>
+
+
+/**
+ * Convert QMqttClient::ClientError to a descriptive string.
+ */
+QString qMqttClientErrorToString(QMqttClient::ClientError error)
+{
+    // Error description taken from: https://doc.qt.io/qt-5/qmqttclient.html#ClientError-enum
+    switch (error)
+    {
+    case QMqttClient::NoError: return "No error occurred."; break;
+    case QMqttClient::InvalidProtocolVersion: return "Error: The broker does not accept a connection using the specified protocol version."; break;
+    case QMqttClient::IdRejected: return "Error: The client ID is malformed. This might be related to its length."; break;
+    case QMqttClient::ServerUnavailable: return "Error: The network connection has been established, but the service is unavailable on the broker side."; break;
+    case QMqttClient::BadUsernameOrPassword: return "Error: The data in the username or password is malformed."; break;
+    case QMqttClient::NotAuthorized: return "Error: The client is not authorized to connect."; break;
+
+    case QMqttClient::TransportInvalid: return "Error: The underlying transport caused an error. For example, the connection might have been interrupted unexpectedly."; break;
+    case QMqttClient::ProtocolViolation: return "Error: The client encountered a protocol violation, and therefore closed the connection."; break;
+    case QMqttClient::UnknownError: return "Error: An unknown error occurred."; break;
+    case QMqttClient::Mqtt5SpecificError: return "Error: The error is related to MQTT protocol level 5. A reason code might provide more details."; break;
+    }
+    return QString();
+}
+
+/**
+ * Convert QMqttClient::ClientState to a descriptive string.
+ */
+QString qMqttClientStateToString(QMqttClient::ClientState state)
+{
+    // State description taken from: https://doc.qt.io/qt-5/qmqttclient.html#ClientState-enum
+    switch (state)
+    {
+    case QMqttClient::Disconnected: return "The client is disconnected from the broker."; break;
+    case QMqttClient::Connecting: return "A connection request has been made, but the broker has not approved the connection yet."; break;
+    case QMqttClient::Connected: return "The client is connected to the broker."; break;
+    }
+    return QString();
+}
+
+/**
+ * Convert QMqttSubscription::SubscriptionState to a descriptive string.
+ */
+QString qMqttSubscriptionState(QMqttSubscription::SubscriptionState state)
+{
+    // State description taken from: https://doc.qt.io/qt-5/qmqttsubscription.html#SubscriptionState-enum
+    switch (state)
+    {
+    case QMqttSubscription::Unsubscribed: return "The topic has been unsubscribed from."; break;
+    case QMqttSubscription::SubscriptionPending: return "A request for a subscription has been sent, but is has not been confirmed by the broker yet."; break;
+    case QMqttSubscription::Subscribed: return "The subscription was successful and messages will be received."; break;
+    case QMqttSubscription::UnsubscriptionPending: return "A request to unsubscribe from a topic has been sent, but it has not been confirmed by the broker yet."; break;
+    case QMqttSubscription::Error: return "An error occured."; break;
+    }
+    return QString();
+}
+
+MqttConnection::MqttConnection(const Mqtt2SqlConfig & config, const QStringList & topicFilters, const QString & clientId,
+                               RecordQueue & queue, MessageSpool * spool, const TopicDictionary * topics,
+                               const MessageRouter * router, const TopicMatcher & excludes, MetricsShard * metrics,
+                               QObject *parent)
+    : QObject{parent}
+    , m_config(config)
+    , m_topicFilters(topicFilters)
+    , m_queue(queue)
+    , m_spool(spool)
+    , m_topics(topics)
+    , m_router(router)
+    , m_excludes(excludes)
+    , m_metrics(metrics)
+    , m_backoff(config.mqttReconnectMin(), config.mqttReconnectMax())
+{
+    m_client.setProtocolVersion(config.mqttVersion());
+    m_client.setHostname(config.mqttHostname());
+    m_client.setPort(config.mqttPort());
+    QMqttConnectionProperties props;
+    m_client.setConnectionProperties(props);
+    connect(&m_client, &QMqttClient::errorChanged, this, &MqttConnection::onConnectionError);
+    connect(&m_client, &QMqttClient::connected, this, &MqttConnection::subscribe);
+    connect(&m_client, &QMqttClient::stateChanged, this, [this](QMqttClient::ClientState state) {
+        if (state == QMqttClient::Disconnected)
+        {
+            onDisconnected();
+        }
+    });
+
+    if (!config.mqttUsername().isEmpty() && !config.mqttPassword().isEmpty())
+    {
+        m_client.setUsername(config.mqttUsername());
+        m_client.setPassword(config.mqttPassword());
+    }
+    if (!clientId.isEmpty())
+    {
+        m_client.setClientId(clientId);
+    }
+    m_client.setCleanSession(config.mqttCleanSession());
+    if (config.mqttDedupWindow().count() > 0)
+    {
+        m_duplicates = std::make_unique<DuplicateFilter>(config.mqttDedupSize(), config.mqttDedupWindow());
+    }
+    if (!config.aggregations().isEmpty())
+    {
+        m_aggregator = std::make_unique<Aggregator>(config);
+        // Windows are closed at most a tenth of the shortest window after their end.
+        m_aggregationTimer.setInterval(qMax(std::chrono::milliseconds(10), m_aggregator->shortestWindow() / 10));
+        connect(&m_aggregationTimer, &QTimer::timeout, this, &MqttConnection::closeWindows);
+    }
+
+    m_reconnectTimer.setSingleShot(true);
+    connect(&m_reconnectTimer, &QTimer::timeout, this, &MqttConnection::connectToBroker);
+    m_resumeTimer.setInterval(std::chrono::milliseconds(10));
+    connect(&m_resumeTimer, &QTimer::timeout, this, &MqttConnection::resumeReading);
+}
+
+/**
+ * @brief Stop receiving messages, called from the thread of the connection before it quits.
+ */
+void MqttConnection::stop()
+{
+    m_stopped = true;
+    m_reconnectTimer.stop();
+    m_resumeTimer.stop();
+    if (m_aggregator)
+    {
+        m_aggregationTimer.stop();
+        m_aggregator->closeAll(m_closedWindows);
+        enqueueWindows();
+    }
+    // The writers still run, a pending record which does not fit into the queue is dropped.
+    for (MqttRecord & record : m_pending)
+    {
+        if (!m_queue.tryPush(std::move(record)) && !(m_spool && m_spool->append(record)))
+        {
+            m_metrics->messagesDropped.add();
+        }
+    }
+    m_pending.clear();
+    disconnect(&m_client, nullptr, this, nullptr);
+    for (QMqttSubscription * subscription : std::as_const(m_subscriptions))
+    {
+        disconnect(subscription, nullptr, this, nullptr);
+    }
+    m_client.disconnectFromHost();
+}
+
+/**
+ * @brief Connect to the MQTT broker, with TLS if configured.
+ */
+void MqttConnection::connectToBroker()
+{
+    if (m_aggregator && !m_aggregationTimer.isActive())
+    {
+        m_aggregationTimer.start();
+    }
+    if (m_client.state() != QMqttClient::Disconnected)
+    {
+        return;
+    }
+
+    if (m_config.mqttUseTls())
+    {
+        QSslConfiguration sslconfig;
+        sslconfig.defaultConfiguration();
+        sslconfig.setProtocol(QSsl::TlsV1_2);
+        sslconfig.setPeerVerifyMode(QSslSocket::VerifyNone);
+        m_client.connectToHostEncrypted(sslconfig);
+    }
+    else
+    {
+        m_client.connectToHost();
+    }
+}
+
+/**
+ * @brief Called when the connection to the MQTT brocker is established and will subscribe to all topic filters.
+ */
+void MqttConnection::subscribe()
+{
+    logInfo("MQTT connection established");
+    m_backoff.reset();
+    const bool resubscribed = m_subscribed;
+    m_subscribed = true;
+
+    m_subscriptions.clear();
+    m_replaying.clear();
+    for (const QMqttTopicFilter & topic : std::as_const(m_unsubscribes))
+    {
+        m_client.unsubscribe(topic);
+    }
+    m_unsubscribes.clear();
+    for (const QString & filter : std::as_const(m_topicFilters))
+    {
+        QMqttSubscription * subscription = subscribeTo(filter);
+        if (!subscription)
+        {
+            return;
+        }
+        // The broker sends the retained messages right after subscribing, before newer ones.
+        if (resubscribed && m_config.mqttSkipRetained())
+        {
+            m_replaying.insert(subscription);
+        }
+    }
+}
+
+/**
+ * @brief Subscribe to \p filter, within the share group if configured.
+ *
+ * On failure the signal \ref errorOccured is emitted and nullptr is returned.
+ */
+QMqttSubscription * MqttConnection::subscribeTo(const QString & filter)
+{
+    const QMqttTopicFilter topic = subscriptionFilter(filter);
+    QMqttSubscription * subscription = m_client.subscribe(topic, static_cast<quint8>(m_config.mqttQos()));
+    if (!subscription) {
+        logError("Failed to subscribe to " + topic.filter());
+        emit errorOccured("Failed to subscribe to " + topic.filter(), 1);
+        return nullptr;
+    }
+    m_subscriptions.append(subscription);
+
+    // The client can return the subscription of a previous connection.
+    connect(subscription, &QMqttSubscription::stateChanged, this, &MqttConnection::onSubscriptionStateChanged, Qt::UniqueConnection);
+    connect(subscription, &QMqttSubscription::messageReceived, this, &MqttConnection::handleMessage, Qt::UniqueConnection);
+    return subscription;
+}
+
+/**
+ * @brief Filter subscribed for the topic filter \p filter, with the $share prefix of the share group.
+ */
+QMqttTopicFilter MqttConnection::subscriptionFilter(const QString & filter) const
+{
+    const QString shareGroup = m_config.mqttShareGroup();
+    return QMqttTopicFilter(shareGroup.isEmpty() ? filter : "$share/" + shareGroup + "/" + filter);
+}
+
+/**
+ * @brief Take over a reloaded \p config, called in the thread of the connection.
+ *
+ * The connection stays up, only the topic filters no longer in \p topicFilters are
+ * unsubscribed and the new ones subscribed. Received messages are routed by \p router
+ * from now on, the old router must stay valid until this is called.
+ */
+void MqttConnection::reconfigure(const Mqtt2SqlConfig & config, const QStringList & topicFilters, const MessageRouter * router)
+{
+    m_config = config;
+    m_router = router;
+    const bool connected = m_client.state() == QMqttClient::Connected;
+    for (const QString & filter : std::as_const(m_topicFilters))
+    {
+        if (topicFilters.contains(filter))
+        {
+            continue;
+        }
+        logInfo("Unsubscribing from " + filter);
+        const QMqttTopicFilter topic = subscriptionFilter(filter);
+        for (int i = m_subscriptions.size() - 1; i >= 0; --i)
+        {
+            if (m_subscriptions.at(i)->topic() == topic)
+            {
+                disconnect(m_subscriptions.at(i), nullptr, this, nullptr);
+                m_replaying.remove(m_subscriptions.at(i));
+                m_subscriptions.removeAt(i);
+            }
+        }
+        if (connected)
+        {
+            m_client.unsubscribe(topic);
+        }
+        else if (!m_config.mqttCleanSession())
+        {
+            // The broker keeps the subscriptions of the session, they are removed on connect.
+            m_unsubscribes.append(topic);
+        }
+    }
+    const QStringList previous = m_topicFilters;
+    m_topicFilters = topicFilters;
+    // Without connection all filters are subscribed on connect.
+    if (!connected)
+    {
+        m_unsubscribes.erase(std::remove_if(m_unsubscribes.begin(), m_unsubscribes.end(), [this](const QMqttTopicFilter & topic) {
+            return std::any_of(m_topicFilters.cbegin(), m_topicFilters.cend(), [this, &topic](const QString & filter) {
+                return subscriptionFilter(filter) == topic;
+            });
+        }), m_unsubscribes.end());
+        return;
+    }
+    for (const QString & filter : topicFilters)
+    {
+        if (!previous.contains(filter))
+        {
+            logInfo("Subscribing to " + filter);
+            if (!subscribeTo(filter))
+            {
+                return;
+            }
+        }
+    }
+}
+
+void MqttConnection::onSubscriptionStateChanged(QMqttSubscription::SubscriptionState state)
+{
+    logInfo("Subscription state changed: " + qMqttSubscriptionState(state));
+}
+
+/**
+ * @brief Called when an error occurs in the MQTT client.
+ *
+ * Will print the error via \ref qMqttClientErrorToString. Errors a reconnect can not fix,
+ * like rejected credentials, emit the signal \ref errorOccured, all others are handled by
+ * reconnecting in \ref onDisconnected.
+ */
+void MqttConnection::onConnectionError(QMqttClient::ClientError error)
+{
+    if (error != QMqttClient::NoError)
+    {
+        logError("MQTT error: " + qMqttClientErrorToString(error));
+        switch (error)
+        {
+        case QMqttClient::InvalidProtocolVersion:
+        case QMqttClient::IdRejected:
+        case QMqttClient::BadUsernameOrPassword:
+        case QMqttClient::NotAuthorized:
+            emit errorOccured(qMqttClientErrorToString(error), 3);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+/**
+ * @brief Called when the connection to the MQTT broker is lost or could not be established,
+ * schedules a reconnect with jittered exponential backoff.
+ *
+ * Queued and batched messages are kept by the writers meanwhile.
+ */
+void MqttConnection::onDisconnected()
+{
+    if (m_reconnectTimer.isActive())
+    {
+        return;
+    }
+    const std::chrono::milliseconds delay = m_backoff.next();
+    logWarning("MQTT connection lost, reconnecting in " + QString::number(delay.count()) + " ms.");
+    m_reconnectTimer.start(delay);
+}
+
+/**
+ * @brief Called when a MQTT message is received.
+ *
+ * Queues the received message for the \ref SqlWriter threads, with the receive time as ts,
+ * the messages topic as topic and the messages payload as data. If the queue is full the
+ * message is appended to the spool, without spool it is dropped. With QoS 1 or 2 the
+ * connection stops reading instead of dropping the message, see \ref enqueue. Messages matching
+ * an exclude filter are dropped before anything else is done. Retained messages sent again after
+ * a reconnect, until the subscription receives its first non-retained message, and messages the
+ * \ref DuplicateFilter has seen are skipped if configured. Numeric
+ * messages of aggregated topics are added to the \ref Aggregator and only stored with keepraw.
+ * With normalized topics the topic id is taken from the topic dictionary, with routes the
+ * route is assigned by the \ref MessageRouter.
+ */
+void MqttConnection::handleMessage(const QMqttMessage &msg)
+{
+    const qint64 received = m_clock.now();
+    if (!m_excludes.isEmpty() && m_excludes.match(msg.topic().name()) >= 0)
+    {
+        return;
+    }
+    m_metrics->messagesReceived.add();
+    bool replayed = false;
+    if (!m_replaying.isEmpty())
+    {
+        QMqttSubscription * subscription = qobject_cast<QMqttSubscription *>(sender());
+        if (m_replaying.contains(subscription))
+        {
+            replayed = msg.retain();
+            if (!replayed)
+            {
+                m_replaying.remove(subscription);
+            }
+        }
+    }
+    if (replayed
+            || (m_duplicates && m_duplicates->isDuplicate(msg.topic().name(), msg.payload(), received)))
+    {
+        m_metrics->messagesDuplicate.add();
+        return;
+    }
+    if (Logger::instance().isEnabled(LogLevel::Debug))
+    {
+        logDebug("Message received. Topic: " + msg.topic().name() + ", Message: " + QString::fromUtf8(msg.payload()));
+    }
+    const qint64 ts = messageTimestamp(msg, received);
+    if (m_aggregator)
+    {
+        const int aggregation = m_aggregator->match(msg.topic().name());
+        if (aggregation >= 0 && m_aggregator->add(aggregation, msg.topic().name(), msg.payload(), ts, m_closedWindows))
+        {
+            m_metrics->messagesAggregated.add();
+            enqueueWindows();
+            if (!m_aggregator->keepRaw(aggregation))
+            {
+                return;
+            }
+        }
+    }
+    MqttRecord record {ts, msg.topic().name(), msg.payload()};
+    if (m_topics)
+    {
+        // Unknown topics are resolved by the writers.
+        record.topicId = m_topics->find(record.topic);
+    }
+    if (m_router)
+    {
+        record.route = m_router->route(record.topic);
+    }
+    enqueue(std::move(record));
+}
+
+/**
+ * @brief Push \p record to the queue, to the spool if the queue is full, or drop it.
+ *
+ * With QoS 1 or 2 and without room in the spool the record is kept and the connection stops
+ * reading from the broker, see \ref pauseReading, instead of dropping the record.
+ */
+void MqttConnection::enqueue(MqttRecord && record)
+{
+    // Records received while paused keep their order behind the pending ones.
+    if (m_pending.isEmpty() && m_queue.tryPush(std::move(record)))
+    {
+        return;
+    }
+    if (m_spool && m_spool->append(record))
+    {
+        m_metrics->messagesSpooled.add();
+        return;
+    }
+    if (m_config.mqttQos() > 0 && !m_stopped)
+    {
+        m_pending.append(std::move(record));
+        pauseReading();
+        return;
+    }
+    m_metrics->messagesDropped.add();
+    Logger::instance().logLimited(LogLevel::Error, "queue-full", "Error: queue full, message dropped. Topic: " + record.topic);
+}
+
+/**
+ * @brief Stop reading from the broker until the pending records are queued.
+ *
+ * QtMqtt acknowledges a message once it is handed over, so the signals of the transport are
+ * blocked and the socket buffer is limited, which keeps further messages unacknowledged at
+ * the broker. The event loop keeps running, \ref resumeReading is called by a timer.
+ */
+void MqttConnection::pauseReading()
+{
+    if (m_paused)
+    {
+        return;
+    }
+    m_paused = true;
+    logWarning("Queue full, pausing MQTT connection until the writers catch up.");
+    QIODevice * transport = m_client.transport();
+    if (transport)
+    {
+        transport->blockSignals(true);
+        if (QAbstractSocket * socket = qobject_cast<QAbstractSocket *>(transport))
+        {
+            socket->setReadBufferSize(64 * 1024);
+        }
+    }
+    m_resumeTimer.start();
+}
+
+/**
+ * @brief Queue the pending records and continue reading from the broker once all are queued.
+ */
+void MqttConnection::resumeReading()
+{
+    int queued = 0;
+    while (queued < m_pending.size() && m_queue.tryPush(std::move(m_pending[queued])))
+    {
+        ++queued;
+    }
+    m_pending.erase(m_pending.begin(), m_pending.begin() + queued);
+    if (!m_pending.isEmpty())
+    {
+        return;
+    }
+    m_resumeTimer.stop();
+    m_paused = false;
+    logInfo("MQTT connection resumed.");
+    QIODevice * transport = m_client.transport();
+    if (!transport)
+    {
+        return;
+    }
+    transport->blockSignals(false);
+    QAbstractSocket * socket = qobject_cast<QAbstractSocket *>(transport);
+    if (socket)
+    {
+        socket->setReadBufferSize(0);
+        // Signals of a lost connection were blocked as well.
+        if (socket->state() != QAbstractSocket::ConnectedState)
+        {
+            m_client.disconnectFromHost();
+            onDisconnected();
+            return;
+        }
+    }
+    if (transport->bytesAvailable() > 0)
+    {
+        QMetaObject::invokeMethod(transport, "readyRead", Qt::QueuedConnection);
+    }
+}
+
+/**
+ * @brief Queue the records of the closed windows, their route is already set by the \ref Aggregator.
+ */
+void MqttConnection::enqueueWindows()
+{
+    for (MqttRecord & record : m_closedWindows)
+    {
+        if (m_topics)
+        {
+            record.topicId = m_topics->find(record.topic);
+        }
+        enqueue(std::move(record));
+    }
+    m_closedWindows.clear();
+}
+
+/**
+ * @brief Close the windows whose end has passed, so quiet topics are written as well.
+ */
+void MqttConnection::closeWindows()
+{
+    m_aggregator->closeExpired(m_clock.now(), m_closedWindows);
+    enqueueWindows();
+}
+
+/**
+ * @brief Timestamp of \p msg, taken from the configured MQTT 5 user property if present.
+ *
+ * The property holds milliseconds since the Unix epoch or an ISO 8601 date, without
+ * a valid property \p received is used.
+ */
+qint64 MqttConnection::messageTimestamp(const QMqttMessage & msg, qint64 received) const
+{
+    if (m_config.mqttTimestampProperty().isEmpty()
+            || !(msg.publishProperties().availableProperties() & QMqttPublishProperties::UserProperty))
+    {
+        return received;
+    }
+    const QMqttUserProperties properties = msg.publishProperties().userProperties();
+    for (const QMqttStringPair & property : properties)
+    {
+        if (property.name() != m_config.mqttTimestampProperty())
+        {
+            continue;
+        }
+        bool ok = false;
+        const qint64 msecs = property.value().toLongLong(&ok);
+        if (ok)
+        {
+            return msecs;
+        }
+        const QDateTime ts = QDateTime::fromString(property.value(), Qt::ISODateWithMs);
+        return ts.isValid() ? ts.toMSecsSinceEpoch() : received;
+    }
+    return received;
+}
@@ -0,0 +1,122 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef MQTTCONNECTION_H
+#define MQTTCONNECTION_H
+
+#include <QMqttClient>
+#include <QMqttMessage>
+#include <QMqttSubscription>
+#include <QObject>
+#include <QSet>
+#include <QStringList>
+#include <QTimer>
+#include <QVector>
+
+#include <memory>
+
+#include "aggregator.h"
+#include "duplicatefilter.h"
+#include "exponentialbackoff.h"
+#include "messagerouter.h"
+#include "messagespool.h"
+#include "metrics.h"
+#include "mqtt2sqlconfig.h"
+#include "receiveclock.h"
+#include "sqlwriter.h"
+#include "topicdictionary.h"
+#include "topicmatcher.h"
+
+/**
+ * @brief One connection to the MQTT broker, subscribing to a part of the topic filters.
+ *
+ * Received messages are pushed to the \ref RecordQueue shared with all connections and
+ * writers. Every connection is meant to run in its own thread, so TLS and MQTT parsing
+ * of several connections run in parallel. The spool, topic dictionary, router and exclude
+ * filters are shared and thread safe.
+ */
+class MqttConnection : public QObject
+{
+    Q_OBJECT
+public:
+    MqttConnection(const Mqtt2SqlConfig & config, const QStringList & topicFilters, const QString & clientId,
+                   RecordQueue & queue, MessageSpool * spool, const TopicDictionary * topics,
+                   const MessageRouter * router, const TopicMatcher & excludes, MetricsShard * metrics,
+                   QObject *parent = nullptr);
+
+    void reconfigure(const Mqtt2SqlConfig & config, const QStringList & topicFilters, const MessageRouter * router);
+
+public slots:
+    void connectToBroker();
+    void stop();
+
+signals:
+    /// Is emitted when an error occurs.
+    void errorOccured(const QString & error, int exitcode);
+
+private slots:
+    void subscribe();
+    void onConnectionError(QMqttClient::ClientError error);
+    void onDisconnected();
+    void onSubscriptionStateChanged(QMqttSubscription::SubscriptionState state);
+    void handleMessage(const QMqttMessage &msg);
+    void closeWindows();
+    void resumeReading();
+
+private:
+    QMqttSubscription * subscribeTo(const QString & filter);
+    QMqttTopicFilter subscriptionFilter(const QString & filter) const;
+    qint64 messageTimestamp(const QMqttMessage & msg, qint64 received) const;
+    void enqueue(MqttRecord && record);
+    void pauseReading();
+    void enqueueWindows();
+
+    Mqtt2SqlConfig m_config;
+    QStringList m_topicFilters;
+    RecordQueue & m_queue;
+    MessageSpool * m_spool;
+    const TopicDictionary * m_topics;
+    const MessageRouter * m_router;
+    const TopicMatcher & m_excludes;
+    MetricsShard * m_metrics;
+    QMqttClient m_client {this};
+    QVector<QMqttSubscription *> m_subscriptions;
+    /// Filters removed by a reload while not connected, the session of the broker still holds them.
+    QVector<QMqttTopicFilter> m_unsubscribes;
+    QTimer m_reconnectTimer {this};
+    ExponentialBackoff m_backoff;
+    ReceiveClock m_clock;
+    /// Null if the deduplication is disabled.
+    std::unique_ptr<DuplicateFilter> m_duplicates;
+    /// Subscriptions made again after a reconnect which have not yet received a non-retained message.
+    QSet<QMqttSubscription *> m_replaying;
+    bool m_subscribed = false;
+    /// Null without aggregations.
+    std::unique_ptr<Aggregator> m_aggregator;
+    QTimer m_aggregationTimer {this};
+    /// Records of closed windows, reused.
+    QVector<MqttRecord> m_closedWindows;
+    /// Records which did not fit into the queue while reading is paused, in receive order.
+    QVector<MqttRecord> m_pending;
+    QTimer m_resumeTimer {this};
+    bool m_paused = false;
+    bool m_stopped = false;
+};
+
+#endif // MQTTCONNECTION_H
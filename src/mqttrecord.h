@@ -0,0 +1,58 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef MQTTRECORD_H
+#define MQTTRECORD_H
+
+#include <QByteArray>
+#include <QString>
+
+#include "jsonvalidator.h"
+
+/// Values of a closed window of the \ref Aggregator, stored as the payload of its record.
+struct AggregateWindow
+{
+    qint64 windowMs = 0;
+    qint64 count = 0;
+    double min = 0;
+    double max = 0;
+    double avg = 0;
+};
+
+/// A received message waiting to be written to the database.
+struct MqttRecord
+{
+    /// Receive time in milliseconds since the Unix epoch (UTC).
+    qint64 ts = 0;
+    QString topic;
+    QByteArray payload;
+    /// Id of the topic in the topics table, -1 if not resolved yet.
+    int topicId = -1;
+    /// Index of the route of the message, -1 for the mqtt table.
+    int route = -1;
+    /// Whether the record is a window of the \ref Aggregator, which is always written to the aggregate route.
+    /// Its payload holds the \ref AggregateWindow bytes instead of JSON, so it is not parsed again.
+    bool aggregate = false;
+    /// Set by the writer with classified payloads.
+    PayloadType payloadType = PayloadType::Json;
+    /// Value of a \ref PayloadType::Number payload.
+    double number = 0;
+};
+
+#endif // MQTTRECORD_H
@@ -18,226 +18,923 @@
 // SPDX-License-Identifier: GPL-3.0-or-later
 
 #include "mqttsubscriber.h"
+#include "logger.h"
 
+#include <QCryptographicHash>
 #include <QSqlDatabase>
 #include <QSqlQuery>
 #include <QSqlError>
+#include <QStringList>
+
+#include <algorithm>
+
+/// Advisory lock held while the schema is created, so several instances do not create it at once.
+static constexpr qint64 schemaLockKey = 0x716d717432737101;
+
+/// Part of the schema comment, increased whenever createSchema creates a different schema for the same config.
+static constexpr int schemaVersion = 1;
 
 /**
- * Convert QMqttClient::ClientError to a descriptive string.
+ * Length of one partition of the mqtt table.
  */
-QString qMqttClientErrorToString(QMqttClient::ClientError error)
+std::chrono::hours partitionLength(Mqtt2SqlConfig::Partitioning partitioning)
 {
-    // Error description taken from: https://doc.qt.io/qt-5/qmqttclient.html#ClientError-enum
-    switch (error)
-    {
-    case QMqttClient::NoError: return "No error occurred."; break;
-    case QMqttClient::InvalidProtocolVersion: return "Error: The broker does not accept a connection using the specified protocol version."; break;
-    case QMqttClient::IdRejected: return "Error: The client ID is malformed. This might be related to its length."; break;
-    case QMqttClient::ServerUnavailable: return "Error: The network connection has been established, but the service is unavailable on the broker side."; break;
-    case QMqttClient::BadUsernameOrPassword: return "Error: The data in the username or password is malformed."; break;
-    case QMqttClient::NotAuthorized: return "Error: The client is not authorized to connect."; break;
+    return partitioning == Mqtt2SqlConfig::Partitioning::Hourly ? std::chrono::hours(1) : std::chrono::hours(24);
+}
 
-    case QMqttClient::TransportInvalid: return "Error: The underlying transport caused an error. For example, the connection might have been interrupted unexpectedly."; break;
-    case QMqttClient::ProtocolViolation: return "Error: The client encountered a protocol violation, and therefore closed the connection."; break;
-    case QMqttClient::UnknownError: return "Error: An unknown error occurred."; break;
-    case QMqttClient::Mqtt5SpecificError: return "Error: The error is related to MQTT protocol level 5. A reason code might provide more details."; break;
-    }
-    return QString();
+/**
+ * Start of the partition containing \p ts, in UTC.
+ */
+QDateTime partitionStart(const QDateTime & ts, Mqtt2SqlConfig::Partitioning partitioning)
+{
+    const QDateTime utc = ts.toUTC();
+    const int hour = partitioning == Mqtt2SqlConfig::Partitioning::Hourly ? utc.time().hour() : 0;
+    return QDateTime(utc.date(), QTime(hour, 0), Qt::UTC);
 }
 
 /**
- * Convert QMqttClient::ClientState to a descriptive string.
+ * Name of the partition starting at \p start: mqtt_pYYYYMMDD for daily and mqtt_pYYYYMMDDHH for hourly partitions.
  */
-QString qMqttClientStateToString(QMqttClient::ClientState state)
+QString partitionName(const QDateTime & start, Mqtt2SqlConfig::Partitioning partitioning)
 {
-    // State description taken from: https://doc.qt.io/qt-5/qmqttclient.html#ClientState-enum
-    switch (state)
+    return "mqtt_p" + start.toString(partitioning == Mqtt2SqlConfig::Partitioning::Hourly ? "yyyyMMddHH" : "yyyyMMdd");
+}
+
+MqttSubscriber::MqttSubscriber(const Mqtt2SqlConfig & config, QObject *parent)
+    : QObject{parent}
+    , m_config(config)
+    , m_queue(config.sqlQueueSize())
+    , m_schemaBackoff(config.sqlReconnectMin(), config.sqlReconnectMax())
+{
+    m_routerTimer.setInterval(std::chrono::seconds(1));
+    connect(&m_routerTimer, &QTimer::timeout, this, &MqttSubscriber::releaseRouters);
+    for (const QString & filter : config.mqttExcludeTopics())
+    {
+        m_excludes.addFilter(filter, 0);
+    }
+    if (config.sqlNormalizeTopics())
+    {
+        m_topics = std::make_unique<TopicDictionary>();
+    }
+    if (!config.routes().isEmpty())
     {
-    case QMqttClient::Disconnected: return "The client is disconnected from the broker."; break;
-    case QMqttClient::Connecting: return "A connection request has been made, but the broker has not approved the connection yet."; break;
-    case QMqttClient::Connected: return "The client is connected to the broker."; break;
+        m_router = std::make_unique<MessageRouter>(config.routes());
     }
-    return QString();
+
+    if (!config.spoolDirectory().isEmpty())
+    {
+        m_spool = std::make_unique<MessageSpool>(config.spoolDirectory(), config.spoolSegmentSize(), config.spoolMaxSize());
+        if (!m_spool->open())
+        {
+            logError(m_spool->lastError());
+            m_spool.reset();
+        }
+    }
+
+    if (config.metricsPort() != 0)
+    {
+        m_metrics.addGauge("qmqtt2sql_queue_depth", "Messages waiting for a writer.",
+                           [this]() { return static_cast<double>(m_queue.size()); });
+        m_metrics.addGauge("qmqtt2sql_spool_bytes", "Size of the spooled messages not written yet.",
+                           [this]() { return m_spool ? static_cast<double>(m_spool->pendingBytes()) : 0.0; });
+        m_metricsServer = std::make_unique<MetricsServer>(m_metrics);
+        if (!m_metricsServer->listen(config.metricsAddress(), config.metricsPort()))
+        {
+            logError("Error: can not listen for metrics requests: " + m_metricsServer->errorString());
+            m_metricsServer.reset();
+        }
+    }
+
+    // The other sinks create their tables and files themselves.
+    const bool psql = config.sinkType() == Mqtt2SqlConfig::SinkType::Psql;
+    m_schemaReady.store(!psql, std::memory_order_release);
+
+    // The writers and the MQTT connections connect while the schema is created below,
+    // messages received until then wait in the queue or the spool.
+    for (int i = 0; i < config.sqlWriters(); ++i)
+    {
+        SqlWriter * writer = new SqlWriter(config, m_queue, m_spool.get(), m_topics.get(), m_router.get(),
+                                           m_metrics.addShard(), m_schemaReady, i, this);
+        m_writers.append(writer);
+        writer->start();
+    }
+    startConnections();
+
+    if (psql)
+    {
+        QSqlDatabase db = QSqlDatabase::addDatabase("QPSQL");
+        db.setHostName(config.sqlHostname());
+        db.setDatabaseName(config.sqlDatabase());
+        db.setPort(config.sqlPort());
+        db.setUserName(config.sqlUsername());
+        db.setPassword(config.sqlPassword());
+        prepareSchema();
+    }
+
+    // TimescaleDB runs the retention of the mqtt table itself, see createHypertable.
+    if (psql && !RetentionCleaner::tables(config).isEmpty())
+    {
+        startCleaner();
+    }
+}
+
+/**
+ * @brief Start the \ref RetentionCleaner in its own thread and the timer of the periodic cleanup.
+ */
+void MqttSubscriber::startCleaner()
+{
+    m_cleaner = new RetentionCleaner(m_config, m_metrics.addShard());
+    m_cleanerThread = new QThread(this);
+    m_cleanerThread->setObjectName("qmqtt2sql-cleanup");
+    m_cleaner->moveToThread(m_cleanerThread);
+    m_cleanerThread->start();
+
+    m_cleanupTimer.setInterval(m_config.sqlCleanupInterval());
+    m_cleanupTimer.setSingleShot(false);
+    connect(&m_cleanupTimer, &QTimer::timeout, this, &MqttSubscriber::cleanup);
+    m_cleanupTimer.start();
 }
 
 /**
- * Convert QMqttSubscription::SubscriptionState to a descriptive string.
+ * @brief Start the MQTT connections, each in its own thread.
+ *
+ * Without share group the topic filters are distributed round robin over the connections,
+ * so every connection subscribes to a disjoint set. With share group every connection
+ * subscribes to all filters and the broker distributes the messages. With more than one
+ * connection the configured client id gets the connection number appended.
  */
-QString qMqttSubscriptionState(QMqttSubscription::SubscriptionState state)
+void MqttSubscriber::startConnections()
 {
-    // State description taken from: https://doc.qt.io/qt-5/qmqttsubscription.html#SubscriptionState-enum
-    switch (state)
+    const int count = m_config.mqttShareGroup().isEmpty()
+            ? qMin(m_config.mqttConnections(), static_cast<int>(m_config.mqttTopics().size()))
+            : m_config.mqttConnections();
+    QVector<QStringList> filters(count);
+    for (int i = 0; i < m_config.mqttTopics().size(); ++i)
     {
-    case QMqttSubscription::Unsubscribed: return "The topic has been unsubscribed from."; break;
-    case QMqttSubscription::SubscriptionPending: return "A request for a subscription has been sent, but is has not been confirmed by the broker yet."; break;
-    case QMqttSubscription::Subscribed: return "The subscription was successful and messages will be received."; break;
-    case QMqttSubscription::UnsubscriptionPending: return "A request to unsubscribe from a topic has been sent, but it has not been confirmed by the broker yet."; break;
-    case QMqttSubscription::Error: return "An error occured."; break;
+        if (m_config.mqttShareGroup().isEmpty())
+        {
+            filters[i % count] << m_config.mqttTopics().at(i);
+        }
+        else
+        {
+            for (QStringList & connectionFilters : filters)
+            {
+                connectionFilters << m_config.mqttTopics().at(i);
+            }
+        }
+    }
+
+    for (int i = 0; i < count; ++i)
+    {
+        QString clientId = m_config.mqttClientId();
+        if (!clientId.isEmpty() && count > 1)
+        {
+            clientId += QString("-%1").arg(i);
+        }
+        MqttConnection * connection = new MqttConnection(m_config, filters.at(i), clientId, m_queue, m_spool.get(),
+                                                         m_topics.get(), m_router.get(), m_excludes, m_metrics.addShard());
+        QThread * thread = new QThread(this);
+        thread->setObjectName(QString("qmqtt2sql-mqtt-%1").arg(i));
+        connection->moveToThread(thread);
+        connect(thread, &QThread::started, connection, &MqttConnection::connectToBroker);
+        connect(connection, &MqttConnection::errorOccured, this, &MqttSubscriber::errorOccured);
+        m_connections.append(connection);
+        m_connectionThreads.append(thread);
+        thread->start();
     }
-    return QString();
+    m_connectionFilters = filters;
 }
 
-MqttSubscriber::MqttSubscriber(const Mqtt2SqlConfig & config, QObject *parent)
-    : QObject{parent}
-    , m_config(config)
+/**
+ * @brief Apply the settings of the reloaded \p config which can be changed while running.
+ *
+ * See Mqtt2SqlConfig::update for the settings applied, the others are logged and need a
+ * restart. The tables of new routes are created first, then the writers get the new config,
+ * which they take over before their next batch, and then the connections, which stay
+ * connected and only subscribe to the added and unsubscribe from the removed topic filters.
+ * Queued messages and the batches in progress are kept.
+ */
+void MqttSubscriber::reload(const Mqtt2SqlConfig & config)
 {
-    m_client.setProtocolVersion(config.mqttVersion());
-    m_client.setHostname(config.mqttHostname());
-    m_client.setPort(config.mqttPort());
-    QMqttConnectionProperties props;
-    m_client.setConnectionProperties(props);
-    connect(&m_client, &QMqttClient::errorChanged, this, &MqttSubscriber::onConnectionError);
-    connect(&m_client, &QMqttClient::connected, this, &MqttSubscriber::subscribe);
+    Mqtt2SqlConfig updated = m_config;
+    const Mqtt2SqlConfig::Changes changes = updated.update(config);
+    for (const QString & key : changes.restart)
+    {
+        logWarning("Setting " + key + " changed, it is applied on the next restart.");
+    }
+    if (!changes.topics && !changes.routes && !changes.batch && !changes.retention && !changes.log
+        && !changes.indexes)
+    {
+        logInfo("Config reloaded, no changes to apply.");
+        return;
+    }
 
-    if (!config.mqttUsername().isEmpty() && !config.mqttPassword().isEmpty())
+    const bool psql = m_config.sinkType() == Mqtt2SqlConfig::SinkType::Psql;
+    if (changes.routes && psql)
     {
-        m_client.setUsername(config.mqttUsername());
-        m_client.setPassword(config.mqttPassword());
+        QSqlDatabase db = QSqlDatabase::database(QLatin1String(QSqlDatabase::defaultConnection), false);
+        if (!db.isOpen() && !db.open())
+        {
+            logError("Error: can not create the tables of the routes, config not reloaded: " + db.lastError().text());
+            return;
+        }
     }
+    m_config = updated;
 
-    if (config.mqttUseTls())
+    if (changes.log)
     {
-        QSslConfiguration sslconfig;
-        sslconfig.defaultConfiguration();
-        sslconfig.setProtocol(QSsl::TlsV1_2);
-        sslconfig.setPeerVerifyMode(QSslSocket::VerifyNone);
-        m_client.connectToHostEncrypted(sslconfig);
+        Logger::instance().setLevel(m_config.logLevel());
+        Logger::instance().setRateLimit(m_config.logRateLimit(), m_config.logRateInterval());
     }
-    else
+    if (changes.routes)
     {
-        m_client.connectToHost();
+        if (psql)
+        {
+            withSchemaLock(&MqttSubscriber::addRoutes);
+        }
+        m_retiredRouters.push_back(std::move(m_router));
+        m_router = std::make_unique<MessageRouter>(m_config.routes());
+        m_routerTimer.start();
     }
 
-    QSqlDatabase db = QSqlDatabase::addDatabase("QPSQL");
-    db.setHostName(config.sqlHostname());
-    db.setDatabaseName(config.sqlDatabase());
-    db.setPort(config.sqlPort());
-    db.setUserName(config.sqlUsername());
-    db.setPassword(config.sqlPassword());
-    if (db.open())
+    // Before the connections, so the writers know the new routes once records using them are queued.
+    const bool recreateSinks = changes.routes || (!psql && changes.retention);
+    for (SqlWriter * writer : std::as_const(m_writers))
     {
-        QSqlQuery query("CREATE TABLE IF NOT EXISTS mqtt (ts timestamp with time zone, topic varchar(255), data jsonb);");
-        if (!query.exec())
+        writer->reconfigure(m_config, m_router.get(), recreateSinks);
+    }
+
+    if (changes.topics)
+    {
+        redistributeTopics();
+    }
+    for (int i = 0; i < m_connections.size(); ++i)
+    {
+        MqttConnection * connection = m_connections.at(i);
+        const Mqtt2SqlConfig connectionConfig = m_config;
+        const QStringList filters = m_connectionFilters.at(i);
+        const MessageRouter * router = m_router.get();
+        ++m_connectionReloads;
+        QMetaObject::invokeMethod(connection, [this, connection, connectionConfig, filters, router]() {
+            connection->reconfigure(connectionConfig, filters, router);
+            QMetaObject::invokeMethod(this, [this]() { --m_connectionReloads; }, Qt::QueuedConnection);
+        }, Qt::QueuedConnection);
+    }
+
+    if (psql && (changes.retention || changes.routes))
+    {
+        if (m_cleaner)
         {
-            QTextStream(stderr) << "Error while creating mqtt table: " << query.lastError().text() << Qt::endl;
+            RetentionCleaner * cleaner = m_cleaner;
+            const Mqtt2SqlConfig cleanerConfig = m_config;
+            QMetaObject::invokeMethod(cleaner, [cleaner, cleanerConfig]() { cleaner->setConfig(cleanerConfig); }, Qt::QueuedConnection);
+            m_cleanupTimer.setInterval(m_config.sqlCleanupInterval());
         }
-        QSqlQuery query2("CREATE INDEX mqtt_topic_idx ON mqtt (topic DESC);");
-        if (!query2.exec())
+        else if (!RetentionCleaner::tables(m_config).isEmpty())
         {
-            QTextStream(stderr) << "Error while creating index: " << query2.lastError().text() << Qt::endl;
+            startCleaner();
         }
     }
-    else
+    // Before the schema is ready prepareSchema starts the build with the new indexes.
+    if (psql && changes.indexes && m_schemaReady.load(std::memory_order_acquire))
     {
-        QTextStream(stderr) << "Error: Faild to open database: " << db.lastError().text() << Qt::endl;
-        emit errorOccured(db.lastError().text(), 2);
+        startIndexBuilder();
     }
+    logInfo("Config reloaded.");
+}
 
-    m_cleanupTimer.setInterval(60*60*1000);
-    m_cleanupTimer.setSingleShot(false);
-    connect(&m_cleanupTimer, &QTimer::timeout, this, &MqttSubscriber::cleanup);
-    m_cleanupTimer.start();
+/**
+ * @brief Delete the routers retired by reloads once all writers and connections took over the new one.
+ */
+void MqttSubscriber::releaseRouters()
+{
+    if (m_connectionReloads > 0
+            || !std::all_of(m_writers.cbegin(), m_writers.cend(), [](SqlWriter * writer) { return writer->isReconfigured(); }))
+    {
+        return;
+    }
+    m_retiredRouters.clear();
+    m_routerTimer.stop();
 }
 
 /**
- * @brief Called when the connection to the MQTT brocker is established and will subscribe to the topic.
+ * @brief Distribute the reloaded topic filters over the existing connections.
+ *
+ * Filters still configured stay on their connection, so their subscription is not touched.
+ * New filters go to the connection with the fewest filters, with share group every
+ * connection subscribes to all filters.
  */
-void MqttSubscriber::subscribe()
+void MqttSubscriber::redistributeTopics()
 {
-    QTextStream(stdout) << "MQTT connection established" << Qt::endl;
+    const QStringList & topics = m_config.mqttTopics();
+    if (!m_config.mqttShareGroup().isEmpty())
+    {
+        for (QStringList & filters : m_connectionFilters)
+        {
+            filters = topics;
+        }
+        return;
+    }
+    for (QStringList & filters : m_connectionFilters)
+    {
+        filters.erase(std::remove_if(filters.begin(), filters.end(), [&topics](const QString & filter) {
+            return !topics.contains(filter);
+        }), filters.end());
+    }
+    for (const QString & topic : topics)
+    {
+        const bool assigned = std::any_of(m_connectionFilters.cbegin(), m_connectionFilters.cend(), [&topic](const QStringList & filters) {
+            return filters.contains(topic);
+        });
+        if (!assigned)
+        {
+            auto fewest = std::min_element(m_connectionFilters.begin(), m_connectionFilters.end(), [](const QStringList & a, const QStringList & b) {
+                return a.size() < b.size();
+            });
+            fewest->append(topic);
+        }
+    }
+}
 
-    QMqttTopicFilter topic(m_config.mqttTopic());
-    m_subscription = m_client.subscribe(topic);
-    if (!m_subscription) {
-        QTextStream(stderr) << "Failed to subscribe to " << topic.filter() << Qt::endl;
-        emit errorOccured("Failed to subscribe to " + topic.filter(), 1);
+/**
+ * @brief Closes the queue and waits until the writers have written all queued messages.
+ */
+MqttSubscriber::~MqttSubscriber()
+{
+    for (int i = 0; i < m_connections.size(); ++i)
+    {
+        QMetaObject::invokeMethod(m_connections.at(i), &MqttConnection::stop, Qt::BlockingQueuedConnection);
+        m_connectionThreads.at(i)->quit();
+        m_connectionThreads.at(i)->wait();
+    }
+    qDeleteAll(m_connections);
+    if (m_cleaner)
+    {
+        QMetaObject::invokeMethod(m_cleaner, &RetentionCleaner::stop, Qt::BlockingQueuedConnection);
+        m_cleanerThread->quit();
+        m_cleanerThread->wait();
+        delete m_cleaner;
+    }
+    if (m_indexBuilder)
+    {
+        // A running CREATE INDEX is not interrupted, the build is finished first.
+        m_indexBuilder->requestInterruption();
+        m_indexBuilder->wait();
+    }
+    m_queue.close();
+    for (SqlWriter * writer : std::as_const(m_writers))
+    {
+        writer->wait();
     }
+    // The writers hold pointers to the spool, the topics and the router, delete them first.
+    qDeleteAll(m_writers);
+    m_writers.clear();
+}
 
-    connect(m_subscription, &QMqttSubscription::stateChanged, this,
-            [](QMqttSubscription::SubscriptionState s) {
-        QTextStream(stdout) << "Subscription state changed: " << qMqttSubscriptionState(s) << Qt::endl;
-    });
+/**
+ * @brief Open the database and create the schema, retried with backoff until the schema is complete.
+ *
+ * The writers only write once the schema is complete, messages wait in the queue or the spool meanwhile.
+ */
+void MqttSubscriber::prepareSchema()
+{
+    if (openDatabase() && m_schemaComplete)
+    {
+        m_schemaBackoff.reset();
+        m_schemaReady.store(true, std::memory_order_release);
+        // The concurrent indexes need the tables, so they are built once the schema is complete.
+        if (m_config.sqlConcurrentIndexes())
+        {
+            startIndexBuilder();
+        }
+        return;
+    }
+    const std::chrono::milliseconds delay = m_schemaBackoff.next();
+    logWarning("Schema not ready, retrying in " + QString::number(delay.count()) + " ms.");
+    QTimer::singleShot(delay, this, &MqttSubscriber::prepareSchema);
+}
+
+/**
+ * @brief Build the missing indexes of the config with CREATE INDEX CONCURRENTLY in the \ref IndexBuilder thread.
+ *
+ * Existing indexes are skipped. While a build is still running no second one is started, as both
+ * would use the same connection name, the indexes changed meanwhile are built by the next reload or start.
+ */
+void MqttSubscriber::startIndexBuilder()
+{
+    if (m_indexBuilder && !m_indexBuilder->isFinished())
+    {
+        logWarning("Index build still running, the changed indexes are built on the next reload or restart.");
+        return;
+    }
+    delete m_indexBuilder;
+    m_indexBuilder = new IndexBuilder(m_config, this);
+    m_indexBuilder->start();
+}
 
-    connect(m_subscription, &QMqttSubscription::messageReceived, this,
-            [this](const QMqttMessage & msg) {
-        handleMessage(msg);
-    });
+/**
+ * @brief Open the default database connection, which is used for the schema and the cleanup.
+ *
+ * The schema is only created if isSchemaCurrent() returns false. Otherwise the topics are read
+ * and the partitions are maintained, which does not depend on the schema check.
+ */
+bool MqttSubscriber::openDatabase()
+{
+    QSqlDatabase db = QSqlDatabase::database(QLatin1String(QSqlDatabase::defaultConnection), false);
+    if (db.open())
+    {
+        if (!isSchemaCurrent())
+        {
+            withSchemaLock(&MqttSubscriber::createSchema);
+            return true;
+        }
+        m_schemaComplete = true;
+        if (m_config.sqlNormalizeTopics())
+        {
+            loadTopics();
+        }
+        if (m_config.sqlPartitioning() != Mqtt2SqlConfig::Partitioning::None)
+        {
+            withSchemaLock(&MqttSubscriber::maintainPartitions);
+        }
+        return true;
+    }
+    logError("Error: Faild to open database: " + db.lastError().text());
+    return false;
 }
 
 /**
- * @brief Called when an error occurs in the MQTT client.
+ * @brief Returns true if the schema does not need to be created, depending on sqlSchemaCheck().
  *
- * Will print the error via \ref qMqttClientErrorToString and emit the signal \ref errorOccured.
+ * With SchemaCheck::Version a single catalog query reads the comment of the mqtt table, which
+ * createSchema sets to schemaComment() once all statements succeeded.
  */
-void MqttSubscriber::onConnectionError(QMqttClient::ClientError error)
+bool MqttSubscriber::isSchemaCurrent()
 {
-    if (error != QMqttClient::NoError)
+    switch (m_config.sqlSchemaCheck())
+    {
+    case Mqtt2SqlConfig::SchemaCheck::Skip:
+        return true;
+    case Mqtt2SqlConfig::SchemaCheck::Full:
+        return false;
+    case Mqtt2SqlConfig::SchemaCheck::Version:
+        break;
+    }
+    QSqlQuery query;
+    if (!query.exec("SELECT obj_description(to_regclass('mqtt'), 'pg_class');") || !query.next())
+    {
+        logError("Error while reading schema version: " + query.lastError().text());
+        return false;
+    }
+    if (query.value(0).toString() != schemaComment())
     {
-        QTextStream(stderr) << "MQTT error: " << qMqttClientErrorToString(error) << Qt::endl;
-        emit errorOccured(qMqttClientErrorToString(error), 3);
+        logInfo("Schema version changed, creating schema.");
+        return false;
     }
+    return true;
 }
 
 /**
- * @brief Called when a MQTT message is received.
+ * @brief Comment of the mqtt table identifying the schema created for this config.
  *
- * Inserts the received message in the QSqlDatabase, with current timestamp as ts,
- * the messages topic as topic and the messages payload as data.
+ * A hash of every setting createSchema depends on, so a changed setting creates the schema again.
  */
-void MqttSubscriber::handleMessage(const QMqttMessage &msg)
+QString MqttSubscriber::schemaComment() const
 {
-    QTextStream(stdout) << "Message received. Topic: " << msg.topic().name() << ", Message: " << msg.payload() << Qt::endl;
-    QSqlDatabase db = QSqlDatabase::database();
-    if (db.isValid() && db.isOpen())
+    QStringList settings {
+        QString::number(schemaVersion),
+        QString::number(m_config.sqlNormalizeTopics()),
+        QString::number(static_cast<int>(m_config.sqlPartitioning())),
+        QString::number(m_config.sqlTimescaleDb()),
+        QString::number(m_config.sqlChunkTime().count()),
+        QString::number(m_config.sqlCompressAfter().count()),
+        QString::number(m_config.sqlMaxStroageTime().count()),
+        QString::number(m_config.sqlClassifyPayloads()),
+        QString::number(m_config.sqlLatest())
+    };
+    for (const Mqtt2SqlConfig::Route & route : m_config.routes())
     {
+        settings << route.table << QString::number(route.storeData) << QString::number(route.compress);
+        for (const Mqtt2SqlConfig::RouteColumn & column : route.columns)
+        {
+            settings << column.name + " " + column.type;
+        }
+    }
+    // The concurrent ones are checked by the IndexBuilder on every start anyway.
+    if (!m_config.sqlConcurrentIndexes())
+    {
+        const QVector<IndexBuilder::Index> indexes = IndexBuilder::indexes(m_config);
+        for (const IndexBuilder::Index & index : indexes)
+        {
+            settings << index.name + " " + index.definition;
+        }
+    }
+    const QByteArray hash = QCryptographicHash::hash(settings.join('\n').toUtf8(), QCryptographicHash::Sha1);
+    return "qmqtt2sql schema " + QString::fromLatin1(hash.toHex().left(16));
+}
+
+/**
+ * @brief Run \p update while holding the schema lock, so several instances do not change the schema at once.
+ */
+void MqttSubscriber::withSchemaLock(void (MqttSubscriber::*update)())
+{
+    QSqlQuery query;
+    if (!query.exec(QString("SELECT pg_advisory_lock(%1);").arg(schemaLockKey)))
+    {
+        logError("Error while locking schema: " + query.lastError().text());
+    }
+    (this->*update)();
+    if (!query.exec(QString("SELECT pg_advisory_unlock(%1);").arg(schemaLockKey)))
+    {
+        logError("Error while unlocking schema: " + query.lastError().text());
+    }
+}
+
+/**
+ * @brief Create the mqtt table and its indexes if they do not exist.
+ *
+ * Once every statement succeeded the mqtt table is commented with schemaComment().
+ */
+void MqttSubscriber::createSchema()
+{
+    m_schemaComplete = true;
+    const QString topicColumn = m_config.sqlNormalizeTopics() ? "topic_id integer" : "topic varchar(255)";
+    if (m_config.sqlNormalizeTopics())
+    {
+        QSqlQuery query;
+        if (!query.exec("CREATE TABLE IF NOT EXISTS topics (id serial PRIMARY KEY, name varchar(255) NOT NULL UNIQUE);"))
+        {
+            m_schemaComplete = false;
+            logError("Error while creating topics table: " + query.lastError().text());
+        }
+    }
+
+    if (m_config.sqlPartitioning() != Mqtt2SqlConfig::Partitioning::None)
+    {
+        QSqlQuery query;
+        if (!query.exec("CREATE TABLE IF NOT EXISTS mqtt (ts timestamp with time zone NOT NULL, " + topicColumn + ", data jsonb) PARTITION BY RANGE (ts);"))
+        {
+            m_schemaComplete = false;
+            logError("Error while creating mqtt table: " + query.lastError().text());
+        }
+        // Catches rows outside of the created partitions, e.g. old spooled messages.
+        if (!query.exec("CREATE TABLE IF NOT EXISTS mqtt_default PARTITION OF mqtt DEFAULT;"))
+        {
+            m_schemaComplete = false;
+            logError("Error while creating default partition: " + query.lastError().text());
+        }
+        maintainPartitions();
+    }
+    else if (m_config.sqlTimescaleDb())
+    {
+        createHypertable();
+    }
+    else
+    {
+        QSqlQuery query("CREATE TABLE IF NOT EXISTS mqtt (ts timestamp with time zone, " + topicColumn + ", data jsonb);");
+        if (!query.exec())
+        {
+            m_schemaComplete = false;
+            logError("Error while creating mqtt table: " + query.lastError().text());
+        }
+    }
+
+    if (m_config.sqlClassifyPayloads())
+    {
+        addPayloadColumns("mqtt");
+    }
+
+    if (m_config.sqlLatest())
+    {
+        createLatestTable();
+    }
+
+    if (m_config.sqlNormalizeTopics())
+    {
+        const QString payloadColumns = m_config.sqlClassifyPayloads() ? ", m.value, m.raw" : "";
         QSqlQuery query;
-        if (query.prepare("INSERT INTO mqtt (ts, topic, data) VALUES (:ts, :topic, :data);"))
+        // Provides the old table layout for queries.
+        if (!query.exec("CREATE OR REPLACE VIEW mqtt_named AS SELECT m.ts, t.name AS topic, m.data" + payloadColumns
+                        + " FROM mqtt m JOIN topics t ON t.id = m.topic_id;"))
         {
-            query.bindValue(":ts", QDateTime::currentDateTime());
-            query.bindValue(":topic", msg.topic().name());
-            query.bindValue(":data", QString::fromUtf8(msg.payload()));
-            if (!query.exec())
+            m_schemaComplete = false;
+            logError("Error while creating mqtt_named view: " + query.lastError().text());
+        }
+        loadTopics();
+    }
+
+    createRouteTables();
+
+    // Built later by the IndexBuilder thread.
+    if (!m_config.sqlConcurrentIndexes())
+    {
+        const QVector<IndexBuilder::Index> indexes = IndexBuilder::indexes(m_config);
+        for (const IndexBuilder::Index & index : indexes)
+        {
+            if (!IndexBuilder::create(QSqlDatabase::database(), index, false))
             {
-                QTextStream(stderr) << "SQL error: can not execute statement: " << query.lastError().text() << Qt::endl;
+                m_schemaComplete = false;
             }
         }
-        else
+    }
+
+    // Read by isSchemaCurrent on the next start, an incomplete schema is created again.
+    if (m_schemaComplete)
+    {
+        QSqlQuery query;
+        if (!query.exec("COMMENT ON TABLE mqtt IS '" + schemaComment() + "';"))
         {
-            QTextStream(stderr) << "SQL error: can not prepare statement: " << query.lastError().text() << Qt::endl;
+            logError("Error while setting schema version: " + query.lastError().text());
         }
     }
-    else
+}
+
+/**
+ * @brief Create the tables of all routes, with their typed columns.
+ *
+ * Route tables are plain tables, their retention is done by the \ref RetentionCleaner.
+ */
+void MqttSubscriber::createRouteTables()
+{
+    const QString topicColumn = m_config.sqlNormalizeTopics() ? "topic_id integer" : "topic varchar(255)";
+    QSqlQuery query;
+    for (const Mqtt2SqlConfig::Route & route : m_config.routes())
+    {
+        QStringList columns {"ts timestamp with time zone", topicColumn};
+        if (route.storeData)
+        {
+            columns << (route.compress ? "data bytea" : "data jsonb");
+        }
+        for (const Mqtt2SqlConfig::RouteColumn & column : route.columns)
+        {
+            columns << column.name + " " + column.type;
+        }
+        if (!query.exec("CREATE TABLE IF NOT EXISTS " + route.table + " (" + columns.join(", ") + ");"))
+        {
+            m_schemaComplete = false;
+            logError("Error while creating table " + route.table + ": " + query.lastError().text());
+        }
+        if (route.storeData && !route.compress && m_config.sqlClassifyPayloads())
+        {
+            addPayloadColumns(route.table);
+        }
+    }
+}
+
+/**
+ * @brief Create the tables and indexes of routes added by a reload, existing ones are kept.
+ */
+void MqttSubscriber::addRoutes()
+{
+    createRouteTables();
+    const QVector<IndexBuilder::Index> indexes = IndexBuilder::indexes(m_config);
+    for (const IndexBuilder::Index & index : indexes)
     {
-        QTextStream(stderr) << "SQL error: Database not open!" << Qt::endl;
+        if (index.table != "mqtt")
+        {
+            IndexBuilder::create(QSqlDatabase::database(), index, m_config.sqlConcurrentIndexes());
+        }
     }
 }
 
 /**
- * @brief Delete all outdated SQL entires
+ * @brief Create the mqtt_latest table holding the newest message of every topic, written by the \ref SqlWriter.
  */
-void MqttSubscriber::cleanup()
+void MqttSubscriber::createLatestTable()
 {
-    QTextStream(stdout) << "Cleaning up SQL database." << Qt::endl;
-    QSqlDatabase db = QSqlDatabase::database();
-    if (db.isValid() && db.isOpen())
+    const QString topicColumn = m_config.sqlNormalizeTopics() ? "topic_id integer PRIMARY KEY" : "topic varchar(255) PRIMARY KEY";
+    QSqlQuery query;
+    if (!query.exec("CREATE TABLE IF NOT EXISTS mqtt_latest (" + topicColumn + ", ts timestamp with time zone NOT NULL, data jsonb);"))
     {
-        QSqlQuery query;
-        if (query.prepare("DELETE FROM mqtt WHERE ts < :ts;"))
+        m_schemaComplete = false;
+        logError("Error while creating mqtt_latest table: " + query.lastError().text());
+    }
+    if (m_config.sqlClassifyPayloads())
+    {
+        addPayloadColumns("mqtt_latest");
+    }
+    if (m_config.sqlNormalizeTopics())
+    {
+        const QString payloadColumns = m_config.sqlClassifyPayloads() ? ", m.value, m.raw" : "";
+        if (!query.exec("CREATE OR REPLACE VIEW mqtt_latest_named AS SELECT t.name AS topic, m.ts, m.data" + payloadColumns
+                        + " FROM mqtt_latest m JOIN topics t ON t.id = m.topic_id;"))
         {
-            query.bindValue(":ts", QDateTime::currentDateTime().addSecs(m_config.sqlMaxStroageTime().count()*60*60*-1));
-            if (!query.exec())
+            m_schemaComplete = false;
+            logError("Error while creating mqtt_latest_named view: " + query.lastError().text());
+        }
+    }
+}
+
+/**
+ * @brief Add the columns of classified payloads to \p table, if they do not exist yet.
+ *
+ * Numeric payloads are stored in value, payloads which are no JSON in raw.
+ */
+void MqttSubscriber::addPayloadColumns(const QString & table)
+{
+    QSqlQuery query;
+    if (!query.exec("ALTER TABLE " + table + " ADD COLUMN IF NOT EXISTS value double precision, ADD COLUMN IF NOT EXISTS raw bytea;"))
+    {
+        m_schemaComplete = false;
+        logError("Error while adding payload columns to " + table + ": " + query.lastError().text());
+    }
+}
+
+/**
+ * @brief Fill the topic dictionary with all known topics.
+ */
+void MqttSubscriber::loadTopics()
+{
+    QSqlQuery query;
+    query.setForwardOnly(true);
+    if (!query.exec("SELECT id, name FROM topics;"))
+    {
+        logError("Error while reading topics: " + query.lastError().text());
+        return;
+    }
+    while (query.next())
+    {
+        m_topics->insert(query.value(1).toString(), query.value(0).toInt());
+    }
+}
+
+/**
+ * @brief Create the upcoming partitions of the mqtt table and drop all expired ones.
+ *
+ * PostgreSQL can not create a partition for rows already stored in the default partition,
+ * e.g. after the maintenance did not run for longer than the partitions created ahead. A
+ * missing partition is therefore created as a plain table, the rows of its range are moved
+ * out of mqtt_default and then it is attached, all in one transaction.
+ * A partition is dropped once all of its rows are older than sqlMaxStroageTime(), so
+ * retention costs one DROP TABLE per partition instead of deleting every row.
+ */
+void MqttSubscriber::maintainPartitions()
+{
+    const Mqtt2SqlConfig::Partitioning partitioning = m_config.sqlPartitioning();
+    const qint64 length = std::chrono::duration_cast<std::chrono::seconds>(partitionLength(partitioning)).count();
+    const QDateTime now = QDateTime::currentDateTimeUtc();
+
+    QSqlQuery query;
+    QDateTime start = partitionStart(now, partitioning);
+    for (int i = 0; i <= m_config.sqlPartitionsAhead(); ++i)
+    {
+        const QDateTime end = start.addSecs(length);
+        const QString name = partitionName(start, partitioning);
+        const QString from = start.toString(Qt::ISODate);
+        const QString to = end.toString(Qt::ISODate);
+        start = end;
+        if (!query.exec(QString("SELECT to_regclass('%1') IS NOT NULL;").arg(name)) || !query.next())
+        {
+            logError("Error while creating partition: " + query.lastError().text());
+            continue;
+        }
+        if (query.value(0).toBool())
+        {
+            continue;
+        }
+        const QStringList statements = {
+            "BEGIN;",
+            QString("CREATE TABLE %1 (LIKE mqtt INCLUDING DEFAULTS INCLUDING CONSTRAINTS);").arg(name),
+            QString("WITH moved AS (DELETE FROM mqtt_default WHERE ts >= '%2' AND ts < '%3' RETURNING *) "
+                    "INSERT INTO %1 SELECT * FROM moved;").arg(name, from, to),
+            QString("ALTER TABLE mqtt ATTACH PARTITION %1 FOR VALUES FROM ('%2') TO ('%3');").arg(name, from, to),
+            "COMMIT;"
+        };
+        for (const QString & statement : statements)
+        {
+            if (!query.exec(statement))
             {
-                QTextStream(stderr) << "SQL error: can not execute statement: " << query.lastError().text() << Qt::endl;
+                logError("Error while creating partition: " + query.lastError().text());
+                query.exec("ROLLBACK;");
+                break;
             }
         }
-        else
+    }
+
+    const QDateTime cutoff = now.addSecs(m_config.sqlMaxStroageTime().count()*60*60*-1);
+    if (!query.exec("SELECT c.relname FROM pg_inherits i JOIN pg_class c ON c.oid = i.inhrelid "
+                    "JOIN pg_class p ON p.oid = i.inhparent WHERE p.relname = 'mqtt' AND c.relname LIKE 'mqtt\\_p%';"))
+    {
+        logError("Error while listing partitions: " + query.lastError().text());
+        return;
+    }
+    QStringList expired;
+    while (query.next())
+    {
+        const QString name = query.value(0).toString();
+        const QString suffix = name.mid(6);
+        // The partition length is derived from the name, so partitions of a previous setting are dropped as well.
+        const bool hourly = suffix.size() == 10;
+        QDateTime partitionBegin = QDateTime::fromString(suffix, hourly ? "yyyyMMddHH" : "yyyyMMdd");
+        if (!partitionBegin.isValid())
         {
-            QTextStream(stderr) << "SQL error: can not prepare statement: " << query.lastError().text() << Qt::endl;
+            continue;
+        }
+        partitionBegin.setTimeSpec(Qt::UTC);
+        if (partitionBegin.addSecs(hourly ? 60*60 : 24*60*60) <= cutoff)
+        {
+            expired << name;
         }
     }
-    else
+    for (const QString & name : std::as_const(expired))
+    {
+        logInfo("Dropping expired partition " + name);
+        if (!query.exec("DROP TABLE IF EXISTS " + name + ";"))
+        {
+            logError("Error while dropping partition: " + query.lastError().text());
+        }
+    }
+}
+
+/**
+ * @brief Create the mqtt table as TimescaleDB hypertable with compression and retention policies.
+ *
+ * An existing plain mqtt table is converted, its rows are migrated into chunks. Chunks older
+ * than sqlCompressAfter() are compressed segmented by topic, chunks older than
+ * sqlMaxStroageTime() are dropped by the TimescaleDB retention policy.
+ */
+void MqttSubscriber::createHypertable()
+{
+    QSqlQuery query;
+    const auto execute = [this, &query](const QString & statement, const char * what) {
+        if (!query.exec(statement))
+        {
+            m_schemaComplete = false;
+            logError(QString("Error while %1: %2").arg(QLatin1String(what), query.lastError().text()));
+            return false;
+        }
+        return true;
+    };
+
+    execute("CREATE EXTENSION IF NOT EXISTS timescaledb;", "creating timescaledb extension");
+    const QString topicColumn = m_config.sqlNormalizeTopics() ? "topic_id integer" : "topic varchar(255)";
+    execute("CREATE TABLE IF NOT EXISTS mqtt (ts timestamp with time zone NOT NULL, " + topicColumn + ", data jsonb);", "creating mqtt table");
+    execute(QString("SELECT create_hypertable('mqtt', 'ts', chunk_time_interval => INTERVAL '%1 hours', "
+                    "if_not_exists => TRUE, migrate_data => TRUE);").arg(m_config.sqlChunkTime().count()),
+            "creating hypertable");
+
+    if (m_config.sqlCompressAfter().count() > 0)
+    {
+        // The compression settings can not be changed once chunks are compressed, so they are only set once.
+        if (execute("SELECT compression_enabled FROM timescaledb_information.hypertables WHERE hypertable_name = 'mqtt';",
+                    "reading compression state") && query.next() && !query.value(0).toBool())
+        {
+            execute("ALTER TABLE mqtt SET (timescaledb.compress, timescaledb.compress_segmentby = '" + m_config.sqlTopicColumn() + "', "
+                    "timescaledb.compress_orderby = 'ts DESC');", "enabling compression");
+        }
+        execute("SELECT remove_compression_policy('mqtt', if_exists => TRUE);", "removing compression policy");
+        execute(QString("SELECT add_compression_policy('mqtt', INTERVAL '%1 hours');").arg(m_config.sqlCompressAfter().count()),
+                "adding compression policy");
+    }
+
+    // Replaced on every start, so changes of maxstoragehours are applied.
+    execute("SELECT remove_retention_policy('mqtt', if_exists => TRUE);", "removing retention policy");
+    execute(QString("SELECT add_retention_policy('mqtt', INTERVAL '%1 hours');").arg(m_config.sqlMaxStroageTime().count()),
+            "adding retention policy");
+}
+
+
+/**
+ * @brief Delete all outdated SQL entires
+ *
+ * With partitioning the partitions are maintained by \ref maintainPartitions first. The rows
+ * are deleted by the \ref RetentionCleaner in its own thread. Only one instance using the
+ * database cleans up at a time, the others skip the cleanup while the advisory lock is held.
+ */
+void MqttSubscriber::cleanup()
+{
+    if (m_config.sqlPartitioning() != Mqtt2SqlConfig::Partitioning::None)
     {
-        QTextStream(stderr) << "SQL error: Database not open!" << Qt::endl;
+        QSqlDatabase db = QSqlDatabase::database(QLatin1String(QSqlDatabase::defaultConnection), false);
+        QSqlQuery probe(db);
+        // QPSQL still reports a connection as open after the server restarted.
+        const bool alive = db.isOpen() && probe.exec("SELECT 1;");
+        if (!alive)
+        {
+            db.close();
+        }
+        if (!db.isValid() || !(alive || openDatabase()))
+        {
+            logError("SQL error: Database not open!");
+            return;
+        }
+        QSqlQuery lock;
+        if (!lock.exec(QString("SELECT pg_try_advisory_lock(%1);").arg(RetentionCleaner::lockKey)) || !lock.next())
+        {
+            logError("SQL error: can not execute statement: " + lock.lastError().text());
+            return;
+        }
+        if (!lock.value(0).toBool())
+        {
+            logInfo("Partition maintenance skipped, a cleanup is still running.");
+            return;
+        }
+        maintainPartitions();
+        if (!lock.exec(QString("SELECT pg_advisory_unlock(%1);").arg(RetentionCleaner::lockKey)))
+        {
+            logError("SQL error: can not execute statement: " + lock.lastError().text());
+        }
     }
+    // Released above, the cleaner takes the lock on its own connection.
+    QMetaObject::invokeMethod(m_cleaner, &RetentionCleaner::cleanup, Qt::QueuedConnection);
 }
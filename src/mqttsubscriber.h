@@ -21,34 +21,91 @@
 #define MQTTSUBSCRIBER_H
 
 #include <QObject>
+#include <QThread>
 #include <QTimer>
-#include <QMqttClient>
-#include <QMqttSubscription>
-#include <QMqttMessage>
+#include <QVector>
 
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include "exponentialbackoff.h"
+#include "indexbuilder.h"
+#include "messagerouter.h"
+#include "messagespool.h"
+#include "metrics.h"
+#include "metricsserver.h"
 #include "mqtt2sqlconfig.h"
+#include "mqttconnection.h"
+#include "mqttrecord.h"
+#include "retentioncleaner.h"
+#include "sqlwriter.h"
+#include "topicdictionary.h"
+#include "topicmatcher.h"
 
 class MqttSubscriber : public QObject
 {
     Q_OBJECT
 public:
     explicit MqttSubscriber(const Mqtt2SqlConfig &config, QObject *parent = nullptr);
+    ~MqttSubscriber() override;
+
+    void reload(const Mqtt2SqlConfig & config);
 
 signals:
     /// Is emitted when an error occurs.
     void errorOccured(const QString & error, int exitcode);
 
 private slots:
-    void subscribe();
-    void onConnectionError(QMqttClient::ClientError error);
-    void handleMessage(const QMqttMessage &msg);
     void cleanup();
+    void releaseRouters();
 
 private:
-    QMqttClient m_client;
-    QMqttSubscription *m_subscription;
+    void startConnections();
+    void prepareSchema();
+    void startIndexBuilder();
+    void startCleaner();
+    void redistributeTopics();
+    bool openDatabase();
+    bool isSchemaCurrent();
+    QString schemaComment() const;
+    void withSchemaLock(void (MqttSubscriber::*update)());
+    void createSchema();
+    void maintainPartitions();
+    void createHypertable();
+    void loadTopics();
+    void createRouteTables();
+    void addRoutes();
+    void addPayloadColumns(const QString & table);
+    void createLatestTable();
+
+    TopicMatcher m_excludes;
     QTimer m_cleanupTimer;
     Mqtt2SqlConfig m_config;
+    RecordQueue m_queue;
+    Metrics m_metrics;
+    std::unique_ptr<MetricsServer> m_metricsServer;
+    std::unique_ptr<MessageSpool> m_spool;
+    std::unique_ptr<TopicDictionary> m_topics;
+    std::unique_ptr<MessageRouter> m_router;
+    /// Routers replaced by a reload, the writers and connections may still use them until they take over the new one.
+    std::vector<std::unique_ptr<MessageRouter>> m_retiredRouters;
+    /// Reloads queued to the connections which they have not taken over yet.
+    int m_connectionReloads = 0;
+    QTimer m_routerTimer;
+    QVector<SqlWriter *> m_writers;
+    QVector<MqttConnection *> m_connections;
+    QVector<QThread *> m_connectionThreads;
+    /// Topic filters subscribed by every connection.
+    QVector<QStringList> m_connectionFilters;
+    RetentionCleaner * m_cleaner = nullptr;
+    QThread * m_cleanerThread = nullptr;
+    IndexBuilder * m_indexBuilder = nullptr;
+    /// Cleared by every failed statement of createSchema, the schema comment is only set if it stays true.
+    bool m_schemaComplete = false;
+    /// Set once the schema is created, the writers do not write before.
+    std::atomic<bool> m_schemaReady{false};
+    ExponentialBackoff m_schemaBackoff;
 
 };
 
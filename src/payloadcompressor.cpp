@@ -0,0 +1,69 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "payloadcompressor.h"
+
+#include <zstd.h>
+
+PayloadCompressor::PayloadCompressor(const QVector<Mqtt2SqlConfig::Route> & routes)
+    : m_context(ZSTD_createCCtx())
+{
+    m_dictionaries.reserve(routes.size());
+    m_levels.reserve(routes.size());
+    for (const Mqtt2SqlConfig::Route & route : routes)
+    {
+        ZSTD_CDict * dictionary = nullptr;
+        if (route.compress && !route.dictionary.isEmpty())
+        {
+            dictionary = ZSTD_createCDict(route.dictionary.constData(), route.dictionary.size(), route.compressionLevel);
+        }
+        m_dictionaries.push_back(dictionary);
+        m_levels.push_back(route.compressionLevel);
+    }
+}
+
+PayloadCompressor::~PayloadCompressor()
+{
+    for (ZSTD_CDict * dictionary : m_dictionaries)
+    {
+        ZSTD_freeCDict(dictionary);
+    }
+    ZSTD_freeCCtx(m_context);
+}
+
+/**
+ * @brief Compress \p payload of a message of \p route into \p compressed.
+ *
+ * Returns false and sets \ref lastError if zstd fails, e.g. for an invalid dictionary.
+ */
+bool PayloadCompressor::compress(int route, const QByteArray & payload, QByteArray & compressed)
+{
+    compressed.resize(static_cast<int>(ZSTD_compressBound(payload.size())));
+    ZSTD_CDict * dictionary = m_dictionaries.at(route);
+    const std::size_t size = dictionary
+            ? ZSTD_compress_usingCDict(m_context, compressed.data(), compressed.size(), payload.constData(), payload.size(), dictionary)
+            : ZSTD_compressCCtx(m_context, compressed.data(), compressed.size(), payload.constData(), payload.size(), m_levels.at(route));
+    if (ZSTD_isError(size))
+    {
+        m_lastError = QString::fromUtf8(ZSTD_getErrorName(size));
+        return false;
+    }
+    compressed.resize(static_cast<int>(size));
+    return true;
+}
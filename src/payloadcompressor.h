@@ -0,0 +1,60 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef PAYLOADCOMPRESSOR_H
+#define PAYLOADCOMPRESSOR_H
+
+#include <QByteArray>
+#include <QString>
+#include <QVector>
+
+#include <vector>
+
+#include "mqtt2sqlconfig.h"
+
+struct ZSTD_CCtx_s;
+struct ZSTD_CDict_s;
+
+/**
+ * @brief Compresses the payloads of routes with compression zstd, with the dictionary of the route if configured.
+ *
+ * The dictionaries are digested once on construction. Every frame contains the content size and the id
+ * of its dictionary, so it can be decompressed with `zstd -D` or any zstd binding. Not thread safe,
+ * every \ref PostgresSink uses its own compressor.
+ */
+class PayloadCompressor
+{
+public:
+    explicit PayloadCompressor(const QVector<Mqtt2SqlConfig::Route> & routes);
+    ~PayloadCompressor();
+    PayloadCompressor(const PayloadCompressor &) = delete;
+    PayloadCompressor & operator=(const PayloadCompressor &) = delete;
+
+    bool compress(int route, const QByteArray & payload, QByteArray & compressed);
+    const QString & lastError() const { return m_lastError; }
+
+private:
+    ZSTD_CCtx_s * m_context;
+    /// Digested dictionary of every route, nullptr without dictionary or compression.
+    std::vector<ZSTD_CDict_s *> m_dictionaries;
+    std::vector<int> m_levels;
+    QString m_lastError;
+};
+
+#endif // PAYLOADCOMPRESSOR_H
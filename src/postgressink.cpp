@@ -0,0 +1,575 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "postgressink.h"
+
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QStringList>
+
+#include <algorithm>
+
+#include "logger.h"
+#include "messagerouter.h"
+
+#ifdef QMQTT2SQL_HAVE_LIBPQ
+#include "pqcopywriter.h"
+#endif
+#ifdef QMQTT2SQL_HAVE_ZSTD
+#include "payloadcompressor.h"
+#endif
+
+/// PostgreSQL limits a statement to 65535 parameters.
+static constexpr int maxStatementParameters = 65535;
+
+/**
+ * Build a multi-row INSERT statement into \p table for \p rows messages with positional placeholders,
+ * followed by the optional \p conflict clause.
+ */
+QString batchInsertStatement(int rows, const QString & table, const QStringList & columns, const QString & conflict = QString())
+{
+    QStringList placeholders;
+    for (int i = 0; i < columns.size(); ++i)
+    {
+        placeholders << QStringLiteral("?");
+    }
+    const QString row = "(" + placeholders.join(", ") + ")";
+    QStringList values;
+    values.reserve(rows);
+    for (int i = 0; i < rows; ++i)
+    {
+        values << row;
+    }
+    return "INSERT INTO " + table + " (" + columns.join(", ") + ") VALUES " + values.join(", ")
+            + (conflict.isEmpty() ? QString() : " " + conflict) + ";";
+}
+
+PostgresSink::PostgresSink(const Mqtt2SqlConfig & config, TopicDictionary * topics, const MessageRouter * router,
+                           MetricsShard * metrics, int index)
+    : m_config(config)
+    , m_topics(topics)
+    , m_router(router)
+    , m_metrics(metrics)
+    , m_connectionName(QString("qmqtt2sql-writer-%1").arg(index))
+    , m_batchSize(config.sqlBatchSize())
+{
+#ifdef QMQTT2SQL_HAVE_ZSTD
+    const QVector<Mqtt2SqlConfig::Route> & routes = config.routes();
+    if (std::any_of(routes.cbegin(), routes.cend(), [](const Mqtt2SqlConfig::Route & route) { return route.compress; }))
+    {
+        m_compressor = std::make_unique<PayloadCompressor>(routes);
+    }
+#endif
+}
+
+PostgresSink::~PostgresSink()
+{
+    close();
+}
+
+/**
+ * @brief Open the connection of this writer, either a QPSQL connection or a libpq COPY connection.
+ */
+bool PostgresSink::open()
+{
+#ifdef QMQTT2SQL_HAVE_LIBPQ
+    if (m_config.sqlIngestMode() == Mqtt2SqlConfig::IngestMode::Copy)
+    {
+        m_copyWriter = std::make_unique<PqCopyWriter>(m_config);
+        if (!m_copyWriter->open())
+        {
+            logError("Error: Faild to open COPY connection: " + m_copyWriter->lastError());
+            return false;
+        }
+        // Only used inside the transaction of a batch, see writeLatest.
+        if (m_config.sqlLatest()
+                && !m_copyWriter->execute("CREATE TEMP TABLE IF NOT EXISTS mqtt_latest_load (LIKE mqtt_latest) ON COMMIT DELETE ROWS;"))
+        {
+            logError("Error: Faild to create mqtt_latest_load table: " + m_copyWriter->lastError());
+            return false;
+        }
+        return true;
+    }
+#endif
+
+    QSqlDatabase db = QSqlDatabase::addDatabase("QPSQL", m_connectionName);
+    db.setHostName(m_config.sqlHostname());
+    db.setDatabaseName(m_config.sqlDatabase());
+    db.setPort(m_config.sqlPort());
+    db.setUserName(m_config.sqlUsername());
+    db.setPassword(m_config.sqlPassword());
+    if (!db.open())
+    {
+        logError("Error: Faild to open database: " + db.lastError().text());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Check whether the connection still works after a failed write.
+ */
+bool PostgresSink::isAlive()
+{
+#ifdef QMQTT2SQL_HAVE_LIBPQ
+    if (m_copyWriter)
+    {
+        return m_copyWriter->isOpen();
+    }
+#endif
+    QSqlDatabase db = QSqlDatabase::database(m_connectionName, false);
+    QSqlQuery probe(db);
+    return db.isOpen() && probe.exec("SELECT 1;");
+}
+
+bool PostgresSink::isOpen() const
+{
+#ifdef QMQTT2SQL_HAVE_LIBPQ
+    if (m_copyWriter)
+    {
+        return m_copyWriter->isOpen();
+    }
+#endif
+    QSqlDatabase db = QSqlDatabase::database(m_connectionName, false);
+    return db.isValid() && db.isOpen();
+}
+
+void PostgresSink::close()
+{
+#ifdef QMQTT2SQL_HAVE_LIBPQ
+    m_copyWriter.reset();
+#endif
+    m_batchQuery.reset();
+    if (QSqlDatabase::contains(m_connectionName))
+    {
+        QSqlDatabase::database(m_connectionName, false).close();
+        QSqlDatabase::removeDatabase(m_connectionName);
+    }
+}
+
+/**
+ * @brief Write \p batch, either with COPY or with \ref insertBatch.
+ *
+ * With normalized topics the topic ids are resolved first. With routes the batch is split by route
+ * and every table is written with its own statement, all in one transaction. The mqtt_latest table
+ * is updated by \ref writeLatest in the same transaction. A single table is written in a
+ * transaction too if \ref insertBatch needs more than one statement for it.
+ */
+bool PostgresSink::write(QVector<MqttRecord> & batch)
+{
+    if (m_topics && !resolveTopics(batch))
+    {
+        return false;
+    }
+    const bool routed = m_router && !m_router->isEmpty();
+    if (!routed && !m_config.sqlLatest())
+    {
+        return writeRecords(batch, -1);
+    }
+
+    if (routed)
+    {
+        if (m_routeBatches.size() != m_router->size() + 1)
+        {
+            m_routeBatches.resize(m_router->size() + 1);
+            for (QVector<MqttRecord> & records : m_routeBatches)
+            {
+                records.reserve(m_batchSize);
+            }
+        }
+        for (const MqttRecord & record : std::as_const(batch))
+        {
+            m_routeBatches[record.route + 1].append(record);
+        }
+    }
+    const auto tables = (routed ? std::count_if(m_routeBatches.cbegin(), m_routeBatches.cend(),
+                                                [](const QVector<MqttRecord> & records) { return !records.isEmpty(); }) : 1)
+            + (m_config.sqlLatest() ? 1 : 0);
+
+    // A table split into several INSERT statements needs the transaction as well.
+    int single = -1;
+    if (routed && tables == 1)
+    {
+        single = static_cast<int>(std::find_if(m_routeBatches.cbegin(), m_routeBatches.cend(),
+                                               [](const QVector<MqttRecord> & records) { return !records.isEmpty(); })
+                                  - m_routeBatches.cbegin()) - 1;
+    }
+    const bool transaction = tables > 1 || (tables == 1 && !usesCopy() && batch.size() > maxInsertRows(single));
+
+    bool ok = !transaction || execute("BEGIN;");
+    if (!routed)
+    {
+        ok = ok && writeRecords(batch, -1);
+    }
+    for (int i = 0; ok && i < m_routeBatches.size(); ++i)
+    {
+        if (!m_routeBatches.at(i).isEmpty())
+        {
+            ok = writeRecords(m_routeBatches.at(i), i - 1);
+        }
+    }
+    if (ok && m_config.sqlLatest())
+    {
+        ok = writeLatest(batch);
+    }
+    if (transaction)
+    {
+        if (ok)
+        {
+            ok = execute("COMMIT;");
+        }
+        else
+        {
+            execute("ROLLBACK;");
+        }
+    }
+    for (QVector<MqttRecord> & records : m_routeBatches)
+    {
+        records.clear();
+    }
+    return ok;
+}
+
+/**
+ * @brief Prepare the statement for full batches of \p batchSize rows on the next full batch.
+ */
+void PostgresSink::setBatchSize(int batchSize)
+{
+    if (batchSize != m_batchSize)
+    {
+        m_batchSize = batchSize;
+        m_batchQuery.reset();
+    }
+}
+
+/**
+ * @brief Upsert the newest message of every topic in \p batch into the mqtt_latest table.
+ *
+ * Only records whose payload was checked by the writer are upserted, records of routes
+ * without data column and, without classified payloads, non-JSON payloads of compressed
+ * routes are skipped. Only one row per topic is sent, and only rows newer than the stored one replace it, so old
+ * spooled messages do not overwrite newer values. COPY loads the rows into a temporary table
+ * first, since COPY can not upsert.
+ */
+bool PostgresSink::writeLatest(const QVector<MqttRecord> & batch)
+{
+    m_latestBatch.clear();
+    m_latestIndex.clear();
+    for (const MqttRecord & record : batch)
+    {
+        // Payloads of routes without data column, like the windows of the aggregate route, are not checked.
+        if (record.route >= 0 && !m_router->at(record.route).storeData)
+        {
+            continue;
+        }
+        // Without classified payloads mqtt_latest stores jsonb, which other payloads of compressed routes are not.
+        if (!m_config.sqlClassifyPayloads() && record.payloadType != PayloadType::Json)
+        {
+            continue;
+        }
+        const auto it = m_latestIndex.constFind(record.topic);
+        if (it == m_latestIndex.cend())
+        {
+            m_latestIndex.insert(record.topic, m_latestBatch.size());
+            m_latestBatch.append(record);
+        }
+        else if (m_latestBatch.at(*it).ts <= record.ts)
+        {
+            m_latestBatch[*it] = record;
+        }
+    }
+
+    if (m_latestBatch.isEmpty())
+    {
+        return true;
+    }
+
+    const QStringList columns = MessageRouter::columnNames(nullptr, m_config);
+    QStringList updates;
+    for (const QString & column : columns)
+    {
+        if (column != m_config.sqlTopicColumn())
+        {
+            updates << column + " = EXCLUDED." + column;
+        }
+    }
+    const QString conflict = QString("ON CONFLICT (%1) DO UPDATE SET %2 WHERE mqtt_latest.ts <= EXCLUDED.ts")
+            .arg(m_config.sqlTopicColumn(), updates.join(", "));
+
+#ifdef QMQTT2SQL_HAVE_LIBPQ
+    if (m_copyWriter)
+    {
+        Mqtt2SqlConfig::Route load;
+        load.table = "mqtt_latest_load";
+        if (!m_copyWriter->write(m_latestBatch, &load))
+        {
+            Logger::instance().logLimited(LogLevel::Error, "sql-copy", "SQL error: can not copy batch: " + m_copyWriter->lastError());
+            return false;
+        }
+        const QByteArray statement = QString("INSERT INTO mqtt_latest (%1) SELECT %1 FROM mqtt_latest_load %2;")
+                .arg(columns.join(", "), conflict).toUtf8();
+        return execute(statement.constData());
+    }
+#endif
+
+    QSqlDatabase db = QSqlDatabase::database(m_connectionName, false);
+    const int maxRows = maxStatementParameters / columns.size();
+    for (int start = 0; start < m_latestBatch.size(); start += maxRows)
+    {
+        const int rows = qMin(maxRows, m_latestBatch.size() - start);
+        QSqlQuery query(db);
+        if (!query.prepare(batchInsertStatement(rows, "mqtt_latest", columns, conflict)))
+        {
+            Logger::instance().logLimited(LogLevel::Error, "sql-prepare", "SQL error: can not prepare statement: " + query.lastError().text());
+            return false;
+        }
+        m_insertValues.clear();
+        for (int i = start; i < start + rows; ++i)
+        {
+            appendInsertValues(m_insertValues, m_latestBatch.at(i), nullptr, m_config);
+        }
+        for (int pos = 0; pos < m_insertValues.size(); ++pos)
+        {
+            query.bindValue(pos, m_insertValues.at(pos));
+        }
+        if (!query.exec())
+        {
+            Logger::instance().logLimited(LogLevel::Error, "sql-execute", "SQL error: can not execute statement: " + query.lastError().text());
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Write \p records into the table of \p route, or into the mqtt table if \p route is -1.
+ *
+ * The payloads of compressed routes are compressed into a copy of \p records, so a batch
+ * spooled or written again after a failure is not compressed twice.
+ */
+bool PostgresSink::writeRecords(const QVector<MqttRecord> & records, int route)
+{
+#ifdef QMQTT2SQL_HAVE_ZSTD
+    if (route >= 0 && m_router->at(route).compress)
+    {
+        m_compressedBatch.clear();
+        qint64 plainBytes = 0;
+        qint64 compressedBytes = 0;
+        for (const MqttRecord & record : records)
+        {
+            m_compressedBatch.append(record);
+            MqttRecord & compressed = m_compressedBatch.last();
+            compressed.payload = QByteArray();
+            if (!m_compressor->compress(route, record.payload, compressed.payload))
+            {
+                Logger::instance().logLimited(LogLevel::Error, "compress", "Error: can not compress payload: " + m_compressor->lastError());
+                return false;
+            }
+            plainBytes += record.payload.size();
+            compressedBytes += compressed.payload.size();
+        }
+        m_metrics->payloadBytes.add(plainBytes);
+        m_metrics->compressedBytes.add(compressedBytes);
+    }
+    const QVector<MqttRecord> & rows = route >= 0 && m_router->at(route).compress ? m_compressedBatch : records;
+#else
+    const QVector<MqttRecord> & rows = records;
+#endif
+
+#ifdef QMQTT2SQL_HAVE_LIBPQ
+    if (m_copyWriter)
+    {
+        if (!m_copyWriter->write(rows, route >= 0 ? &m_router->at(route) : nullptr))
+        {
+            Logger::instance().logLimited(LogLevel::Error, "sql-copy", "SQL error: can not copy batch: " + m_copyWriter->lastError());
+            return false;
+        }
+        return true;
+    }
+#endif
+
+    return insertBatch(rows, route);
+}
+
+/**
+ * @brief Execute a statement without result on the connection of this writer.
+ */
+bool PostgresSink::execute(const char * statement)
+{
+#ifdef QMQTT2SQL_HAVE_LIBPQ
+    if (m_copyWriter)
+    {
+        if (!m_copyWriter->execute(statement))
+        {
+            Logger::instance().logLimited(LogLevel::Error, "sql-execute", "SQL error: can not execute statement: " + m_copyWriter->lastError());
+            return false;
+        }
+        return true;
+    }
+#endif
+
+    QSqlQuery query(QSqlDatabase::database(m_connectionName, false));
+    if (!query.exec(QString::fromLatin1(statement)))
+    {
+        Logger::instance().logLimited(LogLevel::Error, "sql-execute", "SQL error: can not execute statement: " + query.lastError().text());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Set the topic id of all records of \p batch which are not resolved yet.
+ *
+ * Topics missing in the dictionary are looked up in, or added to, the topics table.
+ */
+bool PostgresSink::resolveTopics(QVector<MqttRecord> & batch)
+{
+    for (MqttRecord & record : batch)
+    {
+        if (record.topicId >= 0)
+        {
+            continue;
+        }
+        record.topicId = m_topics->find(record.topic);
+        if (record.topicId >= 0)
+        {
+            continue;
+        }
+
+        int id = -1;
+#ifdef QMQTT2SQL_HAVE_LIBPQ
+        if (m_copyWriter)
+        {
+            if (!m_copyWriter->topicId(record.topic, id))
+            {
+                Logger::instance().logLimited(LogLevel::Error, "sql-topic", "SQL error: can not resolve topic: " + m_copyWriter->lastError());
+                return false;
+            }
+        }
+        else
+#endif
+        {
+            QSqlQuery query(QSqlDatabase::database(m_connectionName, false));
+            query.prepare("INSERT INTO topics (name) VALUES (?) ON CONFLICT (name) DO UPDATE SET name = EXCLUDED.name RETURNING id;");
+            query.bindValue(0, record.topic);
+            if (!query.exec() || !query.next())
+            {
+                Logger::instance().logLimited(LogLevel::Error, "sql-topic", "SQL error: can not resolve topic: " + query.lastError().text());
+                return false;
+            }
+            id = query.value(0).toInt();
+        }
+        m_topics->insert(record.topic, id);
+        record.topicId = id;
+    }
+    return true;
+}
+
+/**
+ * @brief Rows one INSERT statement into the table of \p route, or into the mqtt table if \p route is -1, can hold.
+ */
+int PostgresSink::maxInsertRows(int route) const
+{
+    const QStringList columns = MessageRouter::columnNames(route >= 0 ? &m_router->at(route) : nullptr, m_config);
+    return maxStatementParameters / static_cast<int>(columns.size());
+}
+
+/**
+ * @brief True if the batches are written with COPY instead of INSERT statements.
+ */
+bool PostgresSink::usesCopy() const
+{
+#ifdef QMQTT2SQL_HAVE_LIBPQ
+    return m_copyWriter != nullptr;
+#else
+    return false;
+#endif
+}
+
+/**
+ * @brief Write \p batch with a multi-row INSERT statement into the table of \p route, or into the mqtt table if \p route is -1.
+ *
+ * The statement for a full batch into the mqtt table is prepared once and reused, other
+ * statements are prepared on demand. Batches exceeding the parameter limit of PostgreSQL
+ * are split into several statements, \ref write runs them in one transaction.
+ */
+bool PostgresSink::insertBatch(const QVector<MqttRecord> & batch, int route)
+{
+    QSqlDatabase db = QSqlDatabase::database(m_connectionName, false);
+    if (!db.isValid() || !db.isOpen())
+    {
+        Logger::instance().logLimited(LogLevel::Error, "sql-not-open", "SQL error: Database not open!");
+        return false;
+    }
+
+    const Mqtt2SqlConfig::Route * routeConfig = route >= 0 ? &m_router->at(route) : nullptr;
+    const QString table = routeConfig ? routeConfig->table : QString("mqtt");
+    const QStringList columns = MessageRouter::columnNames(routeConfig, m_config);
+    const int maxRows = maxInsertRows(route);
+
+    for (int start = 0; start < batch.size(); start += maxRows)
+    {
+        const int rows = qMin(maxRows, batch.size() - start);
+        QSqlQuery partialQuery(db);
+        QSqlQuery * query = &partialQuery;
+        bool prepared = true;
+        if (!routeConfig && rows == m_batchSize)
+        {
+            if (!m_batchQuery)
+            {
+                m_batchQuery = std::make_unique<QSqlQuery>(db);
+                if (!m_batchQuery->prepare(batchInsertStatement(rows, table, columns)))
+                {
+                    prepared = false;
+                }
+            }
+            query = m_batchQuery.get();
+        }
+        else
+        {
+            prepared = partialQuery.prepare(batchInsertStatement(rows, table, columns));
+        }
+
+        if (!prepared)
+        {
+            Logger::instance().logLimited(LogLevel::Error, "sql-prepare", "SQL error: can not prepare statement: " + query->lastError().text());
+            if (query == m_batchQuery.get())
+            {
+                m_batchQuery.reset();
+            }
+            return false;
+        }
+
+        m_insertValues.clear();
+        for (int i = start; i < start + rows; ++i)
+        {
+            appendInsertValues(m_insertValues, batch.at(i), routeConfig, m_config);
+        }
+        for (int pos = 0; pos < m_insertValues.size(); ++pos)
+        {
+            query->bindValue(pos, m_insertValues.at(pos));
+        }
+        if (!query->exec())
+        {
+            Logger::instance().logLimited(LogLevel::Error, "sql-execute", "SQL error: can not execute statement: " + query->lastError().text());
+            return false;
+        }
+    }
+    return true;
+}
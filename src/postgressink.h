@@ -0,0 +1,93 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef POSTGRESSINK_H
+#define POSTGRESSINK_H
+
+#include <QHash>
+#include <QSqlQuery>
+#include <QString>
+#include <QVector>
+
+#include <memory>
+
+#include "sink.h"
+
+#ifdef QMQTT2SQL_HAVE_LIBPQ
+class PqCopyWriter;
+#endif
+#ifdef QMQTT2SQL_HAVE_ZSTD
+class PayloadCompressor;
+#endif
+
+/**
+ * @brief Writes batches to PostgreSQL, with multi-row INSERT statements over QPSQL or with COPY over libpq.
+ *
+ * The schema is created by the \ref MqttSubscriber before the writers start.
+ */
+class PostgresSink : public Sink
+{
+public:
+    PostgresSink(const Mqtt2SqlConfig & config, TopicDictionary * topics, const MessageRouter * router,
+                 MetricsShard * metrics, int index);
+    ~PostgresSink() override;
+
+    bool open() override;
+    void close() override;
+    bool isOpen() const override;
+    bool isAlive() override;
+    bool write(QVector<MqttRecord> & batch) override;
+    void setBatchSize(int batchSize) override;
+
+private:
+    bool resolveTopics(QVector<MqttRecord> & batch);
+    bool writeRecords(const QVector<MqttRecord> & records, int route);
+    bool writeLatest(const QVector<MqttRecord> & batch);
+    bool execute(const char * statement);
+    bool insertBatch(const QVector<MqttRecord> & batch, int route);
+    int maxInsertRows(int route) const;
+    bool usesCopy() const;
+
+    Mqtt2SqlConfig m_config;
+    TopicDictionary * m_topics;
+    const MessageRouter * m_router;
+    MetricsShard * m_metrics;
+    QString m_connectionName;
+    /// Rows of a full batch, the statement of \ref m_batchQuery holds as many.
+    int m_batchSize;
+    /// Batches are reused, clearing a QVector keeps its capacity.
+    QVector<QVector<MqttRecord>> m_routeBatches;
+    /// Newest record of every topic of a batch and its index by topic, see \ref writeLatest.
+    QVector<MqttRecord> m_latestBatch;
+    QHash<QString, int> m_latestIndex;
+    std::unique_ptr<QSqlQuery> m_batchQuery;
+    /// Values of the rows of one statement, keeps its capacity between statements.
+    QVector<QVariant> m_insertValues;
+#ifdef QMQTT2SQL_HAVE_LIBPQ
+    std::unique_ptr<PqCopyWriter> m_copyWriter;
+#endif
+#ifdef QMQTT2SQL_HAVE_ZSTD
+    /// Null without compressed routes.
+    std::unique_ptr<PayloadCompressor> m_compressor;
+    /// Copy of a batch with compressed payloads, the batch itself keeps the plain payloads.
+    QVector<MqttRecord> m_compressedBatch;
+#endif
+};
+
+#endif // POSTGRESSINK_H
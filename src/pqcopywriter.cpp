@@ -0,0 +1,467 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "pqcopywriter.h"
+#include "messagerouter.h"
+
+#include <QtEndian>
+
+#include <cstdio>
+#include <cstring>
+
+#include <libpq-fe.h>
+
+namespace {
+
+/// Difference between the Unix epoch and the PostgreSQL epoch (2000-01-01) in milliseconds.
+constexpr qint64 postgresEpochOffsetMSecs = 946684800000LL;
+
+/// Binary COPY signature, followed by the flags field and the header extension length.
+constexpr char binaryCopyHeader[] = "PGCOPY\n\377\r\n\0";
+
+/// Version prefix of the binary jsonb representation.
+constexpr char jsonbVersion = 1;
+
+/// Initial capacity of the COPY buffer, it grows with the batches and is kept afterwards.
+constexpr int initialBufferSize = 1024 * 1024;
+
+/// The topic cache is cleared once it holds more topics.
+constexpr int maxCachedTopics = 65536;
+
+template <typename T>
+void appendBigEndian(QByteArray & buffer, T value)
+{
+    T be = qToBigEndian(value);
+    buffer.append(reinterpret_cast<const char *>(&be), sizeof(T));
+}
+
+/**
+ * Append \p value to \p buffer, escaped for the COPY text format.
+ */
+void appendTextEscaped(QByteArray & buffer, const QByteArray & value)
+{
+    for (char c : value)
+    {
+        switch (c)
+        {
+        case '\\': buffer.append("\\\\", 2); break;
+        case '\t': buffer.append("\\t", 2); break;
+        case '\n': buffer.append("\\n", 2); break;
+        case '\r': buffer.append("\\r", 2); break;
+        default: buffer.append(c); break;
+        }
+    }
+}
+
+/**
+ * Append \p value to \p buffer as bytea in hex format, escaped for the COPY text format.
+ */
+void appendTextHex(QByteArray & buffer, const QByteArray & value)
+{
+    buffer.append("\\\\x", 3);
+    buffer.append(value.toHex());
+}
+
+/**
+ * Append \p msecs since the Unix epoch to \p buffer as UTC timestamp for the COPY text format.
+ *
+ * Formats the date without QDateTime, the civil date conversion follows
+ * http://howardhinnant.github.io/date_algorithms.html#civil_from_days.
+ */
+void appendTextTimestamp(QByteArray & buffer, qint64 msecs)
+{
+    qint64 days = msecs / 86400000;
+    qint64 msecsOfDay = msecs % 86400000;
+    if (msecsOfDay < 0)
+    {
+        msecsOfDay += 86400000;
+        --days;
+    }
+    days += 719468;
+    const qint64 era = (days >= 0 ? days : days - 146096) / 146097;
+    const qint64 dayOfEra = days - era * 146097;
+    const qint64 yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+    const qint64 dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+    const qint64 mp = (5 * dayOfYear + 2) / 153;
+    const int day = static_cast<int>(dayOfYear - (153 * mp + 2) / 5 + 1);
+    const int month = static_cast<int>(mp < 10 ? mp + 3 : mp - 9);
+    const qint64 year = yearOfEra + era * 400 + (month <= 2 ? 1 : 0);
+
+    char text[32];
+    const int length = std::snprintf(text, sizeof(text), "%04lld-%02d-%02d %02d:%02d:%02d.%03d+00",
+                                     static_cast<long long>(year), month, day,
+                                     static_cast<int>(msecsOfDay / 3600000), static_cast<int>(msecsOfDay / 60000 % 60),
+                                     static_cast<int>(msecsOfDay / 1000 % 60), static_cast<int>(msecsOfDay % 1000));
+    buffer.append(text, length);
+}
+
+} // namespace
+
+PqCopyWriter::PqCopyWriter(const Mqtt2SqlConfig & config)
+    : m_config(config)
+{
+    m_buffer.reserve(initialBufferSize);
+}
+
+PqCopyWriter::~PqCopyWriter()
+{
+    close();
+}
+
+/**
+ * @brief Open the libpq connection with the [psql] connection parameters.
+ */
+bool PqCopyWriter::open()
+{
+    close();
+
+    const QByteArray host = m_config.sqlHostname().toUtf8();
+    const QByteArray port = QByteArray::number(m_config.sqlPort());
+    const QByteArray user = m_config.sqlUsername().toUtf8();
+    const QByteArray password = m_config.sqlPassword().toUtf8();
+    const QByteArray dbname = m_config.sqlDatabase().toUtf8();
+    const char * keywords[] = {"host", "port", "user", "password", "dbname", "client_encoding", nullptr};
+    const char * values[] = {host.constData(), port.constData(), user.constData(), password.constData(), dbname.constData(), "UTF8", nullptr};
+
+    m_connection = PQconnectdbParams(keywords, values, 0);
+    if (PQstatus(m_connection) != CONNECTION_OK)
+    {
+        m_lastError = QString::fromUtf8(PQerrorMessage(m_connection)).trimmed();
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool PqCopyWriter::isOpen() const
+{
+    return m_connection != nullptr && PQstatus(m_connection) == CONNECTION_OK;
+}
+
+void PqCopyWriter::close()
+{
+    if (m_connection)
+    {
+        PQfinish(m_connection);
+        m_connection = nullptr;
+    }
+}
+
+/**
+ * @brief Whether the rows of \p route are sent in the binary format, routes with typed columns always use the text format.
+ */
+bool PqCopyWriter::isBinary(const Mqtt2SqlConfig::Route * route) const
+{
+    return m_config.sqlCopyFormat() == Mqtt2SqlConfig::CopyFormat::Binary && (!route || route->columns.isEmpty());
+}
+
+/**
+ * @brief Encode \p records as COPY data for the table of \p route, the buffer is valid until the next call. Needs no connection.
+ */
+const QByteArray & PqCopyWriter::encode(const QVector<MqttRecord> & records, const Mqtt2SqlConfig::Route * route)
+{
+    if (isBinary(route))
+    {
+        encodeBinary(records, route);
+    }
+    else
+    {
+        encodeText(records, route);
+    }
+    return m_buffer;
+}
+
+/**
+ * @brief Write all \p records with one COPY statement into the table of \p route, or the mqtt table if \p route is nullptr.
+ *
+ * The rows are encoded into a single buffer which is sent with one PQputCopyData call.
+ * Routes with typed columns always use the text format, so PostgreSQL converts the values.
+ */
+bool PqCopyWriter::write(const QVector<MqttRecord> & records, const Mqtt2SqlConfig::Route * route)
+{
+    if (records.isEmpty())
+    {
+        return true;
+    }
+    if (!isOpen() && !open())
+    {
+        return false;
+    }
+
+    const bool binary = isBinary(route);
+    const QByteArray statement = QString("COPY %1 (%2) FROM STDIN%3;")
+            .arg(route ? route->table : QString("mqtt"),
+                 MessageRouter::columnNames(route, m_config).join(", "),
+                 QLatin1String(binary ? " (FORMAT binary)" : "")).toUtf8();
+    PGresult * result = PQexec(m_connection, statement.constData());
+    if (PQresultStatus(result) != PGRES_COPY_IN)
+    {
+        m_lastError = QString::fromUtf8(PQerrorMessage(m_connection)).trimmed();
+        PQclear(result);
+        return false;
+    }
+    PQclear(result);
+
+    encode(records, route);
+
+    const char * copyError = nullptr;
+    if (PQputCopyData(m_connection, m_buffer.constData(), m_buffer.size()) != 1)
+    {
+        copyError = "failed to send COPY data";
+    }
+    if (PQputCopyEnd(m_connection, copyError) != 1)
+    {
+        m_lastError = QString::fromUtf8(PQerrorMessage(m_connection)).trimmed();
+        return false;
+    }
+
+    bool ok = true;
+    while ((result = PQgetResult(m_connection)) != nullptr)
+    {
+        if (PQresultStatus(result) != PGRES_COMMAND_OK)
+        {
+            m_lastError = QString::fromUtf8(PQresultErrorMessage(result)).trimmed();
+            ok = false;
+        }
+        PQclear(result);
+    }
+    return ok;
+}
+
+/**
+ * @brief Execute a statement without result, e.g. BEGIN or COMMIT.
+ */
+bool PqCopyWriter::execute(const char * statement)
+{
+    if (!isOpen())
+    {
+        return false;
+    }
+    PGresult * result = PQexec(m_connection, statement);
+    const bool ok = PQresultStatus(result) == PGRES_COMMAND_OK;
+    if (!ok)
+    {
+        m_lastError = QString::fromUtf8(PQresultErrorMessage(result)).trimmed();
+    }
+    PQclear(result);
+    return ok;
+}
+
+/**
+ * @brief Look up the id of \p topic in the topics table, the topic is added if it does not exist.
+ */
+bool PqCopyWriter::topicId(const QString & topic, int & id)
+{
+    if (!isOpen() && !open())
+    {
+        return false;
+    }
+
+    const QByteArray name = topic.toUtf8();
+    const char * values[] = {name.constData()};
+    PGresult * result = PQexecParams(m_connection,
+                                     "INSERT INTO topics (name) VALUES ($1) ON CONFLICT (name) DO UPDATE SET name = EXCLUDED.name RETURNING id;",
+                                     1, nullptr, values, nullptr, nullptr, 0);
+    const bool ok = PQresultStatus(result) == PGRES_TUPLES_OK && PQntuples(result) == 1;
+    if (ok)
+    {
+        id = QByteArray(PQgetvalue(result, 0, 0)).toInt();
+    }
+    else
+    {
+        m_lastError = QString::fromUtf8(PQresultErrorMessage(result)).trimmed();
+    }
+    PQclear(result);
+    return ok;
+}
+
+/**
+ * @brief Encode \p records in the tab separated COPY text format.
+ */
+void PqCopyWriter::encodeText(const QVector<MqttRecord> & records, const Mqtt2SqlConfig::Route * route)
+{
+    m_buffer.truncate(0);
+    for (const MqttRecord & record : records)
+    {
+        appendTextTimestamp(m_buffer, record.ts);
+        m_buffer.append('\t');
+        if (m_config.sqlNormalizeTopics())
+        {
+            m_buffer.append(QByteArray::number(record.topicId));
+        }
+        else
+        {
+            appendTextEscaped(m_buffer, encodedTopic(record.topic));
+        }
+        if (route && route->storeData && route->compress)
+        {
+            m_buffer.append('\t');
+            appendTextHex(m_buffer, record.payload);
+        }
+        else if ((!route || route->storeData) && !m_config.sqlClassifyPayloads())
+        {
+            m_buffer.append('\t');
+            appendTextEscaped(m_buffer, record.payload);
+        }
+        else if (!route || route->storeData)
+        {
+            const PayloadType type = record.payloadType;
+            m_buffer.append('\t');
+            if (type == PayloadType::Json)
+            {
+                appendTextEscaped(m_buffer, record.payload);
+            }
+            else
+            {
+                m_buffer.append("\\N", 2);
+            }
+            m_buffer.append('\t');
+            if (type == PayloadType::Number)
+            {
+                m_buffer.append(QByteArray::number(record.number, 'g', 17));
+            }
+            else
+            {
+                m_buffer.append("\\N", 2);
+            }
+            m_buffer.append('\t');
+            if (type == PayloadType::Binary)
+            {
+                appendTextHex(m_buffer, record.payload);
+            }
+            else
+            {
+                m_buffer.append("\\N", 2);
+            }
+        }
+        if (route && !route->columns.isEmpty())
+        {
+            const QVariantList values = MessageRouter::columnValues(record, *route);
+            for (const QVariant & value : values)
+            {
+                m_buffer.append('\t');
+                if (value.isNull())
+                {
+                    m_buffer.append("\\N", 2);
+                }
+                else if (value.userType() == QMetaType::Bool)
+                {
+                    m_buffer.append(value.toBool() ? 't' : 'f');
+                }
+                else
+                {
+                    appendTextEscaped(m_buffer, value.toString().toUtf8());
+                }
+            }
+        }
+        m_buffer.append('\n');
+    }
+}
+
+/**
+ * @brief Encode \p records in the binary COPY format.
+ *
+ * timestamptz is sent as microseconds since 2000-01-01 UTC, jsonb as version byte followed by the JSON text
+ * and normalized topics as integer id. Classified payloads are sent as jsonb, float8 or bytea, the other
+ * two columns are NULL. Compressed payloads are sent as bytea. Only used for tables without typed columns.
+ */
+void PqCopyWriter::encodeBinary(const QVector<MqttRecord> & records, const Mqtt2SqlConfig::Route * route)
+{
+    const bool storeData = !route || route->storeData;
+    const bool compressed = route && route->compress;
+    const bool classify = m_config.sqlClassifyPayloads() && !compressed;
+    const qint16 fields = storeData ? (classify ? 5 : 3) : 2;
+    m_buffer.truncate(0);
+    m_buffer.append(binaryCopyHeader, sizeof(binaryCopyHeader) - 1);
+    appendBigEndian<qint32>(m_buffer, 0);
+    appendBigEndian<qint32>(m_buffer, 0);
+    for (const MqttRecord & record : records)
+    {
+        appendBigEndian<qint16>(m_buffer, fields);
+        appendBigEndian<qint32>(m_buffer, 8);
+        appendBigEndian<qint64>(m_buffer, (record.ts - postgresEpochOffsetMSecs) * 1000);
+        if (m_config.sqlNormalizeTopics())
+        {
+            appendBigEndian<qint32>(m_buffer, 4);
+            appendBigEndian<qint32>(m_buffer, record.topicId);
+        }
+        else
+        {
+            const QByteArray & topic = encodedTopic(record.topic);
+            appendBigEndian<qint32>(m_buffer, topic.size());
+            m_buffer.append(topic);
+        }
+        if (storeData && compressed)
+        {
+            appendBigEndian<qint32>(m_buffer, record.payload.size());
+            m_buffer.append(record.payload);
+        }
+        else if (storeData && (!classify || record.payloadType == PayloadType::Json))
+        {
+            appendBigEndian<qint32>(m_buffer, record.payload.size() + 1);
+            m_buffer.append(jsonbVersion);
+            m_buffer.append(record.payload);
+        }
+        else if (storeData)
+        {
+            appendBigEndian<qint32>(m_buffer, -1);
+        }
+        if (storeData && classify)
+        {
+            if (record.payloadType == PayloadType::Number)
+            {
+                quint64 bits;
+                std::memcpy(&bits, &record.number, sizeof(bits));
+                appendBigEndian<qint32>(m_buffer, 8);
+                appendBigEndian<quint64>(m_buffer, bits);
+            }
+            else
+            {
+                appendBigEndian<qint32>(m_buffer, -1);
+            }
+            if (record.payloadType == PayloadType::Binary)
+            {
+                appendBigEndian<qint32>(m_buffer, record.payload.size());
+                m_buffer.append(record.payload);
+            }
+            else
+            {
+                appendBigEndian<qint32>(m_buffer, -1);
+            }
+        }
+    }
+    appendBigEndian<qint16>(m_buffer, -1);
+}
+
+/**
+ * @brief UTF-8 encoding of \p topic, cached so repeated topics are not encoded for every row.
+ */
+const QByteArray & PqCopyWriter::encodedTopic(const QString & topic)
+{
+    auto it = m_topicCache.find(topic);
+    if (it == m_topicCache.end())
+    {
+        if (m_topicCache.size() >= maxCachedTopics)
+        {
+            m_topicCache.clear();
+        }
+        it = m_topicCache.insert(topic, topic.toUtf8());
+    }
+    return it.value();
+}
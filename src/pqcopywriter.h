@@ -0,0 +1,74 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef PQCOPYWRITER_H
+#define PQCOPYWRITER_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+#include "mqtt2sqlconfig.h"
+#include "mqttrecord.h"
+
+typedef struct pg_conn PGconn;
+
+/**
+ * @brief Streams batches of messages into the mqtt table using COPY ... FROM STDIN.
+ *
+ * Uses its own libpq connection, bypassing the QPSQL driver and the QVariant
+ * conversion of every value.
+ */
+class PqCopyWriter
+{
+public:
+    explicit PqCopyWriter(const Mqtt2SqlConfig & config);
+    ~PqCopyWriter();
+
+    PqCopyWriter(const PqCopyWriter &) = delete;
+    PqCopyWriter & operator=(const PqCopyWriter &) = delete;
+
+    bool open();
+    bool isOpen() const;
+    void close();
+
+    bool write(const QVector<MqttRecord> & records, const Mqtt2SqlConfig::Route * route = nullptr);
+    const QByteArray & encode(const QVector<MqttRecord> & records, const Mqtt2SqlConfig::Route * route = nullptr);
+    bool topicId(const QString & topic, int & id);
+    bool execute(const char * statement);
+
+    const QString & lastError() const { return m_lastError; }
+
+private:
+    bool isBinary(const Mqtt2SqlConfig::Route * route) const;
+    void encodeText(const QVector<MqttRecord> & records, const Mqtt2SqlConfig::Route * route);
+    void encodeBinary(const QVector<MqttRecord> & records, const Mqtt2SqlConfig::Route * route);
+    const QByteArray & encodedTopic(const QString & topic);
+
+    Mqtt2SqlConfig m_config;
+    PGconn * m_connection = nullptr;
+    /// Keeps its capacity between batches.
+    QByteArray m_buffer;
+    /// UTF-8 encoding of recently written topics.
+    QHash<QString, QByteArray> m_topicCache;
+    QString m_lastError;
+};
+
+#endif // PQCOPYWRITER_H
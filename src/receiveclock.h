@@ -0,0 +1,76 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef RECEIVECLOCK_H
+#define RECEIVECLOCK_H
+
+#include <QDateTime>
+
+#include <algorithm>
+#include <chrono>
+
+/**
+ * @brief Cheap wall clock for receive timestamps, in milliseconds since the Unix epoch (UTC).
+ *
+ * The epoch time is read once and then advanced with the monotonic clock, so taking a
+ * timestamp does not need a time zone conversion. The offset to the wall clock is read
+ * again every minute to follow clock adjustments. The returned timestamps do not go
+ * backwards for small corrections of up to maxSlew, they hold until the wall clock caught
+ * up. A larger backwards step of the wall clock is taken over at once, otherwise the
+ * timestamps would stay frozen until the clock is back at the time before the step.
+ * Not thread safe, every thread receiving messages uses its own clock.
+ */
+class ReceiveClock
+{
+public:
+    ReceiveClock() { sync(std::chrono::steady_clock::now()); }
+
+    qint64 now()
+    {
+        const auto steady = std::chrono::steady_clock::now();
+        if (steady - m_syncTime >= resyncInterval)
+        {
+            sync(steady);
+        }
+        const qint64 elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(steady - m_syncTime).count();
+        m_last = std::max(m_last, m_syncEpoch + elapsed);
+        return m_last;
+    }
+
+private:
+    static constexpr std::chrono::minutes resyncInterval {1};
+    static constexpr qint64 maxSlew = 1000;
+
+    void sync(std::chrono::steady_clock::time_point steady)
+    {
+        const qint64 epoch = QDateTime::currentMSecsSinceEpoch();
+        if (m_last - epoch > maxSlew)
+        {
+            m_last = 0;
+        }
+        m_syncTime = steady;
+        m_syncEpoch = epoch;
+    }
+
+    std::chrono::steady_clock::time_point m_syncTime;
+    qint64 m_syncEpoch = 0;
+    qint64 m_last = 0;
+};
+
+#endif // RECEIVECLOCK_H
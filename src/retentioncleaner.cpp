@@ -0,0 +1,236 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "retentioncleaner.h"
+#include "logger.h"
+
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QVariant>
+
+#include <algorithm>
+
+RetentionCleaner::RetentionCleaner(const Mqtt2SqlConfig & config, MetricsShard * metrics, QObject *parent)
+    : QObject{parent}
+    , m_config(config)
+    , m_tables(tables(config))
+    , m_metrics(metrics)
+{
+    m_chunkTimer.setSingleShot(true);
+    m_chunkTimer.setInterval(config.sqlCleanupPause());
+    connect(&m_chunkTimer, &QTimer::timeout, this, &RetentionCleaner::deleteChunk);
+}
+
+/**
+ * @brief Tables the expired rows are deleted from.
+ *
+ * With partitioning expired partitions are dropped as a whole and only the rows outside of the
+ * partitions need to be deleted, TimescaleDB drops the chunks of the mqtt table itself.
+ */
+QVector<RetentionCleaner::Table> RetentionCleaner::tables(const Mqtt2SqlConfig & config)
+{
+    QVector<Table> tables;
+    if (config.sqlPartitioning() != Mqtt2SqlConfig::Partitioning::None)
+    {
+        tables.append({"mqtt_default", config.sqlMaxStroageTime()});
+    }
+    else if (!config.sqlTimescaleDb())
+    {
+        tables.append({"mqtt", config.sqlMaxStroageTime()});
+    }
+    for (const Mqtt2SqlConfig::Route & route : config.routes())
+    {
+        // Several routes can use the same table.
+        const bool known = std::any_of(tables.cbegin(), tables.cend(), [&route](const Table & table) { return table.name == route.table; });
+        if (!known)
+        {
+            tables.append({route.table, route.maxStorageTime.count() > 0 ? route.maxStorageTime : config.sqlMaxStroageTime()});
+        }
+    }
+    return tables;
+}
+
+/**
+ * @brief Use the retention and cleanup settings of the reloaded \p config, called in the thread of the cleaner.
+ *
+ * A reload only appends tables, so a running cleanup continues with the new list.
+ */
+void RetentionCleaner::setConfig(const Mqtt2SqlConfig & config)
+{
+    m_config = config;
+    m_tables = tables(config);
+    m_chunkTimer.setInterval(config.sqlCleanupPause());
+}
+
+/**
+ * @brief Statement deleting the oldest expired rows of \p table, at most :rows of them.
+ *
+ * The rows are selected by their ctid, which turns the delete into a TID scan after an index
+ * range scan on ts, instead of a scan of all expired rows.
+ */
+QString RetentionCleaner::chunkStatement(const QString & table)
+{
+    return QString("DELETE FROM %1 WHERE ctid = ANY(ARRAY(SELECT ctid FROM %1 WHERE ts < :ts ORDER BY ts LIMIT :rows));").arg(table);
+}
+
+/**
+ * @brief Start deleting the expired rows, does nothing if a cleanup is still running.
+ */
+void RetentionCleaner::cleanup()
+{
+    if (m_table >= 0 || m_tables.isEmpty())
+    {
+        return;
+    }
+    // QPSQL still reports a connection as open after the server restarted.
+    if (!isAlive())
+    {
+        if (QSqlDatabase::contains(m_connectionName))
+        {
+            QSqlDatabase::database(m_connectionName, false).close();
+        }
+        if (!openDatabase())
+        {
+            return;
+        }
+    }
+    QSqlDatabase db = QSqlDatabase::database(m_connectionName, false);
+
+    QSqlQuery lock(db);
+    if (!lock.exec(QString("SELECT pg_try_advisory_lock(%1);").arg(lockKey)) || !lock.next())
+    {
+        logError("SQL error: can not execute statement: " + lock.lastError().text());
+        return;
+    }
+    if (!lock.value(0).toBool())
+    {
+        logInfo("Cleanup skipped, another instance is cleaning up.");
+        return;
+    }
+
+    logInfo("Cleaning up SQL database.");
+    m_start = std::chrono::steady_clock::now();
+    m_now = QDateTime::currentDateTimeUtc();
+    m_deleted = 0;
+    m_table = 0;
+    deleteChunk();
+}
+
+/**
+ * @brief Delete one chunk of the current table and schedule the next chunk after the pause.
+ */
+void RetentionCleaner::deleteChunk()
+{
+    if (m_table < 0)
+    {
+        return;
+    }
+    const Table & table = m_tables.at(m_table);
+    QSqlQuery query(QSqlDatabase::database(m_connectionName, false));
+    if (!query.prepare(chunkStatement(table.name)))
+    {
+        logError("SQL error: can not prepare statement: " + query.lastError().text());
+        finish();
+        return;
+    }
+    query.bindValue(":ts", m_now.addSecs(table.maxStorageTime.count()*60*60*-1));
+    query.bindValue(":rows", m_config.sqlCleanupChunk());
+    if (!query.exec())
+    {
+        logError("SQL error: can not execute statement: " + query.lastError().text());
+        if (!isAlive())
+        {
+            // The lock is gone with the connection, the next cleanup reconnects.
+            m_table = -1;
+            QSqlDatabase::database(m_connectionName, false).close();
+            return;
+        }
+        finish();
+        return;
+    }
+    const int rows = query.numRowsAffected();
+    m_deleted += qMax(0, rows);
+    m_metrics->rowsDeleted.add(static_cast<quint64>(qMax(0, rows)));
+    if (rows < m_config.sqlCleanupChunk() && ++m_table >= m_tables.size())
+    {
+        finish();
+        return;
+    }
+    m_chunkTimer.start();
+}
+
+/**
+ * @brief Release the advisory lock and record the duration of the cleanup.
+ */
+void RetentionCleaner::finish()
+{
+    m_table = -1;
+    QSqlQuery lock(QSqlDatabase::database(m_connectionName, false));
+    if (!lock.exec(QString("SELECT pg_advisory_unlock(%1);").arg(lockKey)))
+    {
+        logError("SQL error: can not execute statement: " + lock.lastError().text());
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - m_start;
+    m_metrics->cleanupSeconds.observe(elapsed.count());
+    logInfo(QString("Cleanup deleted %1 rows in %2 s.").arg(m_deleted).arg(elapsed.count(), 0, 'f', 1));
+}
+
+/**
+ * @brief Stop a running cleanup and close the connection, called from the thread of the cleaner before it quits.
+ *
+ * Closing the connection releases the advisory lock.
+ */
+void RetentionCleaner::stop()
+{
+    m_chunkTimer.stop();
+    m_table = -1;
+    if (QSqlDatabase::contains(m_connectionName))
+    {
+        QSqlDatabase::database(m_connectionName, false).close();
+        QSqlDatabase::removeDatabase(m_connectionName);
+    }
+}
+
+/**
+ * @brief Check whether the connection of the cleaner works, with a query as QPSQL does not notice a lost connection.
+ */
+bool RetentionCleaner::isAlive()
+{
+    QSqlDatabase db = QSqlDatabase::database(m_connectionName, false);
+    QSqlQuery probe(db);
+    return db.isValid() && db.isOpen() && probe.exec("SELECT 1;");
+}
+
+bool RetentionCleaner::openDatabase()
+{
+    QSqlDatabase db = QSqlDatabase::contains(m_connectionName) ? QSqlDatabase::database(m_connectionName, false)
+                                                               : QSqlDatabase::addDatabase("QPSQL", m_connectionName);
+    db.setHostName(m_config.sqlHostname());
+    db.setDatabaseName(m_config.sqlDatabase());
+    db.setPort(m_config.sqlPort());
+    db.setUserName(m_config.sqlUsername());
+    db.setPassword(m_config.sqlPassword());
+    if (!db.open())
+    {
+        logError("Error: Faild to open database: " + db.lastError().text());
+        return false;
+    }
+    return true;
+}
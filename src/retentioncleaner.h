@@ -0,0 +1,87 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef RETENTIONCLEANER_H
+#define RETENTIONCLEANER_H
+
+#include <QDateTime>
+#include <QObject>
+#include <QTimer>
+#include <QVector>
+
+#include <chrono>
+
+#include "metrics.h"
+#include "mqtt2sqlconfig.h"
+
+/**
+ * @brief Deletes expired rows in small chunks on its own database connection.
+ *
+ * Every chunk deletes the oldest rows up to the configured number in its own transaction,
+ * found by an index range scan on ts, followed by a pause, so the writers are never blocked
+ * for long. Meant to run in its own thread, the connection is opened in that thread. Only one
+ * instance using the database cleans up at a time, coordinated by an advisory lock.
+ */
+class RetentionCleaner : public QObject
+{
+    Q_OBJECT
+public:
+    /// Advisory lock held during the cleanup.
+    static constexpr qint64 lockKey = 0x716d717432737102;
+
+    /// A table and the age after which its rows are deleted.
+    struct Table
+    {
+        QString name;
+        std::chrono::hours maxStorageTime;
+    };
+
+    explicit RetentionCleaner(const Mqtt2SqlConfig & config, MetricsShard * metrics, QObject *parent = nullptr);
+
+    static QVector<Table> tables(const Mqtt2SqlConfig & config);
+    static QString chunkStatement(const QString & table);
+
+    void setConfig(const Mqtt2SqlConfig & config);
+
+public slots:
+    void cleanup();
+    void stop();
+
+private slots:
+    void deleteChunk();
+
+private:
+    bool isAlive();
+    bool openDatabase();
+    void finish();
+
+    Mqtt2SqlConfig m_config;
+    QVector<Table> m_tables;
+    MetricsShard * m_metrics;
+    QString m_connectionName {"qmqtt2sql-cleanup"};
+    QTimer m_chunkTimer {this};
+    /// Index into \ref m_tables of the running cleanup, -1 if none is running.
+    int m_table = -1;
+    /// Start of the running cleanup, the cutoffs are relative to it.
+    QDateTime m_now;
+    qint64 m_deleted = 0;
+    std::chrono::steady_clock::time_point m_start;
+};
+
+#endif // RETENTIONCLEANER_H
@@ -0,0 +1,96 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "signalnotifier.h"
+#include "logger.h"
+
+#include <QSocketNotifier>
+
+#ifdef Q_OS_UNIX
+#include <csignal>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+/// Written by the signal handler at index 0, read by the notifier at index 1.
+int signalSockets[2] = {-1, -1};
+
+void handleSignal(int signalNumber)
+{
+    const unsigned char byte = static_cast<unsigned char>(signalNumber);
+    [[maybe_unused]] const ssize_t written = ::write(signalSockets[0], &byte, sizeof(byte));
+}
+
+} // namespace
+#endif
+
+SignalNotifier::SignalNotifier(const QVector<int> & signalNumbers, QObject *parent)
+    : QObject{parent}
+    , m_signalNumbers(signalNumbers)
+{
+#ifdef Q_OS_UNIX
+    if (::socketpair(AF_UNIX, SOCK_STREAM, 0, signalSockets) != 0)
+    {
+        logError("Error: can not create socket pair, signals are not handled.");
+        return;
+    }
+    m_notifier = new QSocketNotifier(signalSockets[1], QSocketNotifier::Read, this);
+    connect(m_notifier, &QSocketNotifier::activated, this, [this]() {
+        unsigned char byte = 0;
+        if (::read(signalSockets[1], &byte, sizeof(byte)) == sizeof(byte))
+        {
+            emit received(byte);
+        }
+    });
+
+    struct sigaction action {};
+    action.sa_handler = handleSignal;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART;
+    for (const int signalNumber : std::as_const(m_signalNumbers))
+    {
+        if (::sigaction(signalNumber, &action, nullptr) != 0)
+        {
+            logError("Error: can not install handler of signal " + QString::number(signalNumber) + ".");
+        }
+    }
+#endif
+}
+
+/**
+ * @brief Restores the default handling of the signals and closes the socket pair.
+ */
+SignalNotifier::~SignalNotifier()
+{
+#ifdef Q_OS_UNIX
+    if (!m_notifier)
+    {
+        return;
+    }
+    for (const int signalNumber : std::as_const(m_signalNumbers))
+    {
+        ::signal(signalNumber, SIG_DFL);
+    }
+    delete m_notifier;
+    ::close(signalSockets[0]);
+    ::close(signalSockets[1]);
+    signalSockets[0] = signalSockets[1] = -1;
+#endif
+}
@@ -0,0 +1,51 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SIGNALNOTIFIER_H
+#define SIGNALNOTIFIER_H
+
+#include <QObject>
+#include <QVector>
+
+class QSocketNotifier;
+
+/**
+ * @brief Turns Unix signals into the signal \ref received, emitted by the event loop of the notifier's thread.
+ *
+ * The signal handler only writes the signal number to a socket pair, which is read by a
+ * QSocketNotifier, as Qt functions must not be called from a signal handler. Only one instance
+ * may exist, it handles all given signals. On other platforms than Unix the notifier does nothing.
+ */
+class SignalNotifier : public QObject
+{
+    Q_OBJECT
+public:
+    explicit SignalNotifier(const QVector<int> & signalNumbers, QObject *parent = nullptr);
+    ~SignalNotifier() override;
+
+signals:
+    /// Is emitted after the signal \p signalNumber was received.
+    void received(int signalNumber);
+
+private:
+    QVector<int> m_signalNumbers;
+    QSocketNotifier * m_notifier = nullptr;
+};
+
+#endif // SIGNALNOTIFIER_H
@@ -0,0 +1,91 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "sink.h"
+
+#include <QDateTime>
+
+#include "messagerouter.h"
+#include "postgressink.h"
+#include "sqlitesink.h"
+
+#ifdef QMQTT2SQL_HAVE_ARROW
+#include "columnarfilesink.h"
+#endif
+
+/**
+ * @brief Create the sink of the writer with number \p index, as configured by sinkType().
+ */
+std::unique_ptr<Sink> Sink::create(const Mqtt2SqlConfig & config, TopicDictionary * topics, const MessageRouter * router,
+                                   MetricsShard * metrics, int index)
+{
+    switch (config.sinkType())
+    {
+    case Mqtt2SqlConfig::SinkType::Sqlite:
+        return std::make_unique<SqliteSink>(config, router, metrics, index);
+#ifdef QMQTT2SQL_HAVE_ARROW
+    case Mqtt2SqlConfig::SinkType::Files:
+        return std::make_unique<ColumnarFileSink>(config, router, index);
+#endif
+    default:
+        return std::make_unique<PostgresSink>(config, topics, router, metrics, index);
+    }
+}
+
+/**
+ * @brief Append the values of the columns of \p record, in the order of \ref MessageRouter::columnNames.
+ */
+void Sink::appendInsertValues(QVector<QVariant> & values, const MqttRecord & record,
+                              const Mqtt2SqlConfig::Route * route, const Mqtt2SqlConfig & config)
+{
+    const bool storeData = !route || route->storeData;
+    values.append(QDateTime::fromMSecsSinceEpoch(record.ts, Qt::UTC));
+    if (config.sqlNormalizeTopics())
+    {
+        values.append(record.topicId);
+    }
+    else
+    {
+        values.append(record.topic);
+    }
+    if (storeData && route && route->compress)
+    {
+        // A QByteArray is bound as bytea.
+        values.append(record.payload);
+    }
+    else if (storeData && !config.sqlClassifyPayloads())
+    {
+        // QPSQL only sends strings as text, the COPY backend sends the payload bytes unchanged.
+        values.append(QString::fromUtf8(record.payload));
+    }
+    else if (storeData)
+    {
+        const PayloadType type = record.payloadType;
+        values.append(type == PayloadType::Json ? QVariant(QString::fromUtf8(record.payload)) : QVariant());
+        values.append(type == PayloadType::Number ? QVariant(record.number) : QVariant());
+        values.append(type == PayloadType::Binary ? QVariant(record.payload) : QVariant());
+    }
+    if (route && !route->columns.isEmpty())
+    {
+        for (const QVariant & value : MessageRouter::columnValues(record, *route))
+        {
+            values.append(value);
+        }
+    }
+}
@@ -0,0 +1,70 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SINK_H
+#define SINK_H
+
+#include <QString>
+#include <QVariant>
+#include <QVector>
+
+#include <memory>
+
+#include "metrics.h"
+#include "mqtt2sqlconfig.h"
+#include "mqttrecord.h"
+#include "topicdictionary.h"
+
+class MessageRouter;
+
+/**
+ * @brief Storage the \ref SqlWriter threads write their batches to.
+ *
+ * Every writer owns its own sink, so a sink is only used by one thread. The writer does the
+ * batching, the spooling and the reconnects, the sink only opens its connection or files and
+ * writes whole batches. The sink is selected by the type of the [sink] config section, see
+ * \ref create.
+ */
+class Sink
+{
+public:
+    virtual ~Sink() = default;
+
+    static std::unique_ptr<Sink> create(const Mqtt2SqlConfig & config, TopicDictionary * topics, const MessageRouter * router,
+                                        MetricsShard * metrics, int index);
+    static void appendInsertValues(QVector<QVariant> & values, const MqttRecord & record,
+                                   const Mqtt2SqlConfig::Route * route, const Mqtt2SqlConfig & config);
+
+    /// Open the connection or the output, false if it is not available yet.
+    virtual bool open() = 0;
+    virtual void close() = 0;
+    virtual bool isOpen() const = 0;
+    /// Whether the sink still works after a failed write, otherwise it is closed and opened again.
+    virtual bool isAlive() = 0;
+    /// Write \p batch atomically, the records may be updated, e.g. with their topic id. The files sink only buffers it.
+    virtual bool write(QVector<MqttRecord> & batch) = 0;
+    /// Called by the writer between batches, at least once a second.
+    virtual void maintain() {}
+    /// Whether all written batches are durable, the files sink only once its open files are complete.
+    virtual bool isDurable() const { return true; }
+    /// Take over the batch size of a reloaded config, which does not recreate the sink.
+    virtual void setBatchSize(int /*batchSize*/) {}
+};
+
+#endif // SINK_H
@@ -0,0 +1,317 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "sqlitesink.h"
+
+#include <QDateTime>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QStringList>
+
+#include <algorithm>
+
+#include "logger.h"
+#include "messagerouter.h"
+
+SqliteSink::SqliteSink(const Mqtt2SqlConfig & config, const MessageRouter * router, MetricsShard * metrics, int index)
+    : m_config(config)
+    , m_router(router)
+    , m_metrics(metrics)
+    , m_connectionName(QString("qmqtt2sql-writer-%1").arg(index))
+{
+    // One writer is enough for the cleanup, SQLite serializes all writes anyway.
+    if (index == 0)
+    {
+        m_tables.append({"mqtt", config.sqlMaxStroageTime()});
+        for (const Mqtt2SqlConfig::Route & route : config.routes())
+        {
+            const bool known = std::any_of(m_tables.cbegin(), m_tables.cend(), [&route](const Table & table) { return table.name == route.table; });
+            if (!known)
+            {
+                m_tables.append({route.table, route.maxStorageTime.count() > 0 ? route.maxStorageTime : config.sqlMaxStroageTime()});
+            }
+        }
+    }
+    m_nextCleanup = std::chrono::steady_clock::now() + config.sqlCleanupInterval();
+}
+
+SqliteSink::~SqliteSink()
+{
+    close();
+}
+
+/**
+ * @brief Open the database file, switch it to WAL mode and create the missing tables.
+ */
+bool SqliteSink::open()
+{
+    if (!QSqlDatabase::isDriverAvailable("QSQLITE"))
+    {
+        logError("Error: the Qt SQLite driver QSQLITE is not available!");
+        return false;
+    }
+    QSqlDatabase db = QSqlDatabase::addDatabase("QSQLITE", m_connectionName);
+    db.setDatabaseName(m_config.sqlitePath());
+    // Several writers and readers share the file, a locked database is retried instead of failing the batch.
+    db.setConnectOptions("QSQLITE_BUSY_TIMEOUT=5000");
+    if (!db.open())
+    {
+        logError("Error: Faild to open SQLite database: " + db.lastError().text());
+        return false;
+    }
+    if (!execute("PRAGMA journal_mode=WAL;") || !execute("PRAGMA synchronous=" + m_config.sqliteSynchronous() + ";")
+            || !createTable("mqtt", nullptr))
+    {
+        return false;
+    }
+    const QVector<Mqtt2SqlConfig::Route> & routes = m_config.routes();
+    for (int i = 0; i < routes.size(); ++i)
+    {
+        if (!createTable(routes.at(i).table, &routes.at(i)))
+        {
+            return false;
+        }
+    }
+    m_statements.resize(routes.size() + 1);
+    return true;
+}
+
+void SqliteSink::close()
+{
+    // The statements have to be gone before the connection is removed.
+    m_statements.clear();
+    if (QSqlDatabase::contains(m_connectionName))
+    {
+        QSqlDatabase::database(m_connectionName, false).close();
+        QSqlDatabase::removeDatabase(m_connectionName);
+    }
+}
+
+bool SqliteSink::isOpen() const
+{
+    QSqlDatabase db = QSqlDatabase::database(m_connectionName, false);
+    return db.isValid() && db.isOpen();
+}
+
+/**
+ * @brief Check whether the database still works after a failed write.
+ */
+bool SqliteSink::isAlive()
+{
+    QSqlDatabase db = QSqlDatabase::database(m_connectionName, false);
+    QSqlQuery probe(db);
+    return db.isOpen() && probe.exec("SELECT 1;");
+}
+
+/**
+ * @brief Write \p batch in one transaction, every row with the prepared statement of its table.
+ */
+bool SqliteSink::write(QVector<MqttRecord> & batch)
+{
+    QSqlDatabase db = QSqlDatabase::database(m_connectionName, false);
+    if (!db.transaction())
+    {
+        Logger::instance().logLimited(LogLevel::Error, "sqlite-execute", "SQLite error: can not begin transaction: " + db.lastError().text());
+        return false;
+    }
+    for (const MqttRecord & record : std::as_const(batch))
+    {
+        QSqlQuery * query = statement(record.route);
+        if (!query)
+        {
+            db.rollback();
+            return false;
+        }
+        m_values.clear();
+        appendInsertValues(m_values, record, record.route >= 0 ? &m_router->at(record.route) : nullptr, m_config);
+        for (int pos = 0; pos < m_values.size(); ++pos)
+        {
+            query->bindValue(pos, m_values.at(pos));
+        }
+        if (!query->exec())
+        {
+            Logger::instance().logLimited(LogLevel::Error, "sqlite-execute", "SQLite error: can not insert row: " + query->lastError().text());
+            db.rollback();
+            return false;
+        }
+    }
+    if (!db.commit())
+    {
+        Logger::instance().logLimited(LogLevel::Error, "sqlite-execute", "SQLite error: can not commit batch: " + db.lastError().text());
+        db.rollback();
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Delete one chunk of expired rows once the cleanup is due.
+ *
+ * Deleting at most sqlCleanupChunk() rows per call keeps the write lock short, the writer
+ * writes its batches in between. A table is done once a chunk deletes fewer rows.
+ */
+void SqliteSink::maintain()
+{
+    if (m_tables.isEmpty())
+    {
+        return;
+    }
+    const auto now = std::chrono::steady_clock::now();
+    if (m_cleanupTable < 0)
+    {
+        if (now < m_nextCleanup)
+        {
+            return;
+        }
+        m_cleanupTable = 0;
+    }
+
+    const Table & table = m_tables.at(m_cleanupTable);
+    const QDateTime cutoff = QDateTime::currentDateTimeUtc().addSecs(-std::chrono::duration_cast<std::chrono::seconds>(table.maxStorageTime).count());
+    QSqlQuery query(QSqlDatabase::database(m_connectionName, false));
+    query.prepare(QString("DELETE FROM %1 WHERE rowid IN (SELECT rowid FROM %1 WHERE ts < ? ORDER BY ts LIMIT ?);").arg(table.name));
+    query.bindValue(0, cutoff);
+    query.bindValue(1, m_config.sqlCleanupChunk());
+    int rows = 0;
+    if (!query.exec())
+    {
+        Logger::instance().logLimited(LogLevel::Error, "cleanup", "Error while deleting expired rows of " + table.name + ": " + query.lastError().text());
+    }
+    else
+    {
+        rows = query.numRowsAffected();
+        m_metrics->rowsDeleted.add(rows);
+    }
+    if (rows < m_config.sqlCleanupChunk() && ++m_cleanupTable >= m_tables.size())
+    {
+        m_cleanupTable = -1;
+        m_nextCleanup = now + m_config.sqlCleanupInterval();
+    }
+}
+
+bool SqliteSink::execute(const QString & statement)
+{
+    QSqlQuery query(QSqlDatabase::database(m_connectionName, false));
+    if (!query.exec(statement))
+    {
+        logError("SQLite error: can not execute " + statement + " " + query.lastError().text());
+        return false;
+    }
+    return true;
+}
+
+/**
+ * @brief Create \p table of \p route, or the mqtt table if \p route is nullptr, and its configured indexes.
+ *
+ * The columns have the types of the PostgreSQL tables where SQLite knows them, typed route columns
+ * keep their declared type, which SQLite maps to its type affinity.
+ */
+bool SqliteSink::createTable(const QString & table, const Mqtt2SqlConfig::Route * route)
+{
+    QStringList columns {"ts TEXT NOT NULL", "topic TEXT NOT NULL"};
+    const bool storeData = !route || route->storeData;
+    if (storeData)
+    {
+        columns << "data TEXT";
+        if (m_config.sqlClassifyPayloads())
+        {
+            columns << "value REAL" << "raw BLOB";
+        }
+    }
+    if (route)
+    {
+        for (const Mqtt2SqlConfig::RouteColumn & column : route->columns)
+        {
+            columns << column.name + " " + column.type;
+        }
+    }
+    if (!execute("CREATE TABLE IF NOT EXISTS " + table + " (" + columns.join(", ") + ");"))
+    {
+        return false;
+    }
+
+    if (storeData && m_config.sqlClassifyPayloads())
+    {
+        // SQLite has no ADD COLUMN IF NOT EXISTS, tables created without classified payloads get the columns here.
+        QSqlQuery info(QSqlDatabase::database(m_connectionName, false));
+        bool hasValue = false;
+        if (info.exec("PRAGMA table_info(" + table + ");"))
+        {
+            while (info.next())
+            {
+                hasValue = hasValue || info.value(1).toString() == "value";
+            }
+        }
+        if (!hasValue && (!execute("ALTER TABLE " + table + " ADD COLUMN value REAL;") || !execute("ALTER TABLE " + table + " ADD COLUMN raw BLOB;")))
+        {
+            return false;
+        }
+    }
+
+    for (const Mqtt2SqlConfig::Index index : m_config.sqlIndexes())
+    {
+        QString statement;
+        switch (index)
+        {
+        case Mqtt2SqlConfig::Index::Topic:
+            statement = QString("CREATE INDEX IF NOT EXISTS %1_topic_idx ON %1 (topic);").arg(table);
+            break;
+        case Mqtt2SqlConfig::Index::Ts:
+        case Mqtt2SqlConfig::Index::TsBrin:
+            // SQLite has no BRIN indexes.
+            statement = QString("CREATE INDEX IF NOT EXISTS %1_ts_idx ON %1 (ts);").arg(table);
+            break;
+        case Mqtt2SqlConfig::Index::TopicTs:
+            statement = QString("CREATE INDEX IF NOT EXISTS %1_topic_ts_idx ON %1 (topic, ts DESC);").arg(table);
+            break;
+        }
+        if (!execute(statement))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Prepared INSERT statement of the table of \p route, or of the mqtt table if \p route is -1.
+ */
+QSqlQuery * SqliteSink::statement(int route)
+{
+    std::unique_ptr<QSqlQuery> & query = m_statements[route + 1];
+    if (!query)
+    {
+        const Mqtt2SqlConfig::Route * routeConfig = route >= 0 ? &m_router->at(route) : nullptr;
+        const QStringList columns = MessageRouter::columnNames(routeConfig, m_config);
+        QStringList placeholders;
+        for (int i = 0; i < columns.size(); ++i)
+        {
+            placeholders << QStringLiteral("?");
+        }
+        query = std::make_unique<QSqlQuery>(QSqlDatabase::database(m_connectionName, false));
+        if (!query->prepare("INSERT INTO " + (routeConfig ? routeConfig->table : QString("mqtt")) + " (" + columns.join(", ")
+                            + ") VALUES (" + placeholders.join(", ") + ");"))
+        {
+            Logger::instance().logLimited(LogLevel::Error, "sqlite-prepare", "SQLite error: can not prepare statement: " + query->lastError().text());
+            query.reset();
+            return nullptr;
+        }
+    }
+    return query.get();
+}
@@ -0,0 +1,80 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SQLITESINK_H
+#define SQLITESINK_H
+
+#include <QSqlQuery>
+#include <QString>
+#include <QVector>
+
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "sink.h"
+
+/**
+ * @brief Writes batches to a SQLite database file, for gateways without PostgreSQL.
+ *
+ * The database runs in WAL mode, so readers do not block the writers. Every batch is written in one
+ * transaction with one prepared INSERT statement per table, which is reused for all rows and batches.
+ * The tables are created on open with the layout of the PostgreSQL tables, ts is stored as ISO 8601
+ * text in UTC, which sorts by time. The first writer deletes the expired rows in chunks between its batches.
+ */
+class SqliteSink : public Sink
+{
+public:
+    SqliteSink(const Mqtt2SqlConfig & config, const MessageRouter * router, MetricsShard * metrics, int index);
+    ~SqliteSink() override;
+
+    bool open() override;
+    void close() override;
+    bool isOpen() const override;
+    bool isAlive() override;
+    bool write(QVector<MqttRecord> & batch) override;
+    void maintain() override;
+
+private:
+    struct Table
+    {
+        QString name;
+        std::chrono::hours maxStorageTime;
+    };
+
+    bool execute(const QString & statement);
+    bool createTable(const QString & table, const Mqtt2SqlConfig::Route * route);
+    QSqlQuery * statement(int route);
+
+    Mqtt2SqlConfig m_config;
+    const MessageRouter * m_router;
+    MetricsShard * m_metrics;
+    QString m_connectionName;
+    /// Prepared INSERT statement of the mqtt table and of every route, prepared on first use.
+    std::vector<std::unique_ptr<QSqlQuery>> m_statements;
+    /// Values of one row, keeps its capacity.
+    QVector<QVariant> m_values;
+    /// Tables cleaned up by this writer, empty for all but the first writer.
+    QVector<Table> m_tables;
+    /// Table of the next cleanup chunk, -1 until the next cleanup is due.
+    int m_cleanupTable = -1;
+    std::chrono::steady_clock::time_point m_nextCleanup;
+};
+
+#endif // SQLITESINK_H
@@ -0,0 +1,470 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "sqlwriter.h"
+
+#include <QDateTime>
+
+#include <algorithm>
+#include <iterator>
+
+#include "jsonvalidator.h"
+#include "logger.h"
+#include "messagerouter.h"
+
+SqlWriter::SqlWriter(const Mqtt2SqlConfig & config, RecordQueue & queue, MessageSpool * spool, TopicDictionary * topics,
+                     const MessageRouter * router, MetricsShard * metrics, const std::atomic<bool> & schemaReady,
+                     int index, QObject *parent)
+    : QThread{parent}
+    , m_config(config)
+    , m_queue(queue)
+    , m_spool(spool)
+    , m_topics(topics)
+    , m_router(router)
+    , m_metrics(metrics)
+    , m_index(index)
+    , m_schemaReady(schemaReady)
+    , m_sink(Sink::create(config, topics, router, metrics, index))
+    , m_backoff(config.sqlReconnectMin(), config.sqlReconnectMax())
+    , m_connectionName(QString("qmqtt2sql-writer-%1").arg(index))
+{
+    setObjectName(m_connectionName);
+}
+
+SqlWriter::~SqlWriter()
+{
+    wait();
+}
+
+/**
+ * @brief Hand a reloaded \p config and \p router to the writer, may be called from any thread.
+ *
+ * The writer takes them over before its next batch, with \p recreateSink its sink is closed
+ * and created again for the new routes. The old router must stay valid until then.
+ */
+void SqlWriter::reconfigure(const Mqtt2SqlConfig & config, const MessageRouter * router, bool recreateSink)
+{
+    std::lock_guard<std::mutex> lock(m_reloadMutex);
+    m_reloadConfig = config;
+    m_reloadRouter = router;
+    m_reloadSink = m_reloadSink || recreateSink;
+    ++m_reloadsRequested;
+    m_reloadPending.store(true, std::memory_order_release);
+}
+
+/**
+ * @brief Whether the writer took over the last reload, including its sink, may be called from any thread.
+ */
+bool SqlWriter::isReconfigured()
+{
+    std::lock_guard<std::mutex> lock(m_reloadMutex);
+    return m_reloadsApplied.load(std::memory_order_acquire) == m_reloadsRequested;
+}
+
+/**
+ * @brief Take over the config of a pending reload, between two batches.
+ *
+ * Called before every batch, records with a route of the new router are only written after it.
+ */
+void SqlWriter::applyReload()
+{
+    if (!m_reloadPending.load(std::memory_order_acquire))
+    {
+        return;
+    }
+    bool recreateSink = false;
+    int reloads = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_reloadMutex);
+        m_config = m_reloadConfig;
+        m_router = m_reloadRouter;
+        recreateSink = m_reloadSink;
+        m_reloadSink = false;
+        reloads = m_reloadsRequested;
+        m_reloadPending.store(false, std::memory_order_relaxed);
+    }
+    if (!recreateSink)
+    {
+        m_sink->setBatchSize(m_config.sqlBatchSize());
+    }
+    else
+    {
+        // The spool segment in progress is kept, only the sink is replaced.
+        const bool open = m_sink->isOpen();
+        m_sink->close();
+        releaseHeldSegments(m_sink->isDurable());
+        m_sink = Sink::create(m_config, m_topics, m_router, m_metrics, m_index);
+        if (open && !m_sink->open())
+        {
+            logWarning(m_connectionName + " failed to reopen database after reload.");
+            m_nextReconnect = std::chrono::steady_clock::now() + m_backoff.next();
+        }
+    }
+    // The old sink is gone, so nothing of this writer uses the old router any more.
+    m_reloadsApplied.store(reloads, std::memory_order_release);
+}
+
+/**
+ * @brief Writer loop.
+ *
+ * Opens the sink right away, but waits with the first batch until the schema is ready.
+ * Collects messages from the queue until the batch holds sqlBatchSize() messages or the
+ * oldest message is older than sqlBatchTimeout(), then writes the batch. In between
+ * batches spooled messages are written, one batch at a time. When the queue is closed
+ * the remaining messages are written and the thread finishes.
+ *
+ * While the connection is lost the writer reconnects with jittered exponential backoff,
+ * the current batch is kept and written after the reconnect. The sink is maintained in
+ * every iteration, e.g. to rotate its files. A reloaded config is taken over between batches.
+ */
+void SqlWriter::run()
+{
+    if (!m_sink->open())
+    {
+        logError("Error: " + m_connectionName + " failed to open database.");
+        m_nextReconnect = std::chrono::steady_clock::now() + m_backoff.next();
+    }
+    // Messages received while the schema is created wait in the queue.
+    while (!m_schemaReady.load(std::memory_order_acquire) && !m_queue.isClosed())
+    {
+        m_queue.waitForClose(std::chrono::steady_clock::now() + std::chrono::milliseconds(5));
+    }
+    m_batch.reserve(m_config.sqlBatchSize());
+    m_spoolBatch.reserve(m_config.sqlBatchSize());
+
+    auto deadline = std::chrono::steady_clock::now() + m_config.sqlBatchTimeout();
+    MqttRecord record;
+    for (;;)
+    {
+        applyReload();
+        const bool closed = m_queue.isClosed();
+        if (!m_sink->isOpen())
+        {
+            if (closed)
+            {
+                spoolRemaining();
+                break;
+            }
+            if (std::chrono::steady_clock::now() < m_nextReconnect)
+            {
+                m_queue.waitForClose(m_nextReconnect);
+                continue;
+            }
+            if (!reconnect())
+            {
+                continue;
+            }
+        }
+        m_sink->maintain();
+        if (!m_heldSegments.isEmpty() && m_sink->isDurable())
+        {
+            releaseHeldSegments(true);
+        }
+
+        while (m_batch.size() < m_config.sqlBatchSize() && m_queue.tryPop(record))
+        {
+            if (m_batch.isEmpty())
+            {
+                deadline = std::chrono::steady_clock::now() + m_config.sqlBatchTimeout();
+            }
+            m_batch.append(std::move(record));
+        }
+
+        if (m_batch.size() >= m_config.sqlBatchSize()
+                || (!m_batch.isEmpty() && (closed || std::chrono::steady_clock::now() >= deadline)))
+        {
+            flush();
+            continue;
+        }
+        if (!closed && drainSpool())
+        {
+            continue;
+        }
+        if (closed && !m_queue.hasData())
+        {
+            break;
+        }
+        m_queue.waitForData(m_batch.isEmpty() ? std::chrono::steady_clock::now() + std::chrono::seconds(1) : deadline);
+    }
+
+    closeSink();
+}
+
+/**
+ * @brief Close and reopen the connection, on failure the next attempt is scheduled.
+ */
+bool SqlWriter::reconnect()
+{
+    closeSink();
+    if (m_sink->open())
+    {
+        logInfo(m_connectionName + " reconnected to database.");
+        m_backoff.reset();
+        return true;
+    }
+    const std::chrono::milliseconds delay = m_backoff.next();
+    logWarning(m_connectionName + " reconnecting in " + QString::number(delay.count()) + " ms.");
+    m_nextReconnect = std::chrono::steady_clock::now() + delay;
+    return false;
+}
+
+/**
+ * @brief Called on shutdown without connection, appends the current batch and all queued messages to the spool.
+ */
+void SqlWriter::spoolRemaining()
+{
+    int dropped = 0;
+    MqttRecord record;
+    while (m_queue.tryPop(record))
+    {
+        m_batch.append(std::move(record));
+    }
+    if (!m_spool || !m_spool->append(m_batch))
+    {
+        dropped = m_batch.size();
+    }
+    else
+    {
+        m_metrics->messagesSpooled.add(m_batch.size());
+    }
+    m_batch.clear();
+    if (dropped > 0)
+    {
+        m_metrics->messagesDropped.add(dropped);
+        Logger::instance().logLimited(LogLevel::Error, "no-database", "Error: " + m_connectionName + " has no database connection, messages dropped.");
+    }
+}
+
+void SqlWriter::closeSink()
+{
+    if (m_spool && m_spoolPosition >= 0)
+    {
+        m_spool->releaseSegment(m_spoolSegment, false);
+        m_spoolPosition = -1;
+    }
+    m_sink->close();
+    releaseHeldSegments(m_sink->isDurable());
+}
+
+/**
+ * @brief Hand the held spool segments back, deleted if \p written, otherwise to be written again.
+ */
+void SqlWriter::releaseHeldSegments(bool written)
+{
+    for (const MessageSpool::Segment & segment : std::as_const(m_heldSegments))
+    {
+        m_spool->releaseSegment(segment, written);
+    }
+    m_heldSegments.clear();
+}
+
+/**
+ * @brief Write the current batch.
+ *
+ * If the connection is lost the batch is appended to the spool, without spool it is kept
+ * and written again after the reconnect. A batch rejected by a working connection is dropped.
+ */
+void SqlWriter::flush()
+{
+    if (m_batch.isEmpty())
+    {
+        return;
+    }
+
+    if (!commitBatch(m_batch))
+    {
+        if (m_sink->isAlive())
+        {
+            m_metrics->messagesDropped.add(m_batch.size());
+            Logger::instance().logLimited(LogLevel::Error, "batch-rejected", "SQL error: batch rejected, " + QString::number(m_batch.size()) + " messages dropped.");
+        }
+        else
+        {
+            logWarning(m_connectionName + " lost database connection.");
+            closeSink();
+            m_nextReconnect = std::chrono::steady_clock::now() + m_backoff.next();
+            if (!m_spool)
+            {
+                return;
+            }
+            if (!m_spool->append(m_batch))
+            {
+                m_metrics->messagesDropped.add(m_batch.size());
+                Logger::instance().logLimited(LogLevel::Error, "spool", "Spool error: " + m_spool->lastError() + " Messages dropped.");
+            }
+            else
+            {
+                m_metrics->messagesSpooled.add(m_batch.size());
+            }
+        }
+    }
+    m_batch.clear();
+}
+
+/**
+ * @brief Write the next batch of spooled messages.
+ *
+ * Takes a segment from the spool if none is in progress and releases it once all
+ * its messages are written and the sink holds them durably, see Sink::isDurable. If the connection is lost the segment is handed back to the
+ * spool and will be written again later, so messages of a partly written segment can be
+ * stored twice. Returns true if a batch was written.
+ */
+bool SqlWriter::drainSpool()
+{
+    if (!m_spool || !m_sink->isOpen())
+    {
+        return false;
+    }
+    if (m_spoolPosition < 0)
+    {
+        if (!m_spool->hasData() || !m_spool->takeSegment(m_spoolSegment))
+        {
+            return false;
+        }
+        m_spoolPosition = 0;
+        if (m_router)
+        {
+            // The route is not spooled, the routes may have changed since. Windows keep the
+            // aggregate route, their topic is the one of the aggregated messages.
+            for (MqttRecord & record : m_spoolSegment.records)
+            {
+                record.route = record.aggregate ? m_config.aggregateRoute() : m_router->route(record.topic);
+            }
+        }
+    }
+
+    QVector<MqttRecord> & batch = m_spoolBatch;
+    const int batchSize = qMin(m_config.sqlBatchSize(), m_spoolSegment.records.size() - m_spoolPosition);
+    batch.clear();
+    std::copy(m_spoolSegment.records.cbegin() + m_spoolPosition, m_spoolSegment.records.cbegin() + m_spoolPosition + batchSize,
+              std::back_inserter(batch));
+    if (!commitBatch(batch))
+    {
+        if (m_sink->isAlive())
+        {
+            m_metrics->messagesDropped.add(batch.size());
+            Logger::instance().logLimited(LogLevel::Error, "batch-rejected", "SQL error: spooled batch rejected, " + QString::number(batch.size()) + " messages dropped.");
+        }
+        else
+        {
+            // Closing the connection hands the segment back to the spool.
+            logWarning(m_connectionName + " lost database connection.");
+            closeSink();
+            m_nextReconnect = std::chrono::steady_clock::now() + m_backoff.next();
+            return false;
+        }
+    }
+
+    m_spoolPosition += batchSize;
+    if (m_spoolPosition >= m_spoolSegment.records.size())
+    {
+        // Buffered rows are lost on a crash, the segment is deleted once the sink holds them durably.
+        m_spoolSegment.records.clear();
+        if (m_sink->isDurable())
+        {
+            m_spool->releaseSegment(m_spoolSegment, true);
+        }
+        else
+        {
+            m_heldSegments.append(m_spoolSegment);
+        }
+        m_spoolPosition = -1;
+    }
+    return true;
+}
+
+/**
+ * @brief Check the payloads of \p batch with \ref checkPayloads, write it to the sink and update the metrics.
+ */
+bool SqlWriter::commitBatch(QVector<MqttRecord> & batch)
+{
+    applyReload();
+    if (!m_sink->isOpen())
+    {
+        m_metrics->batchesFailed.add();
+        return false;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    checkPayloads(batch);
+    if (!batch.isEmpty() && !m_sink->write(batch))
+    {
+        m_metrics->batchesFailed.add();
+        return false;
+    }
+    const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    m_metrics->messagesInserted.add(batch.size());
+    m_metrics->batchSize.observe(batch.size());
+    m_metrics->commitSeconds.observe(elapsed.count());
+
+    const qint64 now = QDateTime::currentMSecsSinceEpoch();
+    for (const MqttRecord & record : std::as_const(batch))
+    {
+        m_metrics->lagSeconds.observe((now - record.ts) / 1000.0);
+    }
+    return true;
+}
+
+/**
+ * @brief Check the stored payloads of \p batch before writing.
+ *
+ * With classified payloads every payload is assigned its \ref PayloadType, otherwise the
+ * records whose payload is no valid JSON are removed, as PostgreSQL rejects the whole
+ * statement for a single invalid jsonb value. Compressed routes store any payload as bytea,
+ * their invalid JSON payloads are only marked as \ref PayloadType::Binary, so they are kept
+ * out of mqtt_latest. The payload is checked in place, it is not decoded.
+ */
+void SqlWriter::checkPayloads(QVector<MqttRecord> & batch)
+{
+    const auto storeData = [this](const MqttRecord & record) {
+        return record.route < 0 || m_router->at(record.route).storeData;
+    };
+    if (m_config.sqlClassifyPayloads())
+    {
+        for (MqttRecord & record : batch)
+        {
+            if (storeData(record))
+            {
+                record.payloadType = classifyPayload(record.payload, record.number);
+            }
+        }
+        return;
+    }
+
+    const auto invalid = [this, &storeData](MqttRecord & record) {
+        if (!storeData(record))
+        {
+            return false;
+        }
+        const bool valid = isValidJson(record.payload);
+        if (record.route >= 0 && m_router->at(record.route).compress)
+        {
+            record.payloadType = valid ? PayloadType::Json : PayloadType::Binary;
+            return false;
+        }
+        return !valid;
+    };
+    const auto end = std::remove_if(batch.begin(), batch.end(), invalid);
+    const int dropped = static_cast<int>(batch.end() - end);
+    if (dropped > 0)
+    {
+        batch.erase(end, batch.end());
+        m_metrics->messagesDropped.add(dropped);
+        Logger::instance().logLimited(LogLevel::Error, "invalid-json", QString("Error: %1 messages with invalid JSON payload dropped.").arg(dropped));
+    }
+}
@@ -0,0 +1,106 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef SQLWRITER_H
+#define SQLWRITER_H
+
+#include <QThread>
+#include <QVector>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+#include "boundedqueue.h"
+#include "exponentialbackoff.h"
+#include "messagespool.h"
+#include "metrics.h"
+#include "mqtt2sqlconfig.h"
+#include "mqttrecord.h"
+#include "sink.h"
+#include "topicdictionary.h"
+
+class MessageRouter;
+
+/// Queue between the MQTT thread and the \ref SqlWriter threads.
+using RecordQueue = BoundedQueue<MqttRecord>;
+
+/**
+ * @brief Writer thread that takes messages from the \ref RecordQueue and writes them in batches.
+ *
+ * Every writer owns its own \ref Sink, e.g. its own database connection, so several writers can
+ * write in parallel. Batching, spooling and reconnecting are the same for all sinks.
+ */
+class SqlWriter : public QThread
+{
+    Q_OBJECT
+public:
+    SqlWriter(const Mqtt2SqlConfig & config, RecordQueue & queue, MessageSpool * spool, TopicDictionary * topics,
+              const MessageRouter * router, MetricsShard * metrics, const std::atomic<bool> & schemaReady,
+              int index, QObject *parent = nullptr);
+    ~SqlWriter() override;
+
+    void reconfigure(const Mqtt2SqlConfig & config, const MessageRouter * router, bool recreateSink);
+    bool isReconfigured();
+
+protected:
+    void run() override;
+
+private:
+    void closeSink();
+    void releaseHeldSegments(bool written);
+    bool reconnect();
+    void spoolRemaining();
+    void flush();
+    bool drainSpool();
+    bool commitBatch(QVector<MqttRecord> & batch);
+    void checkPayloads(QVector<MqttRecord> & batch);
+    void applyReload();
+
+    Mqtt2SqlConfig m_config;
+    RecordQueue & m_queue;
+    MessageSpool * m_spool;
+    TopicDictionary * m_topics;
+    const MessageRouter * m_router;
+    MetricsShard * m_metrics;
+    int m_index;
+    /// Set once the schema exists, the writer opens its sink before but writes nothing until then.
+    const std::atomic<bool> & m_schemaReady;
+    std::unique_ptr<Sink> m_sink;
+    MessageSpool::Segment m_spoolSegment;
+    QVector<MqttRecord> m_spoolBatch;
+    int m_spoolPosition = -1;
+    /// Written spool segments whose rows the sink does not hold durably yet, without their records.
+    QVector<MessageSpool::Segment> m_heldSegments;
+    ExponentialBackoff m_backoff;
+    std::chrono::steady_clock::time_point m_nextReconnect;
+    QString m_connectionName;
+    QVector<MqttRecord> m_batch;
+    /// Config and router of a reload, taken over by the writer thread before its next batch.
+    std::mutex m_reloadMutex;
+    std::atomic<bool> m_reloadPending {false};
+    Mqtt2SqlConfig m_reloadConfig;
+    const MessageRouter * m_reloadRouter = nullptr;
+    bool m_reloadSink = false;
+    /// Reloads handed to the writer and taken over by it, the old router is unused once they are equal.
+    int m_reloadsRequested = 0;
+    std::atomic<int> m_reloadsApplied {0};
+};
+
+#endif // SQLWRITER_H
@@ -0,0 +1,59 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef TOPICDICTIONARY_H
+#define TOPICDICTIONARY_H
+
+#include <QHash>
+#include <QReadWriteLock>
+#include <QString>
+
+/**
+ * @brief Thread-safe cache of the topics table, mapping topic names to their id.
+ *
+ * Filled on startup and extended by the writers whenever they store a new topic.
+ */
+class TopicDictionary
+{
+public:
+    /// Returns the id of \p topic or -1 if the topic is not known yet.
+    int find(const QString & topic) const
+    {
+        QReadLocker locker(&m_lock);
+        return m_ids.value(topic, -1);
+    }
+
+    void insert(const QString & topic, int id)
+    {
+        QWriteLocker locker(&m_lock);
+        m_ids.insert(topic, id);
+    }
+
+    int size() const
+    {
+        QReadLocker locker(&m_lock);
+        return m_ids.size();
+    }
+
+private:
+    mutable QReadWriteLock m_lock;
+    QHash<QString, int> m_ids;
+};
+
+#endif // TOPICDICTIONARY_H
@@ -0,0 +1,139 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include "topicmatcher.h"
+
+#include <QHash>
+#include <QStringList>
+
+namespace {
+
+/// Keeps the lower of two values, -1 means no value.
+void keepLowest(int & best, int value)
+{
+    if (value >= 0 && (best < 0 || value < best))
+    {
+        best = value;
+    }
+}
+
+} // namespace
+
+TopicMatcher::TopicMatcher()
+{
+    m_nodes.append(Node());
+}
+
+/**
+ * @brief Add \p filter to the trie, topics matching it will return \p value.
+ */
+void TopicMatcher::addFilter(const QString & filter, int value)
+{
+    int node = 0;
+    const QStringList segments = filter.split(QLatin1Char('/'));
+    for (const QString & segment : segments)
+    {
+        if (segment == QLatin1String("#"))
+        {
+            keepLowest(m_nodes[node].hashValue, value);
+            ++m_filters;
+            return;
+        }
+        if (segment == QLatin1String("+"))
+        {
+            if (m_nodes[node].plusChild < 0)
+            {
+                m_nodes.append(Node());
+                m_nodes[node].plusChild = m_nodes.size() - 1;
+            }
+            node = m_nodes[node].plusChild;
+            continue;
+        }
+        int next = child(node, segment);
+        if (next < 0)
+        {
+            Node newNode;
+            newNode.segment = segment;
+            m_nodes.append(newNode);
+            next = m_nodes.size() - 1;
+            m_nodes[node].children.insert(qHash(QStringView(segment)), next);
+        }
+        node = next;
+    }
+    keepLowest(m_nodes[node].value, value);
+    ++m_filters;
+}
+
+/**
+ * @brief Returns the lowest value of all filters matching \p topic, or -1 if none matches.
+ */
+int TopicMatcher::match(QStringView topic) const
+{
+    int best = -1;
+    matchNode(0, topic, 0, best);
+    return best;
+}
+
+int TopicMatcher::child(int node, QStringView segment) const
+{
+    const QMultiHash<size_t, int> & children = m_nodes.at(node).children;
+    const size_t hash = qHash(segment);
+    for (auto it = children.constFind(hash); it != children.constEnd() && it.key() == hash; ++it)
+    {
+        if (QStringView(m_nodes.at(it.value()).segment) == segment)
+        {
+            return it.value();
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief Match the topic levels starting at \p pos against the subtree of \p node, pos is -1 after the last level.
+ */
+void TopicMatcher::matchNode(int node, QStringView topic, qsizetype pos, int & best) const
+{
+    const Node & n = m_nodes.at(node);
+    const bool systemTopic = node == 0 && topic.startsWith(QLatin1Char('$'));
+
+    // "a/#" also matches "a", so the # value applies before and after the last level.
+    if (!systemTopic)
+    {
+        keepLowest(best, n.hashValue);
+    }
+    if (pos < 0)
+    {
+        keepLowest(best, n.value);
+        return;
+    }
+
+    const qsizetype end = topic.indexOf(QLatin1Char('/'), pos);
+    const QStringView segment = topic.mid(pos, (end < 0 ? topic.size() : end) - pos);
+    const qsizetype next = end < 0 ? -1 : end + 1;
+
+    const int exact = child(node, segment);
+    if (exact >= 0)
+    {
+        matchNode(exact, topic, next, best);
+    }
+    if (n.plusChild >= 0 && !systemTopic)
+    {
+        matchNode(n.plusChild, topic, next, best);
+    }
+}
@@ -0,0 +1,65 @@
+/*
+    QMQTT2SQL subscribes to a MQTT broker and stores all messages in a PostgreSQL database.
+    Copyright (C) 2024  Thomas Zimmermann
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#ifndef TOPICMATCHER_H
+#define TOPICMATCHER_H
+
+#include <QMultiHash>
+#include <QString>
+#include <QStringView>
+#include <QVector>
+
+/**
+ * @brief Trie of MQTT topic filters, built once and matched against every received topic.
+ *
+ * Every filter is added with a value, \ref match returns the lowest value of all matching
+ * filters. Matching walks the topic levels without allocating, the + and # wildcards
+ * follow the MQTT rules, including that topics starting with $ are not matched by
+ * wildcards on the first level.
+ */
+class TopicMatcher
+{
+public:
+    TopicMatcher();
+
+    void addFilter(const QString & filter, int value);
+    int match(QStringView topic) const;
+    bool isEmpty() const { return m_filters == 0; }
+
+private:
+    struct Node
+    {
+        QString segment;
+        /// Children by hash of their segment.
+        QMultiHash<size_t, int> children;
+        int plusChild = -1;
+        /// Value of a filter ending in this node.
+        int value = -1;
+        /// Value of a filter ending with # after this node.
+        int hashValue = -1;
+    };
+
+    int child(int node, QStringView segment) const;
+    void matchNode(int node, QStringView topic, qsizetype pos, int & best) const;
+
+    QVector<Node> m_nodes;
+    int m_filters = 0;
+};
+
+#endif // TOPICMATCHER_H